@@ -199,13 +199,53 @@ struct addr_info *addrmask_init(const char *addressmask)
   return result;
 }
 
+/* common part of the matchers, addr_bytes is the network part of a subnet */
+/* returns the first entry in list order that covers the subnet */
+static struct addr_info *addrmask_match_bytes(struct addr_info *matches, unsigned short int addr_family, const unsigned char *addr_bytes, unsigned char mask_shift)
+{
+  const unsigned char *mp;
+  const unsigned char *np;
+  const unsigned char *ap;
+  struct addr_info *entry;
+
+  for (entry = matches; entry; entry = entry->next) {
+    if (entry->addr_family != addr_family)
+      continue;
+
+    /* a subnet larger than entry can not be covered by it, but an */
+    /* entry further down the list may still cover it */
+    if (mask_shift < entry->mask_shift)
+      continue;
+
+    /* Unoptimized case: netmask with some or all bits zero. */
+    if (entry->mask_shift < entry->addr_bit_count) {
+      for (np = entry->net_bytes, mp = entry->mask_bytes,
+          ap = addr_bytes; /* void */ ; np++, mp++, ap++) {
+        if (ap >= addr_bytes + entry->addr_byte_count)
+          return entry;
+        if ((*ap & *mp) != *np)
+          break;
+      }
+    }
+      
+    /* Optimized case: all 1 netmask (i.e. no netmask specified). */
+    else {
+      for (np = entry->net_bytes,
+          ap = addr_bytes; /* void */ ; np++, ap++) {
+        if (ap >= addr_bytes + entry->addr_byte_count)
+          return entry;
+        if (*ap != *np)
+          break;
+      }
+    }
+  }
+  
+  return NULL;
+}
+
 struct addr_info *addrmask_match(struct addr_info *matches, const char *addr)
 {
   struct addr_info info;
-  unsigned char *mp;
-  unsigned char *np;
-  unsigned char *ap;
-  struct addr_info *entry;
 
   if (!matches || !addr)
     return NULL;
@@ -213,41 +253,222 @@ struct addr_info *addrmask_match(struct addr_info *matches, const char *addr)
   if (!addrmask_parse(&info, addr))
     return NULL;
 
-  for (entry = matches; entry; entry = entry->next) {
-    if (entry->addr_family == info.addr_family) {
-      /* Unoptimized case: netmask with some or all bits zero. */
-      if (entry->mask_shift < entry->addr_bit_count) {
-        for (np = entry->net_bytes, mp = entry->mask_bytes,
-            ap = info.net_bytes; /* void */ ; np++, mp++, ap++) {
-          if (ap >= info.net_bytes + entry->addr_byte_count)
-            goto found;
-          if ((*ap & *mp) != *np)
-            break;
-        }
-      }
-      
-      /* Optimized case: all 1 netmask (i.e. no netmask specified). */
-      else {
-        for (np = entry->net_bytes,
-            ap = info.net_bytes; /* void */ ; np++, ap++) {
-          if (ap >= info.net_bytes + entry->addr_byte_count)
-            goto found;
-          if (*ap != *np)
-            break;
+  return addrmask_match_bytes(matches, info.addr_family, info.net_bytes, info.mask_shift);
+}
+
+struct addr_info *addrmask_match_subnet(struct addr_info *matches, const struct addr_subnet *subnet)
+{
+  if (!matches || !subnet)
+    return NULL;
+
+  return addrmask_match_bytes(matches, subnet->addr_family, subnet->net_bytes, subnet->mask_shift);
+}
+
+bool addrmask_parse_subnet(struct addr_subnet *subnet, const char *text)
+{
+  struct addr_info info;
+  const char *weight;
+  char address[INET6_ADDRSTRLEN + 8];
+  size_t length;
+
+  memset(subnet, 0, sizeof(struct addr_subnet));
+  subnet->weight = -1;
+
+  weight = strchr(text, '#');
+  length = weight ? (size_t)(weight - text) : strlen(text);
+  if (length >= sizeof(address))
+    return false;
+  memcpy(address, text, length);
+  address[length] = 0;
+
+  if (weight) {
+    weight++;
+    if (!*weight || !str_alldig(weight))
+      return false;
+    subnet->weight = atoi(weight);
+  }
+
+  if (!addrmask_parse(&info, address))
+    return false;
+
+  memcpy(subnet->net_bytes, info.net_bytes, info.addr_byte_count);
+  subnet->addr_family = info.addr_family;
+  subnet->mask_shift = info.mask_shift;
+  subnet->address_length = length;
+  return true;
+}
+
+/*
+
+addrmask_trie: path compressed binary trie (patricia) over the prefixes
+of an addr_info list, one per address family. Every node holds a prefix,
+nodes with an entry are prefixes from the list, the others only branch.
+
+*/
+
+struct addrmask_trie_node {
+  unsigned char key[ADDR_MAX_BYTES];	/* prefix, bits beyond keylen are 0 */
+  unsigned char keylen;
+  struct addr_info *entry;		/* NULL for branch-only nodes */
+  struct addrmask_trie_node *child[2];
+};
+
+static inline int addrmask_trie_bit(const unsigned char *key, unsigned int bit)
+{
+  return (key[bit / CHAR_BIT] >> (CHAR_BIT - 1 - bit % CHAR_BIT)) & 1;
+}
+
+/* number of leading bits a and b have in common, at most maxbits */
+static unsigned int addrmask_trie_common(const unsigned char *a, const unsigned char *b, unsigned int maxbits)
+{
+  unsigned int bits = 0;
+  unsigned char diff;
+
+  while ((bits < maxbits) && (a[bits / CHAR_BIT] == b[bits / CHAR_BIT]))
+    bits += CHAR_BIT;
+  if (bits < maxbits) {
+    diff = a[bits / CHAR_BIT] ^ b[bits / CHAR_BIT];
+    while (!(diff & 0x80)) {
+      diff <<= 1;
+      bits++;
+    }
+  }
+  return bits < maxbits ? bits : maxbits;
+}
+
+static struct addrmask_trie_node *addrmask_trie_newnode(const unsigned char *key, unsigned int keylen, struct addr_info *entry)
+{
+  struct addrmask_trie_node *node;
+
+  node = malloc(sizeof(struct addrmask_trie_node));
+  if (!node)
+    return NULL;
+  memset(node, 0, sizeof(struct addrmask_trie_node));
+  memcpy(node->key, key, (keylen + CHAR_BIT - 1) / CHAR_BIT);
+  mask_addr(node->key, ADDR_MAX_BYTES, keylen);
+  node->keylen = keylen;
+  node->entry = entry;
+  return node;
+}
+
+static bool addrmask_trie_insert(struct addrmask_trie_node **link, struct addr_info *entry)
+{
+  const unsigned char *key = entry->net_bytes;
+  unsigned int keylen = entry->mask_shift;
+  struct addrmask_trie_node *node;
+  struct addrmask_trie_node *branch;
+  unsigned int common;
+
+  while ((node = *link)) {
+    common = addrmask_trie_common(key, node->key,
+      keylen < node->keylen ? keylen : node->keylen);
+
+    if (common < node->keylen) {
+      /* key diverges from or ends inside the prefix of node, split */
+      if (common == keylen) {
+        branch = addrmask_trie_newnode(key, keylen, entry);
+        if (!branch)
+          return false;
+      } else {
+        branch = addrmask_trie_newnode(key, common, NULL);
+        if (!branch)
+          return false;
+        branch->child[addrmask_trie_bit(key, common)] =
+          addrmask_trie_newnode(key, keylen, entry);
+        if (!branch->child[addrmask_trie_bit(key, common)]) {
+          free(branch);
+          return false;
         }
       }
+      branch->child[addrmask_trie_bit(node->key, common)] = node;
+      *link = branch;
+      return true;
+    }
+
+    if (node->keylen == keylen) {
+      /* same prefix again, the first one wins like in list order */
+      if (!node->entry)
+        node->entry = entry;
+      return true;
     }
+
+    link = &node->child[addrmask_trie_bit(key, node->keylen)];
   }
-  
-  return NULL;
 
-found:
-  /* Address matches, now check for subnet size */
-  
-  if (info.mask_shift < entry->mask_shift)
-    return NULL;
-  
-  return entry;
+  *link = addrmask_trie_newnode(key, keylen, entry);
+  return *link != NULL;
+}
+
+static void addrmask_trie_freenode(struct addrmask_trie_node *node)
+{
+  if (!node)
+    return;
+  addrmask_trie_freenode(node->child[0]);
+  addrmask_trie_freenode(node->child[1]);
+  free(node);
+}
+
+bool addrmask_trie_build(struct addrmask_trie *trie, struct addr_info *list)
+{
+  struct addr_info *entry;
+
+  memset(trie, 0, sizeof(struct addrmask_trie));
+
+  for (entry = list; entry; entry = entry->next) {
+    if (!addrmask_trie_insert(entry->addr_family == AF_INET6 ?
+        &trie->root6 : &trie->root4, entry)) {
+      addrmask_trie_free(trie);
+      return false;
+    }
+    trie->count++;
+  }
+  return true;
+}
+
+void addrmask_trie_free(struct addrmask_trie *trie)
+{
+  addrmask_trie_freenode(trie->root4);
+  addrmask_trie_freenode(trie->root6);
+  memset(trie, 0, sizeof(struct addrmask_trie));
+}
+
+/*
+ * Walks down the path of the subnet, every node with an entry on the way
+ * covers it. Returns the longest (most specific) or the shortest
+ * covering prefix, or NULL.
+ */
+static struct addr_info *addrmask_trie_lookup(const struct addrmask_trie *trie, unsigned short int addr_family, const unsigned char *addr_bytes, unsigned int mask_shift, bool longest)
+{
+  struct addrmask_trie_node *node;
+  struct addr_info *found = NULL;
+
+  node = addr_family == AF_INET6 ? trie->root6 :
+    addr_family == AF_INET ? trie->root4 : NULL;
+
+  while (node && (node->keylen <= mask_shift)) {
+    if (addrmask_trie_common(addr_bytes, node->key, node->keylen) < node->keylen)
+      break;
+    if (node->entry) {
+      found = node->entry;
+      if (!longest)
+        break;
+    }
+    if (node->keylen == mask_shift)
+      break;
+    node = node->child[addrmask_trie_bit(addr_bytes, node->keylen)];
+  }
+
+  return found;
+}
+
+struct addr_info *addrmask_trie_match(const struct addrmask_trie *trie, const struct addr_subnet *subnet)
+{
+  return addrmask_trie_lookup(trie, subnet->addr_family, subnet->net_bytes, subnet->mask_shift, true);
+}
+
+struct addr_info *addrmask_trie_covering(const struct addrmask_trie *trie, const struct addr_subnet *subnet)
+{
+  return addrmask_trie_lookup(trie, subnet->addr_family, subnet->net_bytes, subnet->mask_shift, false);
 }
 
 bool addrmask_to_string(struct string *target, struct addr_info *addr)
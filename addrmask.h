@@ -25,6 +25,17 @@ struct addr_info {
   struct addr_info *next;			/* next entry */
 };
 
+/* parsed subnet as stored per peer, without mask bytes and list pointer */
+struct addr_subnet {
+  unsigned char net_bytes[ADDR_MAX_BYTES];	/* network portion */
+  unsigned short int addr_family;		/* AF_XXX */
+  unsigned char mask_shift;			/* prefix length */
+  int weight;					/* from subnet#weight, -1 if none */
+  size_t address_length;			/* length of text before '#' */
+  const char *text;				/* as received, for output */
+  const char *address;				/* text without #weight */
+};
+
 /* free a struct addr_info */
 extern void addrmask_free(struct addr_info *addrinfo);
 
@@ -38,6 +49,32 @@ extern struct addr_info *addrmask_init(const char *addressmask);
 /* returns matching entry from struct addr_info linked list or NULL */
 extern struct addr_info *addrmask_match(struct addr_info *matches, const char *addr);
 
+/* matches a parsed subnet against a struct addr_info, without parsing */
+extern struct addr_info *addrmask_match_subnet(struct addr_info *matches, const struct addr_subnet *subnet);
+
+/* parse string containing ip/mask#weight into struct addr_subnet */
+/* text and address are left to the caller, which owns the text */
+extern bool addrmask_parse_subnet(struct addr_subnet *subnet, const char *text);
+
+/* prefix trie over a struct addr_info list, see addrmask_trie_build() */
+struct addrmask_trie_node;
+
+struct addrmask_trie {
+  struct addrmask_trie_node *root4;
+  struct addrmask_trie_node *root6;
+  unsigned int count;
+};
+
+/* index all entries of list, the list has to outlive the trie */
+extern bool addrmask_trie_build(struct addrmask_trie *trie, struct addr_info *list);
+extern void addrmask_trie_free(struct addrmask_trie *trie);
+
+/* longest prefix from the trie that covers subnet, or NULL */
+extern struct addr_info *addrmask_trie_match(const struct addrmask_trie *trie, const struct addr_subnet *subnet);
+
+/* shortest prefix from the trie that covers subnet, or NULL */
+extern struct addr_info *addrmask_trie_covering(const struct addrmask_trie *trie, const struct addr_subnet *subnet);
+
 /* convert struct addr_info back to a string */
 extern bool addrmask_to_string(struct string *target, struct addr_info *addr);
 
@@ -1,6 +1,16 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #include "ar.h"
 
@@ -81,15 +91,18 @@ ar_is_ar_file(struct string *archive)
   return true;
 }
 
+/* locate membername in archive without copying it */
+/* result points into the archive buffer and is only valid as long as */
+/* the archive is neither modified nor freed */
 bool
-ar_extract(struct string *archive, char *membername, struct string *result)
+ar_extract_view(struct string *archive, char *membername, struct string_view *result)
 {
   ssize_t len;
   char *pos;
   struct ar_hdr *arh;
   ssize_t memberlen;
 
-  string_free(result); // clear result buffer at the start
+  string_view_init(result, NULL, 0);
 
   len = string_length(archive);
   if (len < SARMAG) {
@@ -126,33 +139,323 @@ ar_extract(struct string *archive, char *membername, struct string *result)
       return false;
     }
     
-    if (memberlen+(memberlen&1) > len) {
+    if (memberlen > len) {
       log_warn("ar_extract: buffer corrupt - header length bigger than rest of buffer\n");
       return false;
     }
     
     if (ar_compare_name(arh->ar_name, sizeof(arh->ar_name), membername)) {
       // found!
-      if (!string_concatb(result, pos, memberlen)) {
-        log_warn("ar_extract: extract copy failed\n");
-        return false;
-      }
-
+      string_view_init(result, pos, memberlen);
       return true;
     }
 
+    /* members are padded to even length, the last padding byte is optional */
+    if (memberlen+(memberlen&1) >= len) {
+      // finished, but not found
+      return false;
+    }
+
     pos += memberlen+(memberlen&1);
     len -= memberlen+(memberlen&1);
+  }
+}
 
-    if (len == 0) {
-      // finished, but not found
-      return 1;
-    } else if (len < 0) {
-      // should not happen
-      log_warn("ar_extract: buffer corrupt - buffer too short\n");
+bool
+ar_extract(struct string *archive, char *membername, struct string *result)
+{
+  struct string_view member;
+
+  string_free(result); // clear result buffer at the start
+
+  if (!ar_extract_view(archive, membername, &member)) {
+    return false;
+  }
+
+  if (!string_concatb(result, member.s, member.length)) {
+    log_warn("ar_extract: extract copy failed\n");
+    return false;
+  }
+
+  return true;
+}
+
+/*
+
+ar_index: all member headers parsed and validated once, lookups by name
+are hashed and return views into the archive buffer
+
+*/
+
+static uint32_t
+ar_index_hash(const char *name, size_t len)
+{
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+
+  while (len--) {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* member name without padding and the optional trailing '/' */
+static bool
+ar_index_parse_name(const char *inh, size_t len, struct string_view *name)
+{
+  if (memchr(inh, 0, len)) {
+    log_warn("ar_index: header name contains zero-bytes\n");
+    return false;
+  }
+
+  string_view_init(name, inh, len);
+  while (name->length && (name->s[name->length-1] == ' ')) {
+    name->length--;
+  }
+  if (name->length && (name->s[name->length-1] == '/')) {
+    name->length--;
+  }
+  if (!name->length) {
+    log_warn("ar_index: member without name\n");
+    return false;
+  }
+  return true;
+}
+
+static bool
+ar_index_add(struct ar_index *index, struct string_view *name, const char *data, size_t length)
+{
+  struct ar_index_member *members;
+  unsigned int alloc;
+
+  if (index->count == index->alloc) {
+    alloc = index->alloc ? index->alloc * 2 : 8;
+    members = realloc(index->members, alloc * sizeof(struct ar_index_member));
+    if (members == NULL) {
+      log_err("ar_index: malloc error\n");
       return false;
     }
+    index->members = members;
+    index->alloc = alloc;
+  }
+
+  index->members[index->count].name = *name;
+  index->members[index->count].hash = ar_index_hash(name->s, name->length);
+  string_view_init(&index->members[index->count].data, data, length);
+  index->count++;
+
+  return true;
+}
+
+static bool
+ar_index_build_slots(struct ar_index *index)
+{
+  unsigned int size;
+  unsigned int i;
+  unsigned int slot;
+  struct ar_index_member *m;
+
+  /* keep the table at most half full */
+  for (size = 8; size < index->count * 2; size *= 2);
+
+  index->slots = calloc(size, sizeof(unsigned int));
+  if (index->slots == NULL) {
+    log_err("ar_index: malloc error\n");
+    return false;
+  }
+  index->slotmask = size - 1;
+
+  for (i = 0; i < index->count; i++) {
+    m = &index->members[i];
+    for (slot = m->hash & index->slotmask; index->slots[slot];
+         slot = (slot + 1) & index->slotmask) {
+      if (string_view_equals(&index->members[index->slots[slot]-1].name, &m->name)) {
+        /* duplicate name, the first member wins like in ar_extract() */
+        break;
+      }
+    }
+    if (!index->slots[slot]) {
+      index->slots[slot] = i + 1;
+    }
+  }
+
+  return true;
+}
+
+/* parse and validate all member headers of buf */
+/* buf has to stay valid and unmodified while the index is in use */
+bool
+ar_index_build(struct ar_index *index, const char *buf, size_t len)
+{
+  const char *pos;
+  const struct ar_hdr *arh;
+  ssize_t memberlen;
+  struct string_view name;
+
+  memset(index, 0, sizeof(struct ar_index));
+
+  if ((len < SARMAG) || (strncmp(buf, ARMAG, SARMAG) != 0)) {
+    log_warn("ar_index: no .ar header at the beginning\n");
+    return false;
+  }
+  pos = buf + SARMAG;
+  len -= SARMAG;
+
+  while (len > 0) {
+    if (len < sizeof(struct ar_hdr)) {
+      log_warn("ar_index: buffer corrupt - truncated header\n");
+      goto bail_out;
+    }
+    arh = (const struct ar_hdr *)pos;
+    pos += sizeof(struct ar_hdr);
+    len -= sizeof(struct ar_hdr);
+
+    if (memcmp(arh->ar_fmag, ARFMAG, sizeof(arh->ar_fmag))) {
+      log_warn("ar_index: buffer corrupt - bad magic at end of header\n");
+      goto bail_out;
+    }
+
+    memberlen = ar_parseheaderlength(arh->ar_size, sizeof(arh->ar_size));
+    if (memberlen < 0) {
+      log_warn("ar_index: buffer corrupt - invalid length field in header\n");
+      goto bail_out;
+    }
+    if (memberlen > len) {
+      log_warn("ar_index: buffer corrupt - header length bigger than rest of buffer\n");
+      goto bail_out;
+    }
+
+    if (!ar_index_parse_name(arh->ar_name, sizeof(arh->ar_name), &name)) {
+      goto bail_out;
+    }
+    if (!ar_index_add(index, &name, pos, memberlen)) {
+      goto bail_out;
+    }
+
+    /* members are padded to even length, the last padding byte is optional */
+    if (memberlen+(memberlen&1) >= len) {
+      break;
+    }
+    pos += memberlen+(memberlen&1);
+    len -= memberlen+(memberlen&1);
+  }
+
+  if (!ar_index_build_slots(index)) {
+    goto bail_out;
+  }
+
+  return true;
+
+bail_out:
+  ar_index_free(index);
+  return false;
+}
+
+/* index an archive on disk, the file is mapped instead of read */
+bool
+ar_index_open_file(struct ar_index *index, const char *filename)
+{
+#ifndef WIN32
+  int fd;
+  struct stat st;
+  void *map;
+
+  memset(index, 0, sizeof(struct ar_index));
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    log_warn("ar_index: open %s failed: %s\n", filename, strerror(errno));
+    return false;
+  }
+  if (fstat(fd, &st) != 0) {
+    log_warn("ar_index: stat %s failed: %s\n", filename, strerror(errno));
+    close(fd);
+    return false;
+  }
+  if (st.st_size < SARMAG) {
+    log_warn("ar_index: %s too short\n", filename);
+    close(fd);
+    return false;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    log_warn("ar_index: mmap %s failed: %s\n", filename, strerror(errno));
+    return false;
+  }
+
+  if (!ar_index_build(index, map, st.st_size)) {
+    munmap(map, st.st_size);
+    return false;
+  }
+  index->map = map;
+  index->maplength = st.st_size;
+
+  return true;
+#else
+  struct string archive;
+
+  memset(index, 0, sizeof(struct ar_index));
+
+  string_init(&archive, 8192, STRING_GROWBY_DOUBLE);
+  if (!fs_read_file(&archive, (char *)filename)) {
+    string_free(&archive);
+    return false;
+  }
+  if (!ar_index_build(index, string_get(&archive), string_length(&archive))) {
+    string_free(&archive);
+    return false;
+  }
+  /* the index owns the buffer now */
+  index->map = string_get(&archive);
+  index->maplength = string_length(&archive);
+
+  return true;
+#endif
+}
+
+bool
+ar_index_lookup(struct ar_index *index, const char *membername, struct string_view *result)
+{
+  size_t len = strlen(membername);
+  uint32_t hash = ar_index_hash(membername, len);
+  unsigned int slot;
+  struct ar_index_member *m;
+
+  string_view_init(result, NULL, 0);
+
+  if (index->slots == NULL) {
+    return false;
+  }
+
+  for (slot = hash & index->slotmask; index->slots[slot];
+       slot = (slot + 1) & index->slotmask) {
+    m = &index->members[index->slots[slot]-1];
+    if ((m->hash == hash) && (m->name.length == len) &&
+        (memcmp(m->name.s, membername, len) == 0)) {
+      *result = m->data;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+ar_index_free(struct ar_index *index)
+{
+  free(index->members);
+  free(index->slots);
+  if (index->map != NULL) {
+#ifndef WIN32
+    munmap(index->map, index->maplength);
+#else
+    free(index->map);
+#endif
   }
+  memset(index, 0, sizeof(struct ar_index));
 }
 
 /* test program
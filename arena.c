@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "chaosvpn.h"
+
+/*
+
+simple bump allocator
+
+everything allocated from an arena is released together by arena_free(),
+there is no way to free single allocations. used for data with a common
+lifetime, e.g. everything produced by one parser_parse_config() run.
+
+*/
+
+/* alignment of every allocation, enough for pointers and long long */
+#define ARENA_ALIGN (2 * sizeof(void *))
+
+/* blocks never grow beyond this, unless a single allocation needs it */
+#define ARENA_MAX_BLOCKSIZE (1024 * 1024)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	/* data follows, aligned to ARENA_ALIGN */
+};
+
+#define ARENA_HEADERSIZE \
+	((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+void
+arena_init(struct arena *arena, size_t blocksize)
+{
+	memset(arena, 0, sizeof(struct arena));
+	arena->blocksize = blocksize;
+}
+
+static struct arena_block *
+arena_newblock(struct arena *arena, size_t minsize)
+{
+	struct arena_block *block;
+	size_t size;
+
+	/* grow blocksize geometrically to keep the number of blocks small */
+	size = arena->blocksize;
+	if (arena->blocks != NULL) {
+		size = arena->blocks->size * 2;
+		if (size > ARENA_MAX_BLOCKSIZE)
+			size = ARENA_MAX_BLOCKSIZE;
+	}
+	if (size < minsize)
+		size = minsize;
+
+	block = malloc(ARENA_HEADERSIZE + size);
+	if (block == NULL)
+		return NULL;
+
+	block->size = size;
+	block->used = 0;
+	block->next = arena->blocks;
+	arena->blocks = block;
+
+	arena->stat_mallocs++;
+	return block;
+}
+
+/* returns uninitialized, aligned memory owned by the arena */
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_block *block;
+	void *result;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	block = arena->blocks;
+	if ((block == NULL) || (block->size - block->used < size)) {
+		block = arena_newblock(arena, size);
+		if (block == NULL)
+			return NULL;
+	}
+
+	result = (char *)block + ARENA_HEADERSIZE + block->used;
+	block->used += size;
+
+	arena->stat_allocs++;
+	arena->stat_bytes += size;
+	return result;
+}
+
+char *
+arena_strndup(struct arena *arena, const char *s, size_t len)
+{
+	char *result;
+
+	result = arena_alloc(arena, len + 1);
+	if (result == NULL)
+		return NULL;
+	memcpy(result, s, len);
+	result[len] = '\0';
+	return result;
+}
+
+char *
+arena_strdup(struct arena *arena, const char *s)
+{
+	return arena_strndup(arena, s, strlen(s));
+}
+
+/* releases all memory of the arena at once, it can be reused afterwards */
+void
+arena_free(struct arena *arena)
+{
+	struct arena_block *block;
+	struct arena_block *next;
+
+	for (block = arena->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	arena->blocks = NULL;
+	arena->stat_mallocs = 0;
+	arena->stat_allocs = 0;
+	arena->stat_bytes = 0;
+}
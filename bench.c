@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "bench.h"
+
+double
+bench_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * A config that looks like the real one: a few settings and a
+ * multi-line RSA key per peer. The keys are random but the same on
+ * every call.
+ */
+unsigned int
+bench_make_config(struct string *config, unsigned int peers)
+{
+	static const char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned int lines = 0;
+	unsigned int rnd = 0x12345678;
+	unsigned int i;
+	int l;
+	int c;
+
+	for (i = 0; i < peers; i++) {
+		string_concat_sprintf(config,
+			"[peer%u]\n"
+			"gatewayhost=gw%u.example.net\n"
+			"owner=someone%u@example.net\n"
+			"network=10.%u.%u.0/24\n"
+			"network6=fd00:%x::/64\n"
+			"route_network=172.16.%u.0/24\n"
+			"port=%u\n"
+			"use-tcp-only=%d\n"
+			"indirectdata=0\n"
+			"hidden=0\n"
+			"silent=0\n"
+			"-----BEGIN RSA PUBLIC KEY-----\n",
+			i, i, i, (i >> 8) & 255, i & 255, i, i & 255,
+			4000 + (i % 1000), (i % 7) == 0);
+		lines += 12;
+
+		/* 2048 bit key: 5 full lines of base64 and one with padding */
+		for (l = 0; l < 6; l++) {
+			for (c = 0; c < (l < 5 ? 64 : 38); c++) {
+				rnd = rnd * 1103515245 + 12345;
+				string_putc(config, b64[(rnd >> 16) & 63]);
+			}
+			if (l == 5) {
+				string_concat(config, "==");
+			}
+			string_putc(config, '\n');
+		}
+		string_concat(config, "-----END RSA PUBLIC KEY-----\n\n");
+		lines += 8;
+	}
+
+	return lines;
+}
@@ -0,0 +1,14 @@
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include "string/string.h"
+
+/* helpers shared by the bench_* and test_* programs, see bench.c */
+
+/* wall clock in seconds */
+extern double bench_now(void);
+
+/* appends a synthetic network of peers to config, returns its lines */
+extern unsigned int bench_make_config(struct string *config, unsigned int peers);
+
+#endif
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chaosvpn.h"
+#include "bench.h"
+
+#include <openssl/rsa.h>
+#include <openssl/evp.h>
+
+/*
+ * Measures the key handling part of an update cycle: rsa decrypt of the
+ * session key block and verification of a signature, once with the PEM
+ * keys parsed on every cycle and once with the cached keys.
+ *
+ * usage: bench_crypto <privkey.pem> <pubkey.pem> [iterations]
+ *
+ * keys can be created using:
+ *   openssl genrsa -out privkey.pem 4096
+ *   openssl rsa -in privkey.pem -pubout -out pubkey.pem
+ */
+
+static struct string privpem;
+static struct string pubpem;
+static struct string ciphertext;
+static struct string signature;
+static const char payload[] = "chaosvpn benchmark payload";
+
+static bool
+bench_setup(void)
+{
+	EVP_PKEY *priv;
+	EVP_PKEY *pub;
+	RSA *rsa;
+	EVP_MD_CTX *md_ctx;
+	unsigned int siglen;
+	int len;
+	unsigned char block[50];
+
+	priv = crypto_load_key(string_get(&privpem), true);
+	pub = crypto_load_key(string_get(&pubpem), false);
+	if ((priv == NULL) || (pub == NULL)) {
+		return false;
+	}
+
+	/* same layout as the rsa member: key length, iv length, key, iv */
+	memset(block, 0x42, sizeof(block));
+	block[0] = 32;
+	block[1] = 16;
+	string_init(&ciphertext, EVP_PKEY_size(pub), 512);
+	rsa = EVP_PKEY_get1_RSA(pub);
+	len = RSA_public_encrypt(sizeof(block), block,
+		(unsigned char *)string_get(&ciphertext),
+		rsa, RSA_PKCS1_OAEP_PADDING);
+	RSA_free(rsa);
+	if (len < 0) {
+		return false;
+	}
+	ciphertext.length = len;
+
+	string_init(&signature, EVP_PKEY_size(priv), 512);
+	md_ctx = EVP_MD_CTX_create();
+	EVP_SignInit(md_ctx, EVP_sha512());
+	EVP_SignUpdate(md_ctx, payload, strlen(payload));
+	if (EVP_SignFinal(md_ctx, (unsigned char *)string_get(&signature), &siglen, priv) != 1) {
+		return false;
+	}
+	signature.length = siglen;
+	EVP_MD_CTX_destroy(md_ctx);
+
+	EVP_PKEY_free(priv);
+	EVP_PKEY_free(pub);
+	return true;
+}
+
+static bool
+bench_cycle(bool cached)
+{
+	struct string_view ct;
+	struct string decrypted;
+	struct crypto_verify verify;
+	bool res;
+
+	string_view_fromstring(&ct, &ciphertext);
+	string_lazyinit(&decrypted, 512);
+
+	if (cached) {
+		res = crypto_rsa_decrypt_key(&ct, crypto_cached_private_key(), &decrypted) &&
+			crypto_verify_init_key(&verify, crypto_cached_public_key());
+	} else {
+		res = crypto_rsa_decrypt(&ct, string_get(&privpem), &decrypted) &&
+			crypto_verify_init(&verify, string_get(&pubpem));
+	}
+	string_free(&decrypted);
+	if (!res) {
+		return false;
+	}
+
+	res = crypto_verify_update(&verify, payload, strlen(payload)) &&
+		crypto_verify_final(&verify, &signature);
+	crypto_verify_free(&verify);
+
+	return res;
+}
+
+static void
+bench_run(const char *name, bool cached, int iterations)
+{
+	double start;
+	double elapsed;
+	int i;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if (!bench_cycle(cached)) {
+			log_err("%s: cycle %d failed\n", name, i);
+			exit(1);
+		}
+	}
+	elapsed = bench_now() - start;
+
+	printf("%-10s %6d cycles in %7.3fs = %9.1f cycles/s\n",
+		name, iterations, elapsed, iterations / elapsed);
+}
+
+int
+main (int argc,char *argv[])
+{
+	int iterations = 200;
+
+	log_init(&argc, &argv, LOG_PID, LOG_DAEMON);
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <privkey.pem> <pubkey.pem> [iterations]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 3) {
+		iterations = atoi(argv[3]);
+	}
+
+	crypto_init();
+
+	string_init(&privpem, 4096, 1024);
+	string_init(&pubpem, 4096, 1024);
+	if (!fs_read_file(&privpem, argv[1]) || !fs_read_file(&pubpem, argv[2])) {
+		log_err("unable to read keys\n");
+		exit(1);
+	}
+	string_ensurez(&privpem);
+	string_ensurez(&pubpem);
+
+	if (!bench_setup()) {
+		log_err("benchmark setup failed\n");
+		exit(1);
+	}
+	if (!crypto_cache_private_key_file(argv[1]) ||
+			!crypto_cache_public_key(string_get(&pubpem))) {
+		log_err("loading key cache failed\n");
+		exit(1);
+	}
+
+	bench_run("uncached", false, iterations);
+	bench_run("cached", true, iterations);
+
+	string_free(&privpem);
+	string_free(&pubpem);
+	string_free(&ciphertext);
+	string_free(&signature);
+	crypto_finish();
+
+	return 0;
+}
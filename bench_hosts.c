@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chaosvpn.h"
+#include "bench.h"
+
+/*
+ * Time tinc_write_hosts() for 1, 2, 4, ... threads on a synthetic
+ * network, from an empty hosts/ directory so that every file is
+ * generated and written. The digests of each run are checked against
+ * the single thread run, the files have to be the same. The log output
+ * of the runs is discarded, results go to stderr.
+ *
+ * usage: bench_hosts [peers] [max threads] [iterations]
+ */
+
+/* a fresh run: nothing cached, nothing on disk */
+static double
+bench_run(struct config *config, const char *hostsdir)
+{
+	double start;
+
+	tinc_forget_hosts(config);
+	if (!fs_empty_dir((char *)hostsdir)) {
+		log_err("unable to empty %s\n", hostsdir);
+		exit(1);
+	}
+
+	start = bench_now();
+	if (!tinc_write_hosts(config)) {
+		log_err("tinc_write_hosts failed\n");
+		exit(1);
+	}
+	return bench_now() - start;
+}
+
+static void
+bench_check(struct config *config, struct name_index *reference)
+{
+	struct list_head *p;
+	struct peer_config *peer;
+	struct host_file *expected;
+	struct host_file *file;
+
+	list_for_each(p, &config->peer_config) {
+		peer = container_of(p, struct peer_config_list, list)->peer_config;
+		expected = name_index_lookup(reference, peer->name);
+		file = name_index_lookup(&config->host_files, peer->name);
+		if ((expected == NULL) || (file == NULL) ||
+				memcmp(expected->digest, file->digest, CRYPTO_DIGEST_LENGTH)) {
+			log_err("host file of %s differs from the single thread run\n", peer->name);
+			exit(1);
+		}
+	}
+}
+
+int
+main (int argc,char *argv[])
+{
+	unsigned int peers = 10000;
+	unsigned int maxthreads = 8;
+	int iterations = 3;
+	char dir[] = "/tmp/bench_hosts.XXXXXX";
+	char hostsdir[sizeof(dir) + 8];
+	struct config *config;
+	struct string data;
+	struct string_view view;
+	struct name_index reference;
+	struct arena reference_arena;
+	unsigned int threads;
+	double best;
+	double elapsed;
+	int i;
+
+	log_init(&argc, &argv, LOG_PID, LOG_DAEMON);
+
+	if (argc > 1) {
+		peers = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		maxthreads = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		iterations = atoi(argv[3]);
+	}
+	if (maxthreads > TINC_MAX_THREADS) {
+		maxthreads = TINC_MAX_THREADS;
+	}
+
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		log_err("unable to discard stdout\n");
+		exit(1);
+	}
+
+	crypto_init();
+	config = config_alloc();
+	config->peerid = strdup("peer0");
+	config->tincd_version = strdup("1.0.36");
+
+	string_init(&data, 1024 * 1024, STRING_GROWBY_DOUBLE);
+	bench_make_config(&data, peers);
+	string_view_fromstring(&view, &data);
+	if (!parser_parse_config(&view, &config->peer_config, &config->peer_arena, &config->peer_index)) {
+		log_err("parser_parse_config failed\n");
+		exit(1);
+	}
+
+	if (mkdtemp(dir) == NULL) {
+		log_err("unable to create a directory in /tmp\n");
+		exit(1);
+	}
+	config->base_path = strdup(dir);
+	snprintf(hostsdir, sizeof(hostsdir), "%s/hosts", dir);
+
+	name_index_init(&reference);
+	arena_init(&reference_arena, 64 * 1024);
+
+	for (threads = 1; threads <= maxthreads; threads *= 2) {
+		config->generation_threads = threads;
+		best = 0;
+		for (i = 0; i < iterations; i++) {
+			elapsed = bench_run(config, hostsdir);
+			if ((i == 0) || (elapsed < best)) {
+				best = elapsed;
+			}
+		}
+
+		if (threads == 1) {
+			/* keep the digests, the cache is replaced by every run */
+			reference = config->host_files;
+			reference_arena = config->host_files_arena;
+			name_index_init(&config->host_files);
+			arena_init(&config->host_files_arena, 64 * 1024);
+		} else {
+			bench_check(config, &reference);
+		}
+
+		fprintf(stderr, "%2u threads: %u host files in %.3fs, %.0f files/s\n",
+			threads, peers, best, peers / best);
+	}
+
+	(void)fs_rm_r(dir);
+	name_index_free(&reference);
+	arena_free(&reference_arena);
+	string_free(&data);
+	config_free(config);
+	crypto_finish();
+
+	return 0;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "chaosvpn.h"
+#include "bench.h"
+
+#include <openssl/evp.h>
+
+/*
+ * Throughput of the config decrypt and uncompress step in MB/s of
+ * plaintext, for the two pass variant (decrypt into a full size buffer,
+ * then inflate it) and the fused uncompress_decrypt_inflate().
+ *
+ * usage: bench_inflate [max size in MB]
+ */
+
+static char aes_keybuf[32];
+static char aes_ivbuf[16];
+
+/* config-like text, compresses similar to the real thing */
+static void
+bench_make_plaintext(struct string *plain, size_t size)
+{
+	unsigned int i = 0;
+
+	while (string_length(plain) < size) {
+		string_concat_sprintf(plain,
+			"[peer%u]\ngatewayhost=gw%u.example.net\nowner=someone%u@example.net\n"
+			"network=10.%u.%u.0/24\nport=%u\nkey=-----BEGIN RSA PUBLIC KEY-----\n"
+			"MIIBCgKCAQEA%08x%08x%08xQIDAQAB\n-----END RSA PUBLIC KEY-----\n\n",
+			i, i, i, (i >> 8) & 255, i & 255, 4000 + (i % 1000),
+			i * 2654435761u, i ^ 0x5bd1e995, i * 40503u);
+		i++;
+	}
+	plain->length = size;
+}
+
+static bool
+bench_make_ciphertext(struct string *plain, struct string *ciphertext)
+{
+	uLongf complen;
+	unsigned char *compressed;
+	EVP_CIPHER_CTX *ctx;
+	int len;
+	int finallen;
+
+	complen = compressBound(string_length(plain));
+	compressed = malloc(complen);
+	if (compressed == NULL) {
+		return false;
+	}
+	if (compress2(compressed, &complen, (unsigned char *)string_get(plain),
+			string_length(plain), 9) != Z_OK) {
+		free(compressed);
+		return false;
+	}
+
+	string_init(ciphertext, complen + EVP_MAX_BLOCK_LENGTH, 1024);
+	ctx = EVP_CIPHER_CTX_new();
+	EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
+		(unsigned char *)aes_keybuf, (unsigned char *)aes_ivbuf);
+	EVP_EncryptUpdate(ctx, (unsigned char *)string_get(ciphertext), &len, compressed, complen);
+	EVP_EncryptFinal_ex(ctx, (unsigned char *)string_get(ciphertext) + len, &finallen);
+	ciphertext->length = len + finallen;
+	EVP_CIPHER_CTX_free(ctx);
+	free(compressed);
+
+	return true;
+}
+
+static bool
+bench_twopass(struct string_view *ciphertext, struct string_view *key, struct string_view *iv, struct string *out)
+{
+	struct string compressed;
+	struct uncompress_stream stream;
+	bool res;
+
+	string_lazyinit(&compressed, 8192);
+	if (!crypto_aes_decrypt(ciphertext, key, iv, &compressed)) {
+		return false;
+	}
+	res = uncompress_stream_init(&stream, NULL, out, 0, NULL, NULL) &&
+		uncompress_stream_write(&stream, string_get(&compressed), string_length(&compressed)) &&
+		uncompress_stream_finish(&stream);
+	string_free(&compressed);
+
+	return res;
+}
+
+static void
+bench_run(size_t size)
+{
+	struct string plain;
+	struct string ciphertext;
+	struct string out;
+	struct string_view ct;
+	struct string_view key;
+	struct string_view iv;
+	double start;
+	double twopass;
+	double fused;
+	int iterations;
+	int i;
+
+	string_init(&plain, size + 1024, STRING_GROWBY_DOUBLE);
+	bench_make_plaintext(&plain, size);
+	if (!bench_make_ciphertext(&plain, &ciphertext)) {
+		log_err("unable to create test data\n");
+		exit(1);
+	}
+	string_view_fromstring(&ct, &ciphertext);
+	string_view_init(&key, aes_keybuf, sizeof(aes_keybuf));
+	string_view_init(&iv, aes_ivbuf, sizeof(aes_ivbuf));
+
+	/* about 64MB of plaintext per variant */
+	iterations = 64 * 1024 * 1024 / size;
+	if (iterations < 3) {
+		iterations = 3;
+	}
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		string_init(&out, 4096, STRING_GROWBY_DOUBLE);
+		if (!bench_twopass(&ct, &key, &iv, &out) || !string_equals(&out, &plain)) {
+			log_err("two pass variant failed\n");
+			exit(1);
+		}
+		string_free(&out);
+	}
+	twopass = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		string_init(&out, 4096, STRING_GROWBY_DOUBLE);
+		if (!uncompress_decrypt_inflate(&ct, &key, &iv, NULL, &out, size, NULL, NULL) ||
+				!string_equals(&out, &plain)) {
+			log_err("fused variant failed\n");
+			exit(1);
+		}
+		string_free(&out);
+	}
+	fused = bench_now() - start;
+
+	printf("%9lu bytes (%7lu compressed): two pass %8.1f MB/s, fused %8.1f MB/s\n",
+		(unsigned long)size, (unsigned long)string_length(&ciphertext),
+		size * (double)iterations / twopass / (1024 * 1024),
+		size * (double)iterations / fused / (1024 * 1024));
+
+	string_free(&plain);
+	string_free(&ciphertext);
+}
+
+int
+main (int argc,char *argv[])
+{
+	size_t maxsize = 16;
+	size_t size;
+
+	log_init(&argc, &argv, LOG_PID, LOG_DAEMON);
+
+	if (argc > 1) {
+		maxsize = atoi(argv[1]);
+	}
+	maxsize *= 1024 * 1024;
+
+	crypto_init();
+	memset(aes_keybuf, 0x23, sizeof(aes_keybuf));
+	memset(aes_ivbuf, 0x42, sizeof(aes_ivbuf));
+
+	for (size = 16 * 1024; size <= maxsize; size *= 4) {
+		bench_run(size);
+	}
+
+	crypto_finish();
+
+	return 0;
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chaosvpn.h"
+#include "bench.h"
+
+/*
+ * Throughput of parser_parse_config() in lines per second, on a
+ * synthetic config that looks like the real one: a few settings and a
+ * multi-line RSA key per peer.
+ *
+ * usage: bench_parser [peers] [iterations]
+ */
+
+int
+main (int argc,char *argv[])
+{
+	unsigned int peers = 20000;
+	int iterations = 20;
+	unsigned int lines;
+	struct string config;
+	struct string_view data;
+	struct list_head peer_config;
+	struct arena arena;
+	struct name_index names;
+	double start;
+	double elapsed;
+	int i;
+
+	log_init(&argc, &argv, LOG_PID, LOG_DAEMON);
+
+	if (argc > 1) {
+		peers = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		iterations = atoi(argv[2]);
+	}
+
+	string_init(&config, 1024 * 1024, STRING_GROWBY_DOUBLE);
+	lines = bench_make_config(&config, peers);
+	string_view_fromstring(&data, &config);
+
+	INIT_LIST_HEAD(&peer_config);
+	arena_init(&arena, 65536);
+	name_index_init(&names);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if (!parser_parse_config(&data, &peer_config, &arena, &names)) {
+			log_err("parser_parse_config failed\n");
+			exit(1);
+		}
+		parser_free_config(&peer_config, &arena);
+		name_index_clear(&names);
+	}
+	elapsed = bench_now() - start;
+
+	printf("%u peers, %u lines, %lu bytes: %.3fs per parse, %.0f lines/s\n",
+		peers, lines, (unsigned long)string_length(&config),
+		elapsed / iterations, lines * (double)iterations / elapsed);
+
+	name_index_free(&names);
+	string_free(&config);
+
+	return 0;
+}
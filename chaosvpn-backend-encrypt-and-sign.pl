@@ -25,9 +25,12 @@ use constant VERSION => "0.2";
 # - first revision, based on old chaosvpn perl client
 # v0.02 20100412 haegar@ccc.de
 # - disabled cleartext config file in webtree
+# v0.03
+# - optional zstd / lz4 payload compression ('git config chaosvpn.compression')
 
 use strict;
 use Data::Dumper;
+use File::Temp qw(tempfile);
 use Archive::Ar;		# libarchive-ar-perl
 use Compress::Zlib;		# libcompress-zlib-perl
 use Crypt::OpenSSL::Random;     # libcrypt-openssl-random-perl
@@ -47,6 +50,14 @@ my $destdir = `git config chaosvpn.destdir 2>/dev/null`;
 $destdir =~ s/\s*$//s;
 #my $cleartextconfig = `git config chaosvpn.cleartextconfig 2>/dev/null`;
 #$cleartextconfig =~ s/\s*$//s;
+# payload compression: zlib (default, understood by every client), zstd or lz4
+# zstd and lz4 need the zstd / lz4 commandline tools, and clients built
+# with WITH_ZSTD=1 / WITH_LZ4=1. the zlib file is always written as $id.dat,
+# the other format additionally as $id.dat.<codec> - the webserver can pick
+# it using the codecs=... parameter the client sends.
+my $compression = `git config chaosvpn.compression 2>/dev/null`;
+$compression =~ s/\s*$//s;
+$compression = "zlib" unless ($compression);
 my $signkey = "$GIT_DIR/chaosvpn-private/clearprivkey.pem";
 my $signpubkey = "$GIT_DIR/chaosvpn-private/pubkey.pem";
 
@@ -63,6 +74,10 @@ if (!$destdir) {
   print STDERR "'git config chaosvpn.destdir' NOT DEFINED!\n";
   exit(1);
 }
+if ($compression !~ /^(zlib|zstd|lz4)$/) {
+  print STDERR "'git config chaosvpn.compression' must be zlib, zstd or lz4!\n";
+  exit(1);
+}
 #if (!$cleartextconfig) {
 #  print STDERR "'git config chaosvpn.cleartextconfig' NOT DEFINED!\n";
 #  exit(1);
@@ -207,73 +222,53 @@ sub create_config($)
 	PEERS: foreach my $id (sort(keys %$peers)) {
 		my $peer = $peers->{$id};
 
-		my $ar = new Archive::Ar();
-
-		print "\npeer: $id\n";
-		#print Dumper($peer);
-
-		$ar->add_data("chaosvpn-version", $fileformat_version);
-                		
 		my $aeskey = Crypt::OpenSSL::Random::random_bytes(32);
 		my $aesiv = Crypt::OpenSSL::Random::random_bytes(16);
-		
-		#write_string_into_file(">cleartext", $config) || die "write cleartext for $id failed: $!\n";
-		#write_string_into_file(">pubkey.pem", $peer->{pubkey}) || die "write pubkey for $id failed: $!\n";
 
-		#print "  add cleartext...";
-		#$ar->add_data("cleartext", $config);
-		#print ".\n";
+		print "\npeer: $id\n";
+		#print Dumper($peer);
 
-		print "  compress config...";
-		my $compressed_config = Compress::Zlib::compress($config, 9);
-		print ".\n";
-		
-                print "  encrypt config...";
-                my $encrypted_config = aes_encrypt($compressed_config, $aeskey, $aesiv);
-                $ar->add_data("encrypted", $encrypted_config);
-                print ".\n";
-            
-		print "  sign cleartext...";
-		#system("/usr/bin/openssl", "dgst",
-		#	"-sha512",
-		#	"-sign", $signkey,
-		#	"-out", "./signature",
-		#	"./cleartext")
-		#	&& die "digest for $id failed\n";
-		my $signature = rsa_sign_data($config, $sign_secret_key);
-		#write_string_into_file(">signature", $signature);
-		$signature = aes_encrypt($signature, $aeskey, $aesiv);
-		$ar->add_data("signature", $signature);
-		print ".\n";
-
-		print "  rsa part...";
-		#my $rsa_cleartext =
-		#  chr(length($aeskey)) . # length of aes key in bytes, 0-255
-		#  chr(length($aesiv)) .	 # length of aes iv in bytes, 0-255
-		#  $aeskey,
-		#  $aesiv;
-		my $rsa_cleartext = pack("CCA*A*",
-		        length($aeskey), length($aesiv),
-		        $aeskey,
-		        $aesiv);
-                my $rsa_enc = rsa_encrypt($rsa_cleartext, $peer->{pubkey});
-                $ar->add_data("rsa", $rsa_enc);
-		print ".\n";
-		
-		#system("/usr/bin/openssl", "dgst",
-		#	"-sha512",
-		#	"-verify", $signpubkey,
-		#	"-signature", "./signature",
-		#	"./cleartext")
-		#	&& die "verify signature for $id failed\n";
-
-		print "  create $id.dat...";
-		#system("/usr/bin/ar", "-r",
-		#	"./$id.dat",
-		#	"./cleartext", "./signature")
-		#	&& die "ar for $id failed\n";
-		$ar->write("./$id.dat");
-		print ".\n";
+		my @codecs = ("zlib");
+		push @codecs, $compression if ($compression ne "zlib");
+
+		foreach my $codec (@codecs) {
+			my $ar = new Archive::Ar();
+
+			$ar->add_data("chaosvpn-version", $fileformat_version);
+			# uncompressed size, only a buffer sizing hint for the client
+			$ar->add_data("size", length($config));
+			# no compression member means zlib, for older clients
+			$ar->add_data("compression", $codec) if ($codec ne "zlib");
+
+			print "  compress config ($codec)...";
+			my $compressed_config = compress_data($codec, $config);
+			print ".\n";
+
+			print "  encrypt config...";
+			my $encrypted_config = aes_encrypt($compressed_config, $aeskey, $aesiv);
+			$ar->add_data("encrypted", $encrypted_config);
+			print ".\n";
+
+			print "  sign cleartext...";
+			my $signature = rsa_sign_data($config, $sign_secret_key);
+			$signature = aes_encrypt($signature, $aeskey, $aesiv);
+			$ar->add_data("signature", $signature);
+			print ".\n";
+
+			print "  rsa part...";
+			my $rsa_cleartext = pack("CCA*A*",
+				length($aeskey), length($aesiv),
+				$aeskey,
+				$aesiv);
+			my $rsa_enc = rsa_encrypt($rsa_cleartext, $peer->{pubkey});
+			$ar->add_data("rsa", $rsa_enc);
+			print ".\n";
+
+			my $file = ($codec eq "zlib") ? "./$id.dat" : "./$id.dat.$codec";
+			print "  create $file...";
+			$ar->write($file);
+			print ".\n";
+		}
 		
 		#unlink("./cleartext");
 		#unlink("./signature");
@@ -302,6 +297,30 @@ sub openssl_init()
   Crypt::OpenSSL::RSA->import_random_seed();
 }
 
+sub compress_data($$)
+{
+  my ($codec, $data) = @_;
+
+  return Compress::Zlib::compress($data, 9) if ($codec eq "zlib");
+
+  # zstd and lz4 through their commandline tools, lz4 writes frame format
+  my ($in, $infile) = tempfile(UNLINK => 1);
+  binmode($in);
+  print $in $data;
+  close($in) || die "write $infile failed: $!\n";
+
+  my @cmd = ($codec eq "zstd") ? ("zstd", "-19", "-q", "-c", $infile)
+                               : ("lz4", "-9", "-q", "-c", $infile);
+  open(my $out, "-|", @cmd) || die "$codec failed: $!\n";
+  binmode($out);
+  local $/ = undef;
+  my $compressed = <$out>;
+  close($out) || die "$codec failed\n";
+  unlink($infile);
+
+  return $compressed;
+}
+
 sub rsa_sign_data($$)
 {
   my ($data, $privkey) = @_;
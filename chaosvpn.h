@@ -15,6 +15,7 @@
 
 #include <openssl/ssl.h>
 #include <openssl/evp.h>
+#include <zlib.h>
 
 #ifndef WIN32
 #include <syslog.h>
@@ -32,6 +33,7 @@
 #include <ws2tcpip.h>
 
 #define mkdir(a,b) mkdir(a)
+#define lstat(a,b) stat(a,b)
 #define COMMENT "rem "
 #define SCRIPT ".bat"
 #else
@@ -57,9 +59,15 @@
  */
 
 #define TINC_DEFAULT_CIPHER "blowfish"
+
+/* SHA256, used for config change detection */
+#define CRYPTO_DIGEST_LENGTH 32
 #define TINC_DEFAULT_COMPRESSION "0"
 #define TINC_DEFAULT_DIGEST "sha1"
 
+/* upper limit for $generation_threads */
+#define TINC_MAX_THREADS 64
+
 #if !defined(BSD) && !defined(__APPLE__) && !defined(WIN32)
 #define TUN_DEV   "/dev/net/tun"
 #define TUN_PATH  "/dev/net"
@@ -68,6 +76,97 @@
 
 extern bool ar_is_ar_file(struct string *archive);
 extern bool ar_extract(struct string *archive, char *membername, struct string *result);
+extern bool ar_extract_view(struct string *archive, char *membername, struct string_view *result);
+
+struct ar_index_member {
+	struct string_view name;
+	struct string_view data;
+	uint32_t hash;
+};
+
+/* members of an ar archive, parsed once and looked up by name */
+struct ar_index {
+	struct ar_index_member *members;
+	unsigned int count;
+	unsigned int alloc;
+	unsigned int *slots;	/* open addressing, member index + 1, 0 is empty */
+	unsigned int slotmask;
+	void *map;		/* backing buffer owned by the index, if any */
+	size_t maplength;
+};
+
+extern bool ar_index_build(struct ar_index *index, const char *buf, size_t len);
+extern bool ar_index_open_file(struct ar_index *index, const char *filename);
+extern bool ar_index_lookup(struct ar_index *index, const char *membername, struct string_view *result);
+extern void ar_index_free(struct ar_index *index);
+
+
+
+struct name_index_slot {
+	const char *name;	/* not owned, NULL if the slot is empty */
+	void *value;
+	uint32_t hash;
+};
+
+/* case insensitive hash table, from names to pointers */
+struct name_index {
+	struct name_index_slot *slots;
+	unsigned int slotmask;
+	unsigned int count;
+};
+
+extern void name_index_init(struct name_index *index);
+extern bool name_index_add(struct name_index *index, const char *name, void *value);
+extern void *name_index_lookup(struct name_index *index, const char *name);
+extern void name_index_clear(struct name_index *index);
+extern void name_index_free(struct name_index *index);
+
+
+
+/* growing array of prefixes */
+struct route_set {
+	struct addr_subnet *prefix;
+	unsigned int count;
+	unsigned int size;
+};
+
+/* routes to install, and the prefixes their aggregates must not cover */
+struct route_aggregate {
+	struct route_set routes;
+	struct route_set protected;
+	unsigned int subnets;	/* number of routes added */
+};
+
+extern bool routes_set_add(struct route_set *set, const struct addr_subnet *subnet);
+extern void routes_init(struct route_aggregate *agg);
+extern bool routes_add(struct route_aggregate *agg, const struct addr_subnet *subnet);
+extern bool routes_protect(struct route_aggregate *agg, const struct addr_subnet *subnet);
+extern void routes_subnet_from_info(struct addr_subnet *subnet, const struct addr_info *info);
+extern bool routes_protect_list(struct route_aggregate *agg, struct addr_info *list);
+extern void routes_aggregate(struct route_aggregate *agg);
+extern bool routes_format(struct string *target, const struct addr_subnet *route);
+extern bool routes_save(const struct route_set *set, const char *filename);
+extern bool routes_load(struct route_set *set, const char *filename);
+extern bool routes_diff(struct route_set *prev, struct route_set *next, struct route_set *added, struct route_set *removed);
+extern void routes_set_free(struct route_set *set);
+extern void routes_free(struct route_aggregate *agg);
+
+/* routes installed by chaosvpn, written by the generator for the handler */
+#define ROUTES_FILE "chaosvpn.routes"
+
+
+
+extern int netlink_open(bool link_events);
+extern bool netlink_route_batch(int fd, const char *ifname, unsigned int metric, bool add, const struct route_set *routes, unsigned int *failed);
+extern int netlink_link_event(int fd, const char *ifname);
+extern bool netlink_link_is_up(const char *ifname);
+
+/* the routes the tincd handler has installed, see handler_routes.c */
+struct handler_routes {
+	struct route_set routes;	/* the routes file as installed */
+	bool installed;
+	int fd_netlink;			/* -1 with the shell backend */
+};
 
 
 
@@ -76,6 +175,18 @@ struct string_list {
     char *text;
 };
 
+struct arena_block;
+
+struct arena {
+	struct arena_block *blocks;
+	size_t blocksize;
+
+	/* statistics since the last arena_free() */
+	unsigned int stat_mallocs;	/* blocks requested from malloc() */
+	unsigned int stat_allocs;	/* allocations served */
+	size_t stat_bytes;		/* bytes handed out */
+};
+
 typedef enum E_settings_list_entry_type {
 	LIST_STRING,
 	LIST_INTEGER,
@@ -86,7 +197,8 @@ enum {
 	HANDLER_START_TINCD=0,
 	HANDLER_RESTART_TINCD=1,
 	HANDLER_STOP=2,
-	HANDLER_SIGNAL_OLD_TINCD=3
+	HANDLER_SIGNAL_OLD_TINCD=3,
+	HANDLER_APPLY_ROUTES=4
 };
 
 
@@ -104,14 +216,20 @@ struct settings_list {
 };
 
 
+/* contiguous array of parsed subnets */
+struct subnet_array {
+	struct addr_subnet *subnet;
+	unsigned int count;
+};
+
 struct peer_config {
 	char *name;
 	char *gatewayhost;
 	char *owner;
-	struct list_head network;
-	struct list_head network6;
-	struct list_head route_network;
-	struct list_head route_network6;
+	struct subnet_array network;
+	struct subnet_array network6;
+	struct subnet_array route_network;
+	struct subnet_array route_network6;
 	bool hidden;
 	bool silent;
 	unsigned short port;
@@ -123,6 +241,40 @@ struct peer_config {
 	bool primary;
 	bool use_tcp_only;
 	bool indirectdata;
+	unsigned char sectiondigest[CRYPTO_DIGEST_LENGTH];	/* raw text of the section */
+};
+
+/* files queued before fs_batch_add() flushes the batch by itself */
+#define FS_BATCH_FILES 128
+
+struct fs_uring;
+
+/* a file queued with fs_batch_add(), the strings are copies */
+struct fs_batch_file {
+	const char *fn;
+	const char *tmp;	/* hidden temporary written and renamed to fn */
+	const char *cnt;
+	size_t len;
+	int mode;
+	int error;		/* errno of the first step that failed, 0 if written */
+	bool done;		/* renamed to fn */
+};
+
+/* files replaced together, through io_uring where available, see fs.c */
+struct fs_batch {
+	bool sync;		/* fsync each file before its rename */
+	void (*done)(void *ctx, const char *fn, int error);
+	void *ctx;
+	struct fs_batch_file files[FS_BATCH_FILES];
+	unsigned int count;
+	struct arena arena;	/* the copies, until the flush */
+	struct fs_uring *uring;	/* NULL: each file is written when added */
+};
+
+/* a file in hosts/ as last written, see tinc_write_hosts() */
+struct host_file {
+	char *name;
+	unsigned char digest[CRYPTO_DIGEST_LENGTH];	/* of the contents */
 };
 
 struct peer_config_list {
@@ -153,6 +305,7 @@ struct config {
 	char *ifconfig6;
 	char *master_url;
 	char *base_path;
+	char *output_path;		/* staging directory generated into, NULL: base_path */
 	char *tincd_pidfile;
 	char *masterdata_signkey;
 	char *tincd_graphdumpfile;
@@ -161,23 +314,45 @@ struct config {
 	char *tincd_interface;
 	char *tincd_user;
 	char *tincd_raw_config;
-	struct string privkey;
 	struct string ed25519publickey;
 	struct settings_list *exclude;
+	struct name_index exclude_index;	/* names from exclude, compiled in config_init() */
 	struct peer_config *my_peer;
 	struct list_head peer_config;
+	struct arena peer_arena;	/* owns everything in peer_config */
+	struct name_index peer_index;	/* peer_config by name */
+	struct list_head applied_peer_config;	/* the peers tincd runs with, for peerdiff */
+	struct arena applied_peer_arena;
+	struct name_index applied_peer_index;
+	bool have_applied_peers;
+	struct name_index host_files;	/* struct host_file by name, as written last */
+	struct arena host_files_arena;
+	unsigned char local_digest[CRYPTO_DIGEST_LENGTH];	/* local settings that shape the output */
+	unsigned char applied_digest[CRYPTO_DIGEST_LENGTH];	/* config data last written out */
+	unsigned char applied_local_digest[CRYPTO_DIGEST_LENGTH];	/* local_digest at that time */
+	bool have_applied_digest;
+	unsigned char tincconf_digest[CRYPTO_DIGEST_LENGTH];	/* tinc.conf without the ConnectTo lines */
+	bool have_tincconf_digest;
+	bool tincd_restart_needed;	/* tinc.conf changed beyond what SIGHUP applies, until the restart */
 	time_t ifmodifiedsince;
 	unsigned int update_interval;
+	unsigned int generation_threads;
 	bool use_dynamic_routes;
+	bool auto_aggregate_routes;
+	char *route_backend;
+	bool netlink_routes;	/* $route_backend is "netlink" */
 	bool connect_only_to_primary_nodes;
 	bool run_ifdown;
 	bool localdiscovery;
 	struct settings_list *mergeroutes_supernet_raw;
 	struct addr_info *mergeroutes_supernet;
+	struct addrmask_trie mergeroutes_trie;	/* built in config_init() */
 	struct settings_list *ignore_subnets_raw;
 	struct addr_info *ignore_subnets;
+	struct addrmask_trie ignore_trie;
 	struct settings_list *whitelist_subnets_raw;
 	struct addr_info *whitelist_subnets;
+	struct addrmask_trie whitelist_trie;
 
 	/* vars only used in configfile, dummy for c code: */
 	char *password;
@@ -204,13 +379,52 @@ extern struct config* config_get(void);
 
 
 
+extern void arena_init(struct arena *arena, size_t blocksize);
+extern void *arena_alloc(struct arena *arena, size_t size);
+extern char *arena_strdup(struct arena *arena, const char *s);
+extern char *arena_strndup(struct arena *arena, const char *s, size_t len);
+extern void arena_free(struct arena *arena);
+
+
+
+/* consumer of a decrypted or inflated data stream, false aborts the stream */
+typedef bool (*crypto_sink)(void *ctx, const char *buf, size_t len);
+
+/* incremental SHA512 signature verification */
+struct crypto_verify {
+	EVP_MD_CTX *md_ctx;
+	EVP_PKEY *pkey;
+	bool owns_pkey;
+};
+
+/* SHA256 digest of config data */
+struct crypto_digest {
+	EVP_MD_CTX *md_ctx;
+};
+
 extern void crypto_init(void);
 extern void crypto_finish(void);
 
 extern EVP_PKEY *crypto_load_key(const char *key, const bool is_private);
+extern bool crypto_cache_private_key_file(const char *filename);
+extern bool crypto_cache_public_key(const char *pubkey);
+extern EVP_PKEY *crypto_cached_private_key(void);
+extern EVP_PKEY *crypto_cached_public_key(void);
 extern bool crypto_rsa_verify_signature(struct string *databuffer, struct string *signature, const char *pubkey);
-extern bool crypto_rsa_decrypt(struct string *ciphertext, const char *privkey, struct string *decrypted);
-extern bool crypto_aes_decrypt(struct string *ciphertext, struct string *aes_key, struct string *aes_iv, struct string *decrypted);
+extern bool crypto_rsa_decrypt(struct string_view *ciphertext, const char *privkey, struct string *decrypted);
+extern bool crypto_rsa_decrypt_key(struct string_view *ciphertext, EVP_PKEY *pkey, struct string *decrypted);
+extern bool crypto_aes_decrypt(struct string_view *ciphertext, struct string_view *aes_key, struct string_view *aes_iv, struct string *decrypted);
+extern bool crypto_aes_decrypt_stream(struct string_view *ciphertext, struct string_view *aes_key, struct string_view *aes_iv, crypto_sink sink, void *sinkctx);
+extern bool crypto_verify_init(struct crypto_verify *verify, const char *pubkey);
+extern bool crypto_verify_init_key(struct crypto_verify *verify, EVP_PKEY *pkey);
+extern bool crypto_verify_update(void *ctx, const char *buf, size_t len);
+extern bool crypto_verify_final(struct crypto_verify *verify, struct string *signature);
+extern void crypto_verify_free(struct crypto_verify *verify);
+extern bool crypto_digest_init(struct crypto_digest *digest);
+extern bool crypto_digest_update(void *ctx, const char *buf, size_t len);
+extern bool crypto_digest_final(struct crypto_digest *digest, unsigned char *result);
+extern void crypto_digest_free(struct crypto_digest *digest);
+extern bool crypto_digest_buffer(const char *buf, size_t len, unsigned char *result);
 extern void crypto_warn_openssl_version_changed(void);
 
 
@@ -241,6 +455,16 @@ extern bool fs_writecontents(const char * fn, const char * cnt, const size_t len
 extern int fs_mkdir_p(char *, mode_t);
 extern bool fs_cp_r(char*, char*);
 extern bool fs_empty_dir(char*);
+extern bool fs_prune_dir(const char *dir, bool (*keep)(void *ctx, const char *name), void *ctx, unsigned int *removed);
+extern bool fs_link_r(const char *src, const char *dst);
+extern bool fs_rm_r(const char *path);
+extern bool fs_syncfs(const char *path);
+extern bool fs_exchange(const char *a, const char *b);
+extern bool fs_replacecontents(const char *fn, const char *cnt, const size_t len, const int mode);
+extern void fs_batch_init(struct fs_batch *batch, bool sync, void (*done)(void *ctx, const char *fn, int error), void *ctx);
+extern bool fs_batch_add(struct fs_batch *batch, const char *fn, const char *cnt, size_t len, int mode);
+extern bool fs_batch_flush(struct fs_batch *batch);
+extern void fs_batch_free(struct fs_batch *batch);
 extern bool fs_get_cwd(struct string*);
 extern bool fs_read_file(struct string *buffer, char *fname);
 extern bool fs_read_fd(struct string *buffer, FILE *fd);
@@ -290,17 +514,47 @@ extern void log_init(int *argc, char ***argv, int logopt, int logfac);
 extern void log_raw(int priority, const char *format, ...);
 
 
-extern bool parser_parse_config (char *data, struct list_head *config_list);
-extern void parser_free_config(struct list_head* configlist);
+extern bool parser_parse_config (struct string_view *data, struct list_head *config_list, struct arena *arena, struct name_index *names);
+extern void parser_free_config(struct list_head* configlist, struct arena *arena);
 
 
 extern bool pidfile_create_pidfile(const char *filename);
 
 
+enum peerdiff_action {
+	PEERDIFF_NONE,
+	PEERDIFF_RELOAD,
+	PEERDIFF_RESTART
+};
+
+/* what a config update changes for tincd, see peerdiff.c */
+struct peerdiff {
+	enum peerdiff_action action;
+	char reason[128];	/* the first change that needs action */
+	unsigned int added;
+	unsigned int removed;
+	unsigned int changed;	/* sections with a different text */
+};
+
+extern void peerdiff_compare(struct peerdiff *diff, const char *ownname, struct list_head *prev_list, struct name_index *prev_index, struct list_head *list, struct name_index *index);
+extern const char *peerdiff_action_name(enum peerdiff_action action);
+
+
+extern void handler_routes_init(struct handler_routes *handler);
+extern void handler_routes_add(struct handler_routes *handler, struct config *config);
+extern void handler_routes_remove(struct handler_routes *handler, struct config *config);
+extern void handler_routes_load(struct handler_routes *handler, struct config *config);
+extern bool handler_routes_run(struct config *config, const struct route_set *routes, bool add);
+extern void handler_routes_apply(struct handler_routes *handler, struct config *config);
+extern void handler_routes_free(struct handler_routes *handler);
+
 extern bool tinc_write_config(struct config*);
 extern bool tinc_write_hosts(struct config *config);
+extern void tinc_forget_hosts(struct config *config);
 extern bool tinc_write_updown(struct config*, bool up);
 extern bool tinc_write_subnetupdown(struct config*, bool up);
+extern bool tinc_routes_filename(const char *dir, struct string *filename);
+extern bool tinc_render_routes(struct config *config, struct string *buffer, const struct route_set *routes, bool add);
 extern char *tinc_get_version(struct config *config);
 extern pid_t tinc_get_pid(struct config *config);
 extern bool tinc_invoke_ifdown(struct config* config);
@@ -309,7 +563,34 @@ extern bool tinc_invoke_ifdown(struct config* config);
 extern bool tun_check_or_create(); 
 
 
-extern bool uncompress_inflate(struct string *compressed, struct string *uncompressed);
+struct uncompress_stream;
+
+/* decoder for one compression format */
+struct uncompress_codec {
+	const char *name;
+	bool (*init)(struct uncompress_stream *stream);
+	bool (*write)(struct uncompress_stream *stream, const char *buf, size_t len);
+	void (*end)(struct uncompress_stream *stream);
+};
+
+struct uncompress_stream {
+	const struct uncompress_codec *codec;
+	z_stream strm;		/* zlib state */
+	void *state;		/* state of other codecs */
+	bool initialized;
+	bool finished;
+	struct string *out;
+	crypto_sink observer;
+	void *observerctx;
+};
+
+extern const struct uncompress_codec *uncompress_codec_find(struct string_view *name);
+extern bool uncompress_codec_list(struct string *list);
+extern bool uncompress_stream_init(struct uncompress_stream *stream, const struct uncompress_codec *codec, struct string *out, size_t sizehint, crypto_sink observer, void *observerctx);
+extern bool uncompress_stream_write(void *ctx, const char *buf, size_t len);
+extern bool uncompress_stream_finish(struct uncompress_stream *stream);
+extern void uncompress_stream_free(struct uncompress_stream *stream);
+extern bool uncompress_decrypt_inflate(struct string_view *ciphertext, struct string_view *aes_key, struct string_view *aes_iv, const struct uncompress_codec *codec, struct string *out, size_t sizehint, crypto_sink observer, void *observerctx);
 
 
 #endif
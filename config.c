@@ -73,6 +73,7 @@ config_alloc(void)
 	config->ifconfig6		= NULL; // not required
 	config->master_url		= strdup("https://www.vpn.hamburg.ccc.de/tinc-chaosvpn.txt");
 	config->base_path		= NULL;
+	config->output_path		= NULL;
 	config->tincd_pidfile		= NULL;
 	config->my_peer			= NULL;
 	config->masterdata_signkey	= NULL;
@@ -82,14 +83,26 @@ config_alloc(void)
 	config->tincd_user		= NULL;
 	config->tincd_raw_config	= NULL;
 	config->use_dynamic_routes	= false;
+	config->auto_aggregate_routes	= false;
+	config->route_backend		= strdup("shell");
+	config->netlink_routes		= false;
 	config->connect_only_to_primary_nodes = true;
 	config->localdiscovery		= true;
 	config->update_interval		= 0;
+	config->generation_threads	= 1;
 	config->ifmodifiedsince		= 0;
 
-	string_lazyinit(&config->privkey, 2048);
 	string_lazyinit(&config->ed25519publickey, 1024);
 	INIT_LIST_HEAD(&config->peer_config);
+	arena_init(&config->peer_arena, 64 * 1024);
+	name_index_init(&config->peer_index);
+	INIT_LIST_HEAD(&config->applied_peer_config);
+	arena_init(&config->applied_peer_arena, 64 * 1024);
+	name_index_init(&config->applied_peer_index);
+	config->have_applied_peers	= false;
+	name_index_init(&config->host_files);
+	arena_init(&config->host_files_arena, 64 * 1024);
+	name_index_init(&config->exclude_index);
 
 	config->configfile		= strdup(TINCDIR "/chaosvpn.conf");
 	config->daemonmode		= false;
@@ -115,6 +128,7 @@ config_free(struct config *config)
 	free(config->networkname);
 	free(config->my_ip);
 	free(config->my_addressfamily);
+	free(config->route_backend);
 	free(config->tincd_bin);
 	free(config->tincctl_bin);
 	free(config->routemetric);
@@ -127,6 +141,7 @@ config_free(struct config *config)
 	free(config->ifconfig6);
 	free(config->master_url);
 	free(config->base_path);
+	free(config->output_path);
 	free(config->tincd_pidfile);
 	free(config->masterdata_signkey);
 	free(config->tincd_graphdumpfile);
@@ -138,18 +153,26 @@ config_free(struct config *config)
 	free(config->vpn_netmask);
 	free(config->password);
 
-	string_free(&config->privkey);
 	string_free(&config->ed25519publickey);
 
+	name_index_free(&config->exclude_index);
 	free_settings_list(config->exclude);
-	parser_free_config(&config->peer_config);
+	parser_free_config(&config->peer_config, &config->peer_arena);
+	name_index_free(&config->peer_index);
+	parser_free_config(&config->applied_peer_config, &config->applied_peer_arena);
+	name_index_free(&config->applied_peer_index);
+	name_index_free(&config->host_files);
+	arena_free(&config->host_files_arena);
 	free(config->configfile);
 	free(config->tincd_version);
 	free_settings_list(config->mergeroutes_supernet_raw);
+	addrmask_trie_free(&config->mergeroutes_trie);
 	addrmask_free(config->mergeroutes_supernet);
 	free_settings_list(config->ignore_subnets_raw);
+	addrmask_trie_free(&config->ignore_trie);
 	addrmask_free(config->ignore_subnets);
 	free_settings_list(config->whitelist_subnets_raw);
+	addrmask_trie_free(&config->whitelist_trie);
 	addrmask_free(config->whitelist_subnets);
 
 	if (globalconfig == config) {
@@ -201,6 +224,66 @@ parse_and_free_raw_subnetlist(struct settings_list *raw, const char *label)
 	return addrlist;
 }
 
+/* @exclude as hash set, the names stay owned by config->exclude */
+static bool
+config_compile_excludes(struct config *config)
+{
+	struct list_head* ptr;
+	struct settings_list* etr;
+
+	name_index_clear(&config->exclude_index);
+	if (config->exclude == NULL) {
+		return true;
+	}
+
+	list_for_each(ptr, &config->exclude->list) {
+		etr = list_entry(ptr, struct settings_list, list);
+		if (etr->e->etype != LIST_STRING) {
+			/* only strings allowed */
+			continue;
+		}
+		if (!name_index_add(&config->exclude_index, etr->e->evalue.s, etr->e->evalue.s)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Digest over everything local that influences the generated tinc
+ * configuration: the client version, the tincd version and the
+ * contents of chaosvpn.conf.
+ */
+static bool
+config_digest_local(struct config *config)
+{
+	bool retval = false;
+	struct crypto_digest digest;
+	struct string contents;
+
+	string_lazyinit(&contents, 4096);
+	if (!fs_read_file(&contents, config->configfile)) {
+		log_err("Error: unable to read %s\n", config->configfile);
+		goto bail_out;
+	}
+
+	if (!crypto_digest_init(&digest)) goto bail_out;
+	if (!crypto_digest_update(&digest, VERSION, strlen(VERSION) + 1) ||
+			!crypto_digest_update(&digest,
+				config->tincd_version ? config->tincd_version : "",
+				config->tincd_version ? strlen(config->tincd_version) + 1 : 1) ||
+			!crypto_digest_update(&digest, string_get(&contents), string_length(&contents))) {
+		crypto_digest_free(&digest);
+		goto bail_out;
+	}
+	retval = crypto_digest_final(&digest, config->local_digest);
+
+bail_out:
+	string_free(&contents);
+	return retval;
+}
+
 bool
 config_init(struct config *config)
 {
@@ -230,6 +313,10 @@ config_init(struct config *config)
 		log_err("Error: $update_interval may not be <60.");
 		exit(1);
 	}
+	if ((config->generation_threads < 1) || (config->generation_threads > TINC_MAX_THREADS)) {
+		log_err("Error: $generation_threads has to be between 1 and %d.", TINC_MAX_THREADS);
+		exit(1);
+	}
 
 
 	// check required params
@@ -238,10 +325,33 @@ config_init(struct config *config)
 		return false; \
 		}
 
+	if (str_is_nonempty(config->route_backend) &&
+		strcmp(config->route_backend, "shell") != 0 &&
+		strcmp(config->route_backend, "netlink") != 0) {
+
+		log_err("invalid setting for $route_backend, only 'shell' or 'netlink' allowed.");
+		return false;
+	}
+	config->netlink_routes = str_is_nonempty(config->route_backend) &&
+		(strcmp(config->route_backend, "netlink") == 0);
+#ifndef __linux__
+	if (config->netlink_routes) {
+		log_err("$route_backend 'netlink' is only available on linux.");
+		return false;
+	}
+#endif
+	if (config->netlink_routes &&
+		(str_is_empty(config->routemetric) || !str_alldig(config->routemetric))) {
+
+		log_err("$route_backend 'netlink' needs a numeric $routemetric.");
+		return false;
+	}
+
 	reqparam(peerid, "$my_peerid");
 	reqparam(networkname, "$networkname");
 	reqparam(vpn_ip, "$my_vpn_ip");
-	reqparam(routeadd, "$routeadd");
+	if (!config->netlink_routes)
+		reqparam(routeadd, "$routeadd");
 	reqparam(ifconfig, "$ifconfig");
 	reqparam(base_path, "$base");
 	reqparam(tincd_user, "$tincd_user");
@@ -314,7 +424,8 @@ config_init(struct config *config)
 
 	if (str_is_nonempty(config->vpn_ip6)) {
 		reqparam(ifconfig6, "$ifconfig6");
-		reqparam(routeadd6, "$routeadd6");
+		if (!config->netlink_routes)
+			reqparam(routeadd6, "$routeadd6");
 		
 		if (config->use_dynamic_routes)
 			reqparam(routedel6, "$routedel6");
@@ -353,6 +464,29 @@ config_init(struct config *config)
 		return false;
 	}
 
+	if (config->auto_aggregate_routes && config->use_dynamic_routes) {
+		log_err("settings $auto_aggregate_routes and $use_dynamic_routes are not compatible!");
+		log_err("disable one of them and retry.");
+		return false;
+	}
+
+	if (config->netlink_routes && config->use_dynamic_routes) {
+		log_err("settings $route_backend 'netlink' and $use_dynamic_routes are not compatible!");
+		log_err("disable one of them and retry.");
+		return false;
+	}
+
+	/* the lists are matched against every peer subnet, index them */
+	addrmask_trie_free(&config->mergeroutes_trie);
+	addrmask_trie_free(&config->ignore_trie);
+	addrmask_trie_free(&config->whitelist_trie);
+	if (!addrmask_trie_build(&config->mergeroutes_trie, config->mergeroutes_supernet) ||
+			!addrmask_trie_build(&config->ignore_trie, config->ignore_subnets) ||
+			!addrmask_trie_build(&config->whitelist_trie, config->whitelist_subnets)) {
+		log_err("config_init: malloc error building subnet tries");
+		return false;
+	}
+
 
 #if !defined(BSD) && !defined(__APPLE__)
 	/* Linux */
@@ -383,14 +517,20 @@ config_init(struct config *config)
 	string_init(&key_name, 1024, 512);
 	if (!string_concat_sprintf(&key_name, "%s/rsa_key.priv", config->base_path)) { return false; }
 
-	string_free(&config->privkey); /* just to be sure */
-	if (!fs_read_file(&config->privkey, string_get(&key_name))) {
+	/* parsed once here, while we still may read it, and kept */
+	if (!crypto_cache_private_key_file(string_get(&key_name))) {
 		log_err("error: can't read private rsa key at %s\n", string_get(&key_name));
 		string_free(&key_name);
 		return false;
 	}
 	string_free(&key_name);
 
+	if (str_is_nonempty(config->masterdata_signkey) &&
+			!crypto_cache_public_key(config->masterdata_signkey)) {
+		log_err("error: unable to parse $masterdata_signkey\n");
+		return false;
+	}
+
 
 	string_init(&key_name, 1024, 512);
 	if (!string_concat_sprintf(&key_name, "%s/ed25519_key.pub", config->base_path)) { return false; }
@@ -446,6 +586,14 @@ config_init(struct config *config)
 		config->tmpconffile = strdup(tmp);
 	}
 
+	if (!config_compile_excludes(config)) {
+		return false;
+	}
+
+	if (!config_digest_local(config)) {
+		return false;
+	}
+
 	return true;
 }
 
@@ -1,6 +1,8 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,6 +15,12 @@
 #include <openssl/err.h>
 #include <openssl/pem.h>
 #include <openssl/ssl.h>
+#include <openssl/crypto.h>
+
+#if !defined(WIN32) && (OPENSSL_VERSION_NUMBER < 0x10100000L)
+#include <pthread.h>
+#define CRYPTO_THREAD_LOCKS
+#endif
 
 /*
 
@@ -46,6 +54,24 @@ openssl dgst \
 
 */
 
+/* plaintext block size used by crypto_aes_decrypt_stream() */
+#define CRYPTO_AES_BLOCKSIZE (16 * 1024)
+
+/*
+ * Parsed keys are kept for the process lifetime, parsing the PEM data
+ * and setting up RSA blinding on every update cycle is expensive on
+ * small routers. A key loaded from a file is reloaded when the file
+ * mtime changes.
+ */
+struct crypto_cached_key {
+	EVP_PKEY *pkey;
+	char *filename;		/* NULL if loaded from memory */
+	time_t mtime;
+};
+
+static struct crypto_cached_key crypto_privkey;
+static struct crypto_cached_key crypto_pubkey;
+
 EVP_PKEY *
 crypto_load_key(const char *key, const bool is_private)
 {
@@ -75,52 +101,210 @@ crypto_load_key(const char *key, const bool is_private)
 }
 
 
+static void
+crypto_cached_key_clear(struct crypto_cached_key *key)
+{
+	if (key->pkey != NULL) {
+		EVP_PKEY_free(key->pkey);
+	}
+	free(key->filename);
+	memset(key, 0, sizeof(struct crypto_cached_key));
+}
+
+static bool
+crypto_cached_key_load_file(struct crypto_cached_key *key, const char *filename, const bool is_private)
+{
+	struct string pem;
+	struct stat st;
+	EVP_PKEY *pkey;
+
+	if (stat(filename, &st) != 0) {
+		return false;
+	}
+
+	string_init(&pem, 4096, 1024);
+	if (!fs_read_file(&pem, (char *)filename)) {
+		string_free(&pem);
+		return false;
+	}
+	string_ensurez(&pem);
+	pkey = crypto_load_key(string_get(&pem), is_private);
+	/* do not leave key material lying around in freed memory */
+	memset(pem.s, 0, pem.size);
+	string_free(&pem);
+	if (pkey == NULL) {
+		return false;
+	}
+
+	if (key->filename != filename) {
+		crypto_cached_key_clear(key);
+		key->filename = strdup(filename);
+	} else if (key->pkey != NULL) {
+		EVP_PKEY_free(key->pkey);
+	}
+	key->pkey = pkey;
+	key->mtime = st.st_mtime;
+
+	return true;
+}
+
+/* load the private key file and keep it for crypto_cached_private_key() */
 bool
-crypto_rsa_verify_signature(struct string *databuffer, struct string *signature, const char *pubkey)
+crypto_cache_private_key_file(const char *filename)
+{
+	return crypto_cached_key_load_file(&crypto_privkey, filename, true);
+}
+
+/* parse and keep the public key for crypto_cached_public_key() */
+bool
+crypto_cache_public_key(const char *pubkey)
+{
+	EVP_PKEY *pkey;
+
+	pkey = crypto_load_key(pubkey, false);
+	if (pkey == NULL) {
+		return false;
+	}
+	crypto_cached_key_clear(&crypto_pubkey);
+	crypto_pubkey.pkey = pkey;
+
+	return true;
+}
+
+EVP_PKEY *
+crypto_cached_private_key(void)
+{
+	struct stat st;
+
+	if ((crypto_privkey.filename != NULL) &&
+			(stat(crypto_privkey.filename, &st) == 0) &&
+			(st.st_mtime != crypto_privkey.mtime)) {
+		log_info("private key %s changed, reloading.", crypto_privkey.filename);
+		if (!crypto_cached_key_load_file(&crypto_privkey, crypto_privkey.filename, true)) {
+			/* after dropping privileges the file may be unreadable */
+			log_warn("reloading %s failed, keeping the old key.", crypto_privkey.filename);
+			crypto_privkey.mtime = st.st_mtime;
+		}
+	}
+
+	return crypto_privkey.pkey;
+}
+
+EVP_PKEY *
+crypto_cached_public_key(void)
+{
+	return crypto_pubkey.pkey;
+}
+
+bool
+crypto_verify_init(struct crypto_verify *verify, const char *pubkey)
 {
-	int err;
-	bool retval;
-	EVP_MD_CTX md_ctx;
 	EVP_PKEY *pkey;
 
 	/* load public key into openssl structure */
         pkey = crypto_load_key(pubkey, false);
         if (pkey == NULL) {
-            log_err("crypto_verify_signature: key loading failed\n");
+            memset(verify, 0, sizeof(struct crypto_verify));
+            log_err("crypto_verify_init: key loading failed\n");
             return false;
         }
-        
-        /* Verify the signature */
-        if (EVP_VerifyInit(&md_ctx, EVP_sha512()) != 1) {
-            log_err("crypto_verify_signature: libcrypto verify init failed\n");
+
+        if (!crypto_verify_init_key(verify, pkey)) {
             EVP_PKEY_free(pkey);
             return false;
         }
-        EVP_VerifyUpdate(&md_ctx, string_get(databuffer), string_length(databuffer));
-        err = EVP_VerifyFinal(&md_ctx, (unsigned char*)string_get(signature), string_length(signature), pkey);
-        EVP_PKEY_free(pkey);
-        
+        verify->owns_pkey = true;
+
+        return true;
+}
+
+/* pkey stays owned by the caller */
+bool
+crypto_verify_init_key(struct crypto_verify *verify, EVP_PKEY *pkey)
+{
+        memset(verify, 0, sizeof(struct crypto_verify));
+        verify->pkey = pkey;
+
+        verify->md_ctx = EVP_MD_CTX_create();
+        if (verify->md_ctx == NULL) {
+            log_err("crypto_verify_init: malloc error\n");
+            goto bail_out;
+        }
+        if (EVP_VerifyInit(verify->md_ctx, EVP_sha512()) != 1) {
+            log_err("crypto_verify_init: libcrypto verify init failed\n");
+            goto bail_out;
+        }
+
+        return true;
+
+bail_out:
+        if (verify->md_ctx != NULL) {
+            EVP_MD_CTX_destroy(verify->md_ctx);
+        }
+        memset(verify, 0, sizeof(struct crypto_verify));
+        return false;
+}
+
+/* signature compatible with crypto_sink, ctx is a struct crypto_verify */
+bool
+crypto_verify_update(void *ctx, const char *buf, size_t len)
+{
+        struct crypto_verify *verify = ctx;
+
+        return EVP_VerifyUpdate(verify->md_ctx, buf, len) == 1;
+}
+
+bool
+crypto_verify_final(struct crypto_verify *verify, struct string *signature)
+{
+	int err;
+
+        err = EVP_VerifyFinal(verify->md_ctx, (unsigned char*)string_get(signature), string_length(signature), verify->pkey);
         if (err != 1) {
             log_err("crypto_verify_signature: signature verify failed, received bogus data from backend.\n");
             ERR_print_errors_fp(stderr);
-            retval = false;
-            goto bailout_ctx_cleanup;
+            return false;
         }
 
-        retval = true;
+        //log_info("Signature Verified Ok.\n");
+        return true;
+}
 
-bailout_ctx_cleanup:
-        EVP_MD_CTX_cleanup(&md_ctx);
+void
+crypto_verify_free(struct crypto_verify *verify)
+{
+        if (verify->md_ctx != NULL) {
+            EVP_MD_CTX_destroy(verify->md_ctx);
+            verify->md_ctx = NULL;
+        }
+        if ((verify->pkey != NULL) && verify->owns_pkey) {
+            EVP_PKEY_free(verify->pkey);
+        }
+        verify->pkey = NULL;
+        verify->owns_pkey = false;
+}
+
+bool
+crypto_rsa_verify_signature(struct string *databuffer, struct string *signature, const char *pubkey)
+{
+	bool retval = false;
+	struct crypto_verify verify;
+
+        if (!crypto_verify_init(&verify, pubkey)) {
+            return false;
+        }
+        if (crypto_verify_update(&verify, string_get(databuffer), string_length(databuffer))) {
+            retval = crypto_verify_final(&verify, signature);
+        }
+        crypto_verify_free(&verify);
 
-        //log_info("Signature Verified Ok.\n");
 	return retval;
 }
 
 bool
-crypto_rsa_decrypt(struct string *ciphertext, const char *privkey, struct string *decrypted)
+crypto_rsa_decrypt(struct string_view *ciphertext, const char *privkey, struct string *decrypted)
 {
-        bool retval = false;
-        int len;
+        bool retval;
         EVP_PKEY *pkey;
 
         /* load private key into openssl */
@@ -130,96 +314,158 @@ crypto_rsa_decrypt(struct string *ciphertext, const char *privkey, struct string
             return false;
         }
 
+        retval = crypto_rsa_decrypt_key(ciphertext, pkey, decrypted);
+
+        EVP_PKEY_free(pkey);
+        return retval;
+}
+
+bool
+crypto_rsa_decrypt_key(struct string_view *ciphertext, EVP_PKEY *pkey, struct string *decrypted)
+{
+        int len;
+
         /* check length of ciphertext */
-        if (string_length(ciphertext) != EVP_PKEY_size(pkey)) {
+        if (ciphertext->length != EVP_PKEY_size(pkey)) {
             log_err("crypto_rsa_decrypt: ciphertext should match length of key (%" PRIuPTR " vs %d).\n",
-                    string_length(ciphertext),EVP_PKEY_size(pkey));
-            goto bail_out;
+                    ciphertext->length,EVP_PKEY_size(pkey));
+            return false;
         }
 
         string_free(decrypted); /* just to be sure */
-        string_init(decrypted, EVP_PKEY_size(pkey), 512);
-        if (string_size(decrypted) < EVP_PKEY_size(pkey)) {
+        string_lazyinit(decrypted, 512);
+        if (!string_reserve(decrypted, EVP_PKEY_size(pkey))) {
             log_err("crypto_rsa_decrypt: malloc error.\n");
+            return false;
         }
         
-        len = RSA_private_decrypt(string_length(ciphertext),
-            (unsigned char*)string_get(ciphertext),
+        len = RSA_private_decrypt(ciphertext->length,
+            (const unsigned char*)ciphertext->s,
             (unsigned char*)string_get(decrypted),
             pkey->pkey.rsa,
             RSA_PKCS1_OAEP_PADDING);
-        if (len >= 0) {
-            /* TODO: need cleaner way: */
-            decrypted->length = len;
-            retval = true;
-        } else {
-            retval = false;
+        if (len < 0) {
             log_err("crypto_rsa_decrypt: rsa decrypt failed.\n");
             ERR_print_errors_fp(stderr);
+            return false;
         }
 
-bail_out:
-        EVP_PKEY_free(pkey);
+        /* TODO: need cleaner way: */
+        decrypted->length = len;
+        return true;
+}
+
+/* SHA256 digests, used to detect config changes */
+
+bool
+crypto_digest_init(struct crypto_digest *digest)
+{
+        digest->md_ctx = EVP_MD_CTX_create();
+        if (digest->md_ctx == NULL) {
+            log_err("crypto_digest_init: malloc error\n");
+            return false;
+        }
+        if (EVP_DigestInit_ex(digest->md_ctx, EVP_sha256(), NULL) != 1) {
+            log_err("crypto_digest_init: libcrypto digest init failed\n");
+            crypto_digest_free(digest);
+            return false;
+        }
+        return true;
+}
+
+/* signature compatible with crypto_sink, ctx is a struct crypto_digest */
+bool
+crypto_digest_update(void *ctx, const char *buf, size_t len)
+{
+        struct crypto_digest *digest = ctx;
+
+        return EVP_DigestUpdate(digest->md_ctx, buf, len) == 1;
+}
+
+/* result has to hold CRYPTO_DIGEST_LENGTH bytes */
+bool
+crypto_digest_final(struct crypto_digest *digest, unsigned char *result)
+{
+        bool retval;
+
+        retval = (EVP_DigestFinal_ex(digest->md_ctx, result, NULL) == 1);
+        crypto_digest_free(digest);
         return retval;
 }
 
+void
+crypto_digest_free(struct crypto_digest *digest)
+{
+        if (digest->md_ctx != NULL) {
+            EVP_MD_CTX_destroy(digest->md_ctx);
+            digest->md_ctx = NULL;
+        }
+}
+
 bool
-crypto_aes_decrypt(struct string *ciphertext, struct string *aes_key, struct string *aes_iv, struct string *decrypted)
+crypto_digest_buffer(const char *buf, size_t len, unsigned char *result)
+{
+        return EVP_Digest(buf, len, result, NULL, EVP_sha256(), NULL) == 1;
+}
+
+/*
+ * Decrypt ciphertext in blocks of CRYPTO_AES_BLOCKSIZE, handing each
+ * block of plaintext to sink as soon as it is available.
+ */
+bool
+crypto_aes_decrypt_stream(struct string_view *ciphertext, struct string_view *aes_key, struct string_view *aes_iv, crypto_sink sink, void *sinkctx)
 {
     bool retval = false;
     EVP_CIPHER_CTX ctx;
-    int decryptspace;
+    unsigned char outbuf[CRYPTO_AES_BLOCKSIZE + EVP_MAX_BLOCK_LENGTH];
+    size_t pos;
+    size_t chunk;
     int decryptdone;
 
     EVP_CIPHER_CTX_init(&ctx);
     if (!EVP_DecryptInit_ex(&ctx, EVP_aes_256_cbc(), NULL,
-        (unsigned char *)string_get(aes_key),
-        (unsigned char *)string_get(aes_iv))) {
+        (const unsigned char *)aes_key->s,
+        (const unsigned char *)aes_iv->s)) {
         log_err("crypto_aes_decrypt: init failed\n");
         ERR_print_errors_fp(stderr);
         goto bail_out;
     }
     EVP_CIPHER_CTX_set_padding(&ctx, 1);
     
-    if (string_length(aes_key) != EVP_CIPHER_CTX_key_length(&ctx)) {
+    if (aes_key->length != EVP_CIPHER_CTX_key_length(&ctx)) {
         log_err("crypto_aes_decrypt: invalid key size (%" PRIuPTR " vs expected %d)\n",
-                string_length(aes_key), EVP_CIPHER_CTX_key_length(&ctx));
+                aes_key->length, EVP_CIPHER_CTX_key_length(&ctx));
         goto bail_out;
     }
-    if (string_length(aes_iv) != EVP_CIPHER_CTX_iv_length(&ctx)) {
+    if (aes_iv->length != EVP_CIPHER_CTX_iv_length(&ctx)) {
         log_err("crypto_aes_decrypt: invalid iv size (%" PRIuPTR " vs expected %d)\n",
-                string_length(aes_iv), EVP_CIPHER_CTX_iv_length(&ctx));
+                aes_iv->length, EVP_CIPHER_CTX_iv_length(&ctx));
         goto bail_out;
     }
 
-    decryptspace = string_length(ciphertext) + EVP_MAX_BLOCK_LENGTH;
+    for (pos = 0; pos < ciphertext->length; pos += chunk) {
+        chunk = ciphertext->length - pos;
+        if (chunk > CRYPTO_AES_BLOCKSIZE) {
+            chunk = CRYPTO_AES_BLOCKSIZE;
+        }
 
-    string_free(decrypted); /* free previous buffer */
-    string_init(decrypted, decryptspace, 1024);
-    if (string_size(decrypted) < decryptspace) {
-        log_err("crypto_aes_decrypt: decrypt buffer malloc error\n");
-        goto bail_out;
+        if (!EVP_DecryptUpdate(&ctx, outbuf, &decryptdone,
+                (const unsigned char*)ciphertext->s + pos, chunk)) {
+            log_err("crypto_aes_decrypt: decrypt failed\n");
+            ERR_print_errors_fp(stderr);
+            goto bail_out;
+        }
+        if ((decryptdone > 0) && !sink(sinkctx, (char*)outbuf, decryptdone)) {
+            goto bail_out;
+        }
     }
     
-    if (EVP_DecryptUpdate(&ctx, (unsigned char*)string_get(decrypted),
-            &decryptdone, (unsigned char*)string_get(ciphertext),
-            string_length(ciphertext))) {
-        /* TODO: need cleaner way: */
-        decrypted->length = decryptdone;
-    } else {
-        log_err("crypto_aes_decrypt: decrypt failed\n");
+    if (!EVP_DecryptFinal_ex(&ctx, outbuf, &decryptdone)) {
+        log_err("crypto_aes_decrypt: decrypt final failed\n");
         ERR_print_errors_fp(stderr);
         goto bail_out;
     }
-    
-    if (EVP_DecryptFinal_ex(&ctx,
-            (unsigned char*)string_get(decrypted)+string_length(decrypted),
-            &decryptdone)) {
-        /* TODO: need cleaner way: */
-        decrypted->length += decryptdone;
-    } else {
-        log_err("crypto_aes_decrypt: decrypt final failed\n");
-        ERR_print_errors_fp(stderr);
+    if ((decryptdone > 0) && !sink(sinkctx, (char*)outbuf, decryptdone)) {
         goto bail_out;
     }
 
@@ -230,17 +476,102 @@ bail_out:
     return retval;
 }
 
+static bool
+crypto_sink_string(void *ctx, const char *buf, size_t len)
+{
+    return string_concatb((struct string*)ctx, buf, len);
+}
+
+bool
+crypto_aes_decrypt(struct string_view *ciphertext, struct string_view *aes_key, struct string_view *aes_iv, struct string *decrypted)
+{
+    string_free(decrypted); /* free previous buffer */
+    string_lazyinit(decrypted, 1024);
+    if (!string_reserve(decrypted, ciphertext->length + EVP_MAX_BLOCK_LENGTH)) {
+        log_err("crypto_aes_decrypt: decrypt buffer malloc error\n");
+        return false;
+    }
+
+    return crypto_aes_decrypt_stream(ciphertext, aes_key, aes_iv, crypto_sink_string, decrypted);
+}
+
+#ifdef CRYPTO_THREAD_LOCKS
+/*
+ * libcrypto before 1.1 locks its global tables (engines, error queues)
+ * only through these callbacks, without them digests from several
+ * $generation_threads race. Newer versions lock by themselves.
+ */
+static pthread_mutex_t *crypto_locks = NULL;
+
+static void
+crypto_locking_callback(int mode, int n, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK) {
+        (void)pthread_mutex_lock(&crypto_locks[n]);
+    } else {
+        (void)pthread_mutex_unlock(&crypto_locks[n]);
+    }
+}
+
+static void
+crypto_threadid_callback(CRYPTO_THREADID *id)
+{
+    CRYPTO_THREADID_set_numeric(id, (unsigned long)pthread_self());
+}
+
+static void
+crypto_locks_init(void)
+{
+    int n;
+
+    crypto_locks = malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+    if (crypto_locks == NULL) {
+        log_err("crypto_init: malloc error\n");
+        exit(1);
+    }
+    for (n = 0; n < CRYPTO_num_locks(); n++) {
+        (void)pthread_mutex_init(&crypto_locks[n], NULL);
+    }
+    (void)CRYPTO_THREADID_set_callback(crypto_threadid_callback);
+    CRYPTO_set_locking_callback(crypto_locking_callback);
+}
+
+static void
+crypto_locks_free(void)
+{
+    int n;
+
+    if (crypto_locks == NULL) {
+        return;
+    }
+    CRYPTO_set_locking_callback(NULL);
+    for (n = 0; n < CRYPTO_num_locks(); n++) {
+        (void)pthread_mutex_destroy(&crypto_locks[n]);
+    }
+    free(crypto_locks);
+    crypto_locks = NULL;
+}
+#endif
+
 void
 crypto_init(void)
 {
     /* Just load the crypto library error strings, not SSL */
     ERR_load_crypto_strings();
+#ifdef CRYPTO_THREAD_LOCKS
+    crypto_locks_init();
+#endif
 }
 
 void
 crypto_finish(void)
 {
+    crypto_cached_key_clear(&crypto_privkey);
+    crypto_cached_key_clear(&crypto_pubkey);
     ERR_free_strings();
+#ifdef CRYPTO_THREAD_LOCKS
+    crypto_locks_free();
+#endif
 }
 
 void
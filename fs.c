@@ -8,10 +8,32 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <dirent.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#endif
+#if defined(__linux__) && defined(SYS_io_uring_setup)
+#include <linux/io_uring.h>
+#endif
 
 #include "chaosvpn.h"
 
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+#if defined(__linux__) && !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+/* the batch writer needs direct descriptors in a sparse file table */
+#if defined(SYS_io_uring_setup) && defined(IORING_RSRC_REGISTER_SPARSE)
+#define FS_URING
+#endif
+
 
 #define NOERR (0)
 
@@ -50,14 +72,6 @@ int fs_mkdir_p( char *path, mode_t mode )
     return err;
 }
 
-static bool
-fs_ensure_suffix(struct string* s)
-{
-	if (string_get(s)[s->length - 1] == '/') return true;
-	if (!string_putc(s, '/')) return false;
-	return string_ensurez(s);
-}
-
 bool
 fs_get_cwd(struct string* s)
 {
@@ -88,6 +102,31 @@ fs_get_cwd(struct string* s)
 	return true;
 }
 
+static bool
+fs_is_dot(const char *name)
+{
+	return (name[0] == '.') &&
+		((name[1] == 0) || ((name[1] == '.') && (name[2] == 0)));
+}
+
+#ifdef WIN32
+
+static bool
+fs_ensure_suffix(struct string* s)
+{
+	if (string_get(s)[s->length - 1] == '/') return true;
+	if (!string_putc(s, '/')) return false;
+	return string_ensurez(s);
+}
+
+/* path plus a trailing '/', for appending directory entries */
+static bool
+fs_dir_prefix(struct string *path, const char *dir)
+{
+	if (!string_concat(path, dir)) return false;
+	return fs_ensure_suffix(path);
+}
+
 static bool
 fs_cp_file(const char *src, const char *dst)
 {
@@ -257,6 +296,14 @@ nrcwd_bail_out:
 	return retval;
 }
 
+/* no hard links here, nothing uses them on win32 */
+bool
+fs_link_r(const char *src, const char *dst)
+{
+	errno = ENOSYS;
+	return false;
+}
+
 /* unlinks all regular files in a specified directory */
 /* does not use recursion! does not touch symlinks! */
 bool
@@ -326,6 +373,997 @@ nrcwd_bail_out:
 	return retval;
 }
 
+/* unlinks the regular files in dir that keep() does not want to keep, */
+/* counted in removed; a missing dir is empty */
+bool
+fs_prune_dir(const char *dir, bool (*keep)(void *ctx, const char *name), void *ctx, unsigned int *removed)
+{
+	struct string path;
+	size_t dirlen;
+	DIR* d;
+	struct dirent* dirent;
+	struct stat st;
+	bool retval = false;
+
+	*removed = 0;
+
+	d = opendir(dir);
+	if (!d) {
+		return errno == ENOENT;
+	}
+
+	(void)string_init(&path, 512, 512);
+	if (!string_concat(&path, dir)) goto bail_out;
+	if (!fs_ensure_suffix(&path)) goto bail_out;
+	dirlen = path.length;
+
+	while ((dirent = readdir(d))) {
+		if (keep(ctx, dirent->d_name)) continue;
+
+		path.length = dirlen;
+		if (!string_concat(&path, dirent->d_name)) goto bail_out;
+		if (!string_ensurez(&path)) goto bail_out;
+		if (lstat(string_get(&path), &st) || !S_ISREG(st.st_mode)) continue;
+
+		if (unlink(string_get(&path))) {
+			log_err("fs_prune_dir: failed to unlink %s: %s\n", string_get(&path), strerror(errno));
+			continue;
+		}
+		(*removed)++;
+	}
+
+	retval = true;
+
+	/* fallthrough */
+bail_out:
+	(void)closedir(d);
+	string_free(&path);
+	return retval;
+}
+
+/* removes path and everything below it, a missing path is not an error */
+bool
+fs_rm_r(const char *path)
+{
+	struct string p;
+	size_t plen;
+	DIR* dir;
+	struct dirent* dirent;
+	struct stat st;
+	bool retval = false;
+
+	if (lstat(path, &st)) return errno == ENOENT;
+	if (!S_ISDIR(st.st_mode)) return unlink(path) == 0;
+
+	dir = opendir(path);
+	if (!dir) return false;
+
+	(void)string_init(&p, 512, 512);
+	if (!fs_dir_prefix(&p, path)) goto bail_out;
+	plen = p.length;
+
+	while ((dirent = readdir(dir))) {
+		if (fs_is_dot(dirent->d_name)) continue;
+
+		p.length = plen;
+		if (!string_concat(&p, dirent->d_name)) goto bail_out;
+		if (!string_ensurez(&p)) goto bail_out;
+		if (!fs_rm_r(string_get(&p))) goto bail_out;
+	}
+
+	retval = true;
+
+	/* fallthrough */
+bail_out:
+	(void)closedir(dir);
+	string_free(&p);
+	return retval && (rmdir(path) == 0);
+}
+
+#else
+
+/*
+ * Calls fn for every entry of the open directory dirfd but . and ..,
+ * with its DT_* type. Most filesystems report the type in the directory
+ * entry itself, only for the others it is looked up with fstatat().
+ * readdir() fetches the entries in getdents() batches of a bounded
+ * buffer. A false from fn stops the walk, dirfd stays open.
+ */
+static bool
+fs_dir_foreach(int dirfd, bool (*fn)(void *ctx, int dirfd, const char *name, unsigned char type), void *ctx)
+{
+	DIR* dir;
+	struct dirent* dirent;
+	struct stat st;
+	unsigned char type;
+	int fd;
+	bool retval = true;
+
+	fd = dup(dirfd);
+	if (fd == -1) return false;
+	dir = fdopendir(fd);
+	if (!dir) {
+		(void)close(fd);
+		return false;
+	}
+
+	while ((dirent = readdir(dir))) {
+		if (fs_is_dot(dirent->d_name)) continue;
+
+		type = dirent->d_type;
+		if (type == DT_UNKNOWN) {
+			if (fstatat(dirfd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+			type = S_ISDIR(st.st_mode) ? DT_DIR :
+				S_ISREG(st.st_mode) ? DT_REG :
+				S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+		}
+
+		if (!fn(ctx, dirfd, dirent->d_name, type)) {
+			retval = false;
+			break;
+		}
+	}
+
+	(void)closedir(dir);
+	return retval;
+}
+
+static int
+fs_open_dir(int dirfd, const char *name)
+{
+	return openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+}
+
+/*
+ * Copies the rest of the open file in to out: as a reflink where the
+ * filesystem can share the extents (btrfs, xfs), else inside the kernel
+ * with copy_file_range(), else through a buffer.
+ */
+static bool
+fs_copy_fd(int in, int out)
+{
+	char buf[65536];
+	ssize_t len;
+
+#ifdef __linux__
+	if (ioctl(out, FICLONE, in) == 0) return true;
+#ifdef SYS_copy_file_range
+	/* both offsets advance, a fallback below continues from there */
+	while ((len = syscall(SYS_copy_file_range, in, NULL, out, NULL, (size_t)1 << 30, 0)) > 0);
+	if (len == 0) return true;
+#endif
+#endif
+
+	while ((len = read(in, buf, sizeof(buf))) != 0) {
+		if (len == -1) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		if (write(out, buf, len) != len) return false;
+	}
+	return true;
+}
+
+/* copies file name with the times of st */
+static bool
+fs_snapshot_file(int srcdir, int dstdir, const char *name, const struct stat *st)
+{
+	struct timespec times[2];
+	int in;
+	int out;
+	bool res;
+
+	in = openat(srcdir, name, O_RDONLY | O_NOFOLLOW);
+	if (in == -1) return false;
+	out = openat(dstdir, name, O_CREAT | O_WRONLY | O_TRUNC | O_NOFOLLOW, st->st_mode & 07777);
+	if (out == -1) {
+		(void)close(in);
+		return false;
+	}
+
+	res = fs_copy_fd(in, out);
+	if (res) {
+		times[0].tv_sec = st->st_atime;
+		times[0].tv_nsec = 0;
+		times[1].tv_sec = st->st_mtime;
+		times[1].tv_nsec = 0;
+		if (futimens(out, times)) {
+			log_warn("fs_cp_r: warning: futimens failed for %s", name);
+		}
+	}
+
+	(void)close(out);
+	(void)close(in);
+	return res;
+}
+
+struct fs_snapshot {
+	int dstdir;
+	bool link;
+};
+
+static bool fs_snapshot_dir(int srcdir, int dstdir, bool link);
+
+static bool
+fs_snapshot_entry(void *ctx, int srcdir, const char *name, unsigned char type)
+{
+	struct fs_snapshot *snap = ctx;
+	struct stat st;
+	struct timespec times[2];
+	char target[1024];
+	ssize_t len;
+	int subsrc;
+	int subdst;
+	bool ok;
+
+	if (type == DT_LNK) {
+		len = readlinkat(srcdir, name, target, sizeof(target) - 1);
+		if (len == -1) return true;
+		target[len] = 0;
+		if (symlinkat(target, snap->dstdir, name) && (errno != EEXIST)) {
+			log_warn("fs_cp_r: symlink %s failed: %s", name, strerror(errno));
+			return false;
+		}
+		return true;
+	}
+	if ((type != DT_DIR) && (type != DT_REG)) return true;
+
+	/* a linked file needs no stat, unless the link is refused */
+	if (snap->link && (type == DT_REG) &&
+			(linkat(srcdir, name, snap->dstdir, name, 0) == 0)) return true;
+
+	if (fstatat(srcdir, name, &st, AT_SYMLINK_NOFOLLOW)) return true;
+
+	if (S_ISREG(st.st_mode)) {
+		if (!fs_snapshot_file(srcdir, snap->dstdir, name, &st)) {
+			log_warn("fs_cp_r: copy %s failed: %s", name, strerror(errno));
+			return false;
+		}
+		return true;
+	}
+	if (!S_ISDIR(st.st_mode)) return true;
+
+	if (mkdirat(snap->dstdir, name, st.st_mode & 07777) && (errno != EEXIST)) {
+		log_warn("fs_cp_r: mkdir %s failed: %s", name, strerror(errno));
+		return false;
+	}
+	subsrc = fs_open_dir(srcdir, name);
+	subdst = fs_open_dir(snap->dstdir, name);
+	ok = (subsrc != -1) && (subdst != -1) && fs_snapshot_dir(subsrc, subdst, snap->link);
+	if (ok) {
+		times[0].tv_sec = st.st_atime;
+		times[0].tv_nsec = 0;
+		times[1].tv_sec = st.st_mtime;
+		times[1].tv_nsec = 0;
+		if (futimens(subdst, times)) {
+			log_warn("fs_cp_r: warning: futimens failed for %s", name);
+		}
+	}
+	if (subsrc != -1) (void)close(subsrc);
+	if (subdst != -1) (void)close(subdst);
+	return ok;
+}
+
+/*
+ * Recreates the contents of directory srcdir in dstdir, both open
+ * directory fds; everything is looked up relative to them, the cwd is
+ * never changed. Regular files are copied, or hard linked with link.
+ */
+static bool
+fs_snapshot_dir(int srcdir, int dstdir, bool link)
+{
+	struct fs_snapshot snap;
+
+	snap.dstdir = dstdir;
+	snap.link = link;
+	return fs_dir_foreach(srcdir, fs_snapshot_entry, &snap);
+}
+
+/* with link, dst must not exist yet */
+static bool
+fs_snapshot(const char *src, const char *dst, bool link)
+{
+	struct stat st;
+	int srcfd;
+	int dstfd;
+	bool res = false;
+
+	srcfd = open(src, O_RDONLY | O_DIRECTORY);
+	if (srcfd == -1) return false;
+	if (fstat(srcfd, &st)) goto bail_out;
+	if (mkdir(dst, st.st_mode & 07777) && (link || (errno != EEXIST))) goto bail_out;
+
+	dstfd = fs_open_dir(AT_FDCWD, dst);
+	if (dstfd == -1) goto bail_out;
+	res = fs_snapshot_dir(srcfd, dstfd, link);
+	(void)close(dstfd);
+
+	/* fallthrough */
+bail_out:
+	(void)close(srcfd);
+	return res;
+}
+
+/* copies the tree src into dest, file contents as reflinks if possible */
+bool
+fs_cp_r(char* src, char* dest)
+{
+	return fs_snapshot(src, dest, false);
+}
+
+/*
+ * Recreates the tree src at dst (which must not exist) out of hard
+ * links; a file that can not be linked (protected_hardlinks, another
+ * filesystem) is copied instead. Writers have to replace files in dst,
+ * never truncate them, or they change src as well.
+ */
+bool
+fs_link_r(const char *src, const char *dst)
+{
+	return fs_snapshot(src, dst, true);
+}
+
+static bool
+fs_empty_entry(void *ctx, int dirfd, const char *name, unsigned char type)
+{
+	if ((type == DT_REG) && unlinkat(dirfd, name, 0)) {
+		log_err("fs_empty_dir: failed to unlink %s: %s\n", name, strerror(errno));
+	}
+	return true;
+}
+
+/* unlinks all regular files in a specified directory */
+/* does not use recursion! does not touch symlinks! */
+bool
+fs_empty_dir(char* dest)
+{
+	int dirfd;
+	bool retval;
+
+	dirfd = fs_open_dir(AT_FDCWD, dest);
+	if (dirfd == -1) {
+		/* non-existance is not an error reason! */
+		return errno == ENOENT;
+	}
+	retval = fs_dir_foreach(dirfd, fs_empty_entry, NULL);
+	(void)close(dirfd);
+	return retval;
+}
+
+struct fs_prune {
+	bool (*keep)(void *ctx, const char *name);
+	void *ctx;
+	unsigned int removed;
+};
+
+static bool
+fs_prune_entry(void *ctx, int dirfd, const char *name, unsigned char type)
+{
+	struct fs_prune *prune = ctx;
+
+	if ((type != DT_REG) || prune->keep(prune->ctx, name)) return true;
+
+	if (unlinkat(dirfd, name, 0)) {
+		log_err("fs_prune_dir: failed to unlink %s: %s\n", name, strerror(errno));
+		return true;
+	}
+	prune->removed++;
+	return true;
+}
+
+/* unlinks the regular files in dir that keep() does not want to keep, */
+/* counted in removed; a missing dir is empty */
+bool
+fs_prune_dir(const char *dir, bool (*keep)(void *ctx, const char *name), void *ctx, unsigned int *removed)
+{
+	struct fs_prune prune;
+	int dirfd;
+	bool retval;
+
+	*removed = 0;
+
+	dirfd = fs_open_dir(AT_FDCWD, dir);
+	if (dirfd == -1) {
+		return errno == ENOENT;
+	}
+	prune.keep = keep;
+	prune.ctx = ctx;
+	prune.removed = 0;
+	retval = fs_dir_foreach(dirfd, fs_prune_entry, &prune);
+	(void)close(dirfd);
+
+	*removed = prune.removed;
+	return retval;
+}
+
+static bool
+fs_rm_entry(void *ctx, int dirfd, const char *name, unsigned char type)
+{
+	int subdir;
+	bool ok;
+
+	if (type == DT_DIR) {
+		subdir = fs_open_dir(dirfd, name);
+		if (subdir == -1) return false;
+		ok = fs_dir_foreach(subdir, fs_rm_entry, NULL);
+		(void)close(subdir);
+		return ok && (unlinkat(dirfd, name, AT_REMOVEDIR) == 0);
+	}
+	return unlinkat(dirfd, name, 0) == 0;
+}
+
+/* removes path and everything below it, a missing path is not an error */
+bool
+fs_rm_r(const char *path)
+{
+	int dirfd;
+	bool retval;
+
+	dirfd = fs_open_dir(AT_FDCWD, path);
+	if (dirfd == -1) {
+		if (errno == ENOENT) return true;
+		/* not a directory */
+		return unlink(path) == 0;
+	}
+	retval = fs_dir_foreach(dirfd, fs_rm_entry, NULL);
+	(void)close(dirfd);
+	return retval && (rmdir(path) == 0);
+}
+
+#endif
+
+/* flushes the filesystem path is on, all of it once instead of per file */
+bool
+fs_syncfs(const char *path)
+{
+#if defined(__linux__) && defined(SYS_syncfs)
+	int fd;
+	int res;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) return false;
+	res = syscall(SYS_syncfs, fd);
+	(void)close(fd);
+	return res == 0;
+#elif !defined(WIN32)
+	sync();
+	return true;
+#else
+	return true;
+#endif
+}
+
+/* atomically swaps the directory entries a and b, false with ENOSYS if */
+/* that is not possible here */
+bool
+fs_exchange(const char *a, const char *b)
+{
+#if defined(__linux__) && defined(SYS_renameat2)
+	return syscall(SYS_renameat2, AT_FDCWD, a, AT_FDCWD, b, RENAME_EXCHANGE) == 0;
+#else
+	errno = ENOSYS;
+	return false;
+#endif
+}
+
+/* writes tmp and renames it over fn, returns 0 or the errno of the */
+/* step that failed */
+static int
+fs_replace_file(const char *fn, const char *tmp, const char *cnt, size_t len, int mode, bool sync)
+{
+	ssize_t bw;
+	int err = 0;
+	int fh;
+
+	/* never write through a link into an older generation */
+	(void)unlink(tmp);
+	fh = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, mode);
+	if (fh == -1) {
+		return errno;
+	}
+	bw = write(fh, cnt, len);
+	if (bw == -1) {
+		err = errno;
+	} else if ((size_t)bw != len) {
+		err = EIO;
+	}
+#ifndef WIN32
+	if (!err && sync && fsync(fh)) {
+		err = errno;
+	}
+#endif
+	if (close(fh) && !err) {
+		err = errno;
+	}
+	if (!err && rename(tmp, fn)) {
+		err = errno;
+	}
+	if (err) {
+		(void)unlink(tmp);
+	}
+	return err;
+}
+
+/*
+ * Writes fn as a new file: into a hidden temporary next to it, which is
+ * renamed over fn. Readers see the old or the new contents, never a
+ * partial file, and links to the old file keep the old contents.
+ */
+bool
+fs_replacecontents(const char *fn,
+                   const char *cnt,
+                   const size_t len,
+                   const int mode)
+{
+	struct string tmp;
+	const char *base;
+	int err;
+	bool res = false;
+
+	base = strrchr(fn, '/');
+	base = base ? base + 1 : fn;
+
+	(void)string_init(&tmp, 512, 512);
+	if (!string_concatb(&tmp, fn, base - fn)) goto bail_out;
+	if (!string_concat_sprintf(&tmp, ".%s.new", base)) goto bail_out;
+	if (!string_ensurez(&tmp)) goto bail_out;
+
+	err = fs_replace_file(fn, string_get(&tmp), cnt, len, mode, false);
+	if (err) {
+		errno = err;
+		goto bail_out;
+	}
+	res = true;
+
+bail_out:
+	string_free(&tmp);
+	return res;
+}
+
+/*
+ * Batch writer: fs_batch_add() queues files to replace like
+ * fs_replacecontents() does, fs_batch_flush() writes them. With io_uring
+ * every file is one chain of linked requests
+ *
+ *   unlink tmp -> open tmp -> write -> (fsync) -> close -> rename to fn
+ *
+ * and all chains of a batch go to the kernel with one system call. The
+ * open puts the file into a slot of a registered file table, so the
+ * write and close can name it before it exists. A failed step cancels
+ * the rest of its chain only, done() gets the result of each file.
+ *
+ * Where io_uring is missing, disabled or too old (5.19 for sparse file
+ * tables) each file is written by fs_replace_file() as it is added.
+ * If io_uring_enter() fails for good halfway, the batch waits for what
+ * the kernel already took, closes the ring and writes the files that
+ * are left that way too.
+ */
+
+#ifdef FS_URING
+
+/* requests per file, see above */
+#define FS_URING_STEPS		6
+#define FS_URING_ENTRIES	1024
+
+enum {
+	FS_URING_UNLINK,
+	FS_URING_OPEN,
+	FS_URING_WRITE,
+	FS_URING_FSYNC,
+	FS_URING_CLOSE,
+	FS_URING_RENAME
+};
+
+struct fs_uring {
+	int fd;
+	void *ring;
+	size_t ringlen;
+	struct io_uring_sqe *sqes;
+	size_t sqeslen;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static void
+fs_uring_close(struct fs_uring *uring)
+{
+	if (uring->sqes != NULL) {
+		(void)munmap(uring->sqes, uring->sqeslen);
+	}
+	if (uring->ring != NULL) {
+		(void)munmap(uring->ring, uring->ringlen);
+	}
+	if (uring->fd != -1) {
+		(void)close(uring->fd);
+	}
+	free(uring);
+}
+
+static struct fs_uring *
+fs_uring_open(void)
+{
+	struct io_uring_params params;
+	struct io_uring_rsrc_register files;
+	struct fs_uring *uring;
+	size_t cqlen;
+	char *ring;
+
+	uring = calloc(1, sizeof(struct fs_uring));
+	if (uring == NULL) {
+		return NULL;
+	}
+
+	memset(&params, 0, sizeof(params));
+	uring->fd = syscall(SYS_io_uring_setup, FS_URING_ENTRIES, &params);
+	if (uring->fd == -1) {
+		goto bail_out;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+			(params.sq_entries < FS_BATCH_FILES * FS_URING_STEPS)) {
+		/* older kernel, it has no sparse file tables either */
+		errno = ENOSYS;
+		goto bail_out;
+	}
+
+	/* both rings in one mapping */
+	uring->ringlen = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cqlen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (cqlen > uring->ringlen) {
+		uring->ringlen = cqlen;
+	}
+	ring = mmap(NULL, uring->ringlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		uring->fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		goto bail_out;
+	}
+	uring->ring = ring;
+
+	uring->sqeslen = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		goto bail_out;
+	}
+
+	uring->sq_head = (unsigned int *)(ring + params.sq_off.head);
+	uring->sq_tail = (unsigned int *)(ring + params.sq_off.tail);
+	uring->sq_array = (unsigned int *)(ring + params.sq_off.array);
+	uring->sq_mask = *(unsigned int *)(ring + params.sq_off.ring_mask);
+	uring->cq_head = (unsigned int *)(ring + params.cq_off.head);
+	uring->cq_tail = (unsigned int *)(ring + params.cq_off.tail);
+	uring->cq_mask = *(unsigned int *)(ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+	/* one empty slot per file of a batch */
+	memset(&files, 0, sizeof(files));
+	files.nr = FS_BATCH_FILES;
+	files.flags = IORING_RSRC_REGISTER_SPARSE;
+	if (syscall(SYS_io_uring_register, uring->fd, IORING_REGISTER_FILES2,
+			&files, sizeof(files)) == -1) {
+		goto bail_out;
+	}
+
+	return uring;
+
+bail_out:
+	log_debug("fs: io_uring not available (%s), writing files one by one", strerror(errno));
+	fs_uring_close(uring);
+	return NULL;
+}
+
+/* the next free submission entry, tail is ours until it is published */
+static struct io_uring_sqe *
+fs_uring_sqe(struct fs_uring *uring, unsigned int *tail, unsigned int n, int step, unsigned char flags)
+{
+	unsigned int index = *tail & uring->sq_mask;
+	struct io_uring_sqe *sqe = &uring->sqes[index];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->flags = flags;
+	sqe->user_data = ((__u64)n << 3) | step;
+	uring->sq_array[index] = index;
+	(*tail)++;
+	return sqe;
+}
+
+static void
+fs_uring_queue(struct fs_uring *uring, unsigned int *tail, unsigned int n, const struct fs_batch_file *file, bool sync)
+{
+	struct io_uring_sqe *sqe;
+
+	/* never write through a link into an older generation; a */
+	/* hardlink keeps the chain going when there is nothing to remove */
+	sqe = fs_uring_sqe(uring, tail, n, FS_URING_UNLINK, IOSQE_IO_HARDLINK);
+	sqe->opcode = IORING_OP_UNLINKAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)file->tmp;
+
+	sqe = fs_uring_sqe(uring, tail, n, FS_URING_OPEN, IOSQE_IO_LINK);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)file->tmp;
+	sqe->len = file->mode;
+	sqe->open_flags = O_CREAT | O_WRONLY | O_TRUNC;
+	sqe->file_index = n + 1;
+
+	/* a short write fails the chain as well */
+	sqe = fs_uring_sqe(uring, tail, n, FS_URING_WRITE, IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = n;
+	sqe->addr = (uintptr_t)file->cnt;
+	sqe->len = file->len;
+
+	if (sync) {
+		sqe = fs_uring_sqe(uring, tail, n, FS_URING_FSYNC, IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = n;
+	}
+
+	sqe = fs_uring_sqe(uring, tail, n, FS_URING_CLOSE, IOSQE_IO_LINK);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = n + 1;
+
+	sqe = fs_uring_sqe(uring, tail, n, FS_URING_RENAME, 0);
+	sqe->opcode = IORING_OP_RENAMEAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)file->tmp;
+	sqe->len = AT_FDCWD;
+	sqe->addr2 = (uintptr_t)file->fn;
+}
+
+/* notes the result of one request in its file */
+static void
+fs_uring_complete(struct fs_batch_file *files, const struct io_uring_cqe *cqe)
+{
+	struct fs_batch_file *file = &files[cqe->user_data >> 3];
+	int step = cqe->user_data & 7;
+
+	if (step == FS_URING_UNLINK) {
+		return;
+	}
+	if ((step == FS_URING_RENAME) && (cqe->res == 0)) {
+		file->done = true;
+	}
+	if ((step == FS_URING_WRITE) && (cqe->res >= 0) && ((size_t)cqe->res != file->len)) {
+		file->error = EIO;
+	} else if (cqe->res < 0) {
+		/* the cancelled rest of a chain does not hide the real error */
+		if ((file->error == 0) || (file->error == ECANCELED)) {
+			file->error = -cqe->res;
+		}
+	}
+}
+
+/* notes the completions posted so far, returns how many there were */
+static unsigned int
+fs_uring_reap(struct fs_uring *uring, struct fs_batch_file *files)
+{
+	unsigned int head = *uring->cq_head;
+	unsigned int count = 0;
+
+	while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+		fs_uring_complete(files, &uring->cqes[head & uring->cq_mask]);
+		head++;
+		count++;
+	}
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+/* a failure that waiting, or reaping first, does not cure */
+static bool
+fs_uring_is_hard_error(int error)
+{
+	return (error != EINTR) && (error != EAGAIN) && (error != EBUSY);
+}
+
+/*
+ * Runs the chains of count files and waits until all of them are done.
+ * False if io_uring_enter() failed for good: what the kernel had not
+ * taken yet is withdrawn, and everything it took has completed before
+ * this returns, nothing points into the batch any more. The files that
+ * were not renamed to fn are left for the caller.
+ */
+static bool
+fs_uring_write(struct fs_uring *uring, struct fs_batch_file *files, unsigned int count, bool sync)
+{
+	struct timespec pause = { 0, 1000000 };
+	unsigned int start = *uring->sq_tail;
+	unsigned int tail = start;
+	unsigned int queued;
+	unsigned int completed = 0;
+	unsigned int n;
+	int error;
+
+	for (n = 0; n < count; n++) {
+		fs_uring_queue(uring, &tail, n, &files[n], sync);
+	}
+	queued = tail - start;
+	__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	/* reaping before each call keeps the completion queue from */
+	/* overflowing, which is what EBUSY reports */
+	for (;;) {
+		completed += fs_uring_reap(uring, files);
+		if (completed == queued) {
+			return true;
+		}
+		if ((syscall(SYS_io_uring_enter, uring->fd,
+				tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE), 1,
+				IORING_ENTER_GETEVENTS, NULL, 0) == -1) && fs_uring_is_hard_error(errno)) {
+			break;
+		}
+	}
+
+	error = errno;
+	log_err("fs: io_uring_enter failed: %s", strerror(error));
+
+	queued = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) - start;
+	__atomic_store_n(uring->sq_tail, start + queued, __ATOMIC_RELEASE);
+
+	/* completions are posted without io_uring_enter() as well, if */
+	/* it keeps failing they are polled for */
+	for (;;) {
+		completed += fs_uring_reap(uring, files);
+		if (completed >= queued) {
+			break;
+		}
+		if ((syscall(SYS_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS,
+				NULL, 0) == -1) && fs_uring_is_hard_error(errno)) {
+			(void)nanosleep(&pause, NULL);
+		}
+	}
+
+	errno = error;
+	return false;
+}
+
+#else
+
+struct fs_uring {
+	int fd;
+};
+
+static struct fs_uring *
+fs_uring_open(void)
+{
+	return NULL;
+}
+
+static void
+fs_uring_close(struct fs_uring *uring)
+{
+}
+
+static bool
+fs_uring_write(struct fs_uring *uring, struct fs_batch_file *files, unsigned int count, bool sync)
+{
+	return false;
+}
+
+#endif
+
+/* done(ctx, fn, error) is called once per file, error is 0 or an errno */
+void
+fs_batch_init(struct fs_batch *batch, bool sync, void (*done)(void *ctx, const char *fn, int error), void *ctx)
+{
+	batch->sync = sync;
+	batch->done = done;
+	batch->ctx = ctx;
+	batch->count = 0;
+	arena_init(&batch->arena, 64 * 1024);
+	batch->uring = fs_uring_open();
+}
+
+/*
+ * Queues fn to be replaced with len bytes from cnt, both are copied.
+ * False only if the batch itself failed, a file that could not be
+ * written is reported through done().
+ */
+bool
+fs_batch_add(struct fs_batch *batch, const char *fn, const char *cnt, size_t len, int mode)
+{
+	struct fs_batch_file *file;
+	const char *base;
+	char *tmp;
+	char *copy;
+
+	base = strrchr(fn, '/');
+	base = base ? base + 1 : fn;
+	tmp = arena_alloc(&batch->arena, strlen(fn) + sizeof("..new"));
+	if (tmp == NULL) {
+		log_err("fs_batch_add: malloc error");
+		return false;
+	}
+	sprintf(tmp, "%.*s.%s.new", (int)(base - fn), fn, base);
+
+	/* larger than a single write takes, not worth a chain */
+	if ((batch->uring == NULL) || (len > INT_MAX / 2)) {
+		batch->done(batch->ctx, fn, fs_replace_file(fn, tmp, cnt, len, mode, batch->sync));
+		if (batch->count == 0) {
+			arena_free(&batch->arena);
+		}
+		return true;
+	}
+
+	file = &batch->files[batch->count];
+	file->fn = arena_strdup(&batch->arena, fn);
+	copy = arena_alloc(&batch->arena, len ? len : 1);
+	if ((file->fn == NULL) || (copy == NULL)) {
+		log_err("fs_batch_add: malloc error");
+		return false;
+	}
+	memcpy(copy, cnt, len);
+	file->tmp = tmp;
+	file->cnt = copy;
+	file->len = len;
+	file->mode = mode;
+	file->error = 0;
+	file->done = false;
+
+	if (++batch->count == FS_BATCH_FILES) {
+		return fs_batch_flush(batch);
+	}
+	return true;
+}
+
+/* writes all queued files and reports each of them through done() */
+bool
+fs_batch_flush(struct fs_batch *batch)
+{
+	struct fs_batch_file *file;
+	unsigned int n;
+
+	if (batch->count == 0) {
+		return true;
+	}
+
+	if (!fs_uring_write(batch->uring, batch->files, batch->count, batch->sync)) {
+		/* nothing is in flight any more, this batch and all later */
+		/* files are written one by one */
+		fs_uring_close(batch->uring);
+		batch->uring = NULL;
+		for (n = 0; n < batch->count; n++) {
+			file = &batch->files[n];
+			if (!file->done) {
+				file->error = fs_replace_file(file->fn, file->tmp, file->cnt,
+					file->len, file->mode, batch->sync);
+			}
+		}
+	}
+
+	for (n = 0; n < batch->count; n++) {
+		file = &batch->files[n];
+		if (file->error) {
+			(void)unlink(file->tmp);
+		}
+		batch->done(batch->ctx, file->fn, file->error);
+	}
+
+	batch->count = 0;
+	arena_free(&batch->arena);
+	return true;
+}
+
+/* files still queued are dropped, fs_batch_flush() first */
+void
+fs_batch_free(struct fs_batch *batch)
+{
+	if (batch->uring != NULL) {
+		fs_uring_close(batch->uring);
+		batch->uring = NULL;
+	}
+	batch->count = 0;
+	arena_free(&batch->arena);
+}
+
 bool
 fs_writecontents(const char *fn,
                  const char *cnt,
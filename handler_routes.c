@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
+
+#include "chaosvpn.h"
+
+/*
+
+handler_routes: the routes the tincd handler keeps installed
+
+with $route_backend "netlink" the handler installs the routes file
+itself once the interface is up. with the shell backend tinc-up
+installs them and the handler only takes note of what it installed.
+
+on a config update both apply only the difference to the new routes
+file, the shell backend by running the $routeadd/$routedel commands of
+the changed routes with INTERFACE set, as tincd does for tinc-up.
+
+*/
+
+void
+handler_routes_init(struct handler_routes *handler)
+{
+	memset(handler, 0, sizeof(struct handler_routes));
+	handler->fd_netlink = -1;
+}
+
+/* install the routes written by tinc_write_updown() via netlink */
+void
+handler_routes_add(struct handler_routes *handler, struct config *config)
+{
+	struct string filename;
+	unsigned int failed;
+
+	if (!tinc_routes_filename(config->base_path, &filename)) return;
+	if (!routes_load(&handler->routes, string_get(&filename))) {
+		log_err("unable to read %s, no routes installed.", string_get(&filename));
+		string_free(&filename);
+		return;
+	}
+	string_free(&filename);
+
+	if (!netlink_route_batch(handler->fd_netlink, config->tincd_interface, atoi(config->routemetric),
+			true, &handler->routes, &failed)) {
+		return;
+	}
+	handler->installed = true;
+
+	log_info("netlink: installed %u of %u routes via %s.",
+		handler->routes.count - failed, handler->routes.count, config->tincd_interface);
+}
+
+void
+handler_routes_remove(struct handler_routes *handler, struct config *config)
+{
+	unsigned int failed;
+
+	if (!config->netlink_routes || !handler->installed) return;
+	handler->installed = false;
+
+	(void)netlink_route_batch(handler->fd_netlink, config->tincd_interface, atoi(config->routemetric),
+		false, &handler->routes, &failed);
+}
+
+/* the routes tinc-up installs, for the shell backend */
+void
+handler_routes_load(struct handler_routes *handler, struct config *config)
+{
+	struct string filename;
+
+	if (!tinc_routes_filename(config->base_path, &filename)) return;
+	handler->installed = routes_load(&handler->routes, string_get(&filename));
+	string_free(&filename);
+}
+
+#ifndef WIN32
+/* feeds script to /bin/sh, true if it exited with 0 */
+static bool
+handler_routes_sh(struct config *config, struct string *script)
+{
+	sigset_t sigchld;
+	sigset_t saved;
+	size_t offset = 0;
+	ssize_t written;
+	pid_t pid;
+	int status;
+	int fds[2];
+	bool res = true;
+
+	/* the SIGCHLD handler must not reap the shell before we do */
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	(void)sigprocmask(SIG_BLOCK, &sigchld, &saved);
+
+	if (pipe(fds)) {
+		log_err("unable to run route commands: %s", strerror(errno));
+		(void)sigprocmask(SIG_SETMASK, &saved, NULL);
+		return false;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		log_err("unable to run route commands: %s", strerror(errno));
+		(void)close(fds[0]);
+		(void)close(fds[1]);
+		(void)sigprocmask(SIG_SETMASK, &saved, NULL);
+		return false;
+	}
+	if (pid == 0) {
+		(void)sigprocmask(SIG_SETMASK, &saved, NULL);
+		(void)dup2(fds[0], STDIN_FILENO);
+		(void)close(fds[0]);
+		(void)close(fds[1]);
+		/* the $routeadd/$routedel templates use \$INTERFACE */
+		(void)setenv("INTERFACE", config->tincd_interface, 1);
+		execl("/bin/sh", "sh", (char *)NULL);
+		_exit(127);
+	}
+
+	(void)close(fds[0]);
+	while (offset < string_length(script)) {
+		written = write(fds[1], string_get(script) + offset, string_length(script) - offset);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			res = false;
+			break;
+		}
+		offset += written;
+	}
+	(void)close(fds[1]);
+
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			status = -1;
+			break;
+		}
+	}
+	(void)sigprocmask(SIG_SETMASK, &saved, NULL);
+
+	return res && (status != -1) && WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+#endif
+
+/*
+ * Runs the $routeadd/$routedel commands for routes. All of them run,
+ * false if any of them failed.
+ */
+bool
+handler_routes_run(struct config *config, const struct route_set *routes, bool add)
+{
+	struct string commands;
+	struct string script;
+	struct string_view view;
+	struct string_view line;
+	bool res = false;
+
+	if (routes->count == 0) return true;
+
+	string_init(&commands, 64 * routes->count, STRING_GROWBY_DOUBLE);
+	string_init(&script, 80 * routes->count + 64, STRING_GROWBY_DOUBLE);
+	if (!tinc_render_routes(config, &commands, routes, add)) goto bail_out;
+
+	/* the exit status of the shell is that of the last command only */
+	if (!string_concat(&script, "failed=0\n")) goto bail_out;
+	string_view_fromstring(&view, &commands);
+	while (string_view_split(&view, '\n', &line)) {
+		if (line.length == 0) {
+			continue;
+		}
+		if (!string_concat(&script, "{\n") ||
+				!string_concatb(&script, line.s, line.length) ||
+				!string_concat(&script, "\n} || failed=1\n")) {
+			goto bail_out;
+		}
+	}
+	if (!string_concat(&script, "exit $failed\n")) goto bail_out;
+
+#ifndef WIN32
+	res = handler_routes_sh(config, &script);
+#endif
+	if (!res) {
+		log_warn("some route commands failed.");
+	}
+
+bail_out:
+	string_free(&commands);
+	string_free(&script);
+	return res;
+}
+
+/*
+ * Brings the installed routes in line with the routes file just written
+ * by a config update: only the routes that went away are deleted and
+ * only the new ones added, everything else stays in place.
+ */
+void
+handler_routes_apply(struct handler_routes *handler, struct config *config)
+{
+	struct string filename;
+	struct route_set next;
+	struct route_set added;
+	struct route_set removed;
+	unsigned int failed;
+
+	if (!handler->installed) {
+		/* nothing to diff against, the next install reads the file */
+		return;
+	}
+
+	memset(&next, 0, sizeof(next));
+	memset(&added, 0, sizeof(added));
+	memset(&removed, 0, sizeof(removed));
+
+	if (!tinc_routes_filename(config->base_path, &filename)) return;
+	if (!routes_load(&next, string_get(&filename))) {
+		log_err("unable to read %s, routes not updated.", string_get(&filename));
+		string_free(&filename);
+		return;
+	}
+	string_free(&filename);
+
+	if (!routes_diff(&handler->routes, &next, &added, &removed)) {
+		goto bail_out;
+	}
+
+	if (config->netlink_routes) {
+		(void)netlink_route_batch(handler->fd_netlink, config->tincd_interface, atoi(config->routemetric),
+			false, &removed, &failed);
+		(void)netlink_route_batch(handler->fd_netlink, config->tincd_interface, atoi(config->routemetric),
+			true, &added, &failed);
+	} else {
+		(void)handler_routes_run(config, &removed, false);
+		(void)handler_routes_run(config, &added, true);
+	}
+
+	log_info("routes updated: %u added, %u removed, %u unchanged.",
+		added.count, removed.count, next.count - added.count);
+
+	/* next is what is installed now */
+	routes_set_free(&handler->routes);
+	handler->routes = next;
+	memset(&next, 0, sizeof(next));
+
+bail_out:
+	routes_set_free(&next);
+	routes_set_free(&added);
+	routes_set_free(&removed);
+}
+
+void
+handler_routes_free(struct handler_routes *handler)
+{
+	routes_set_free(&handler->routes);
+	handler->installed = false;
+}
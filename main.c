@@ -24,19 +24,37 @@ static struct daemon_info di_tincd;
 static pid_t pid_tincd_handler;
 static int fd_tincd_handler;
 
+/* installed routes, only used by the slave process */
+static int fd_netlink_events = -1;
+static struct handler_routes handler_routes;
+
 static time_t nextupdate = 0;
 static struct string HTTP_USER_AGENT;
 
+/* tincd restarts and reloads caused by config updates, per hour */
+#define STATS_HOURS 24
+static time_t stats_hour[STATS_HOURS];
+static unsigned int stats_restarts[STATS_HOURS];
+static unsigned int stats_reloads[STATS_HOURS];
+
 
 static bool main_check_root(void);
-static bool main_create_backup(struct config*);
-static bool main_cleanup_hosts_subdir(struct config*);
-static int main_fetch_and_apply_config(struct config* config, struct string* oldconfig);
+static bool main_stage_begin(struct config*);
+static bool main_stage_commit(struct config*);
+static void main_stage_abort(struct config*);
+static int main_fetch_and_apply_config(struct config* config);
 static void main_free_parsed_info(struct config*);
+static bool main_load_applied_peers(struct config*);
+static void main_keep_applied_peers(struct config*);
+static void main_forget_applied_peers(struct config*);
+static void main_count_update(struct config*, int);
 static bool main_load_previous_config(struct config*, struct string*);
+static void main_load_applied_digest(struct config*);
+static void main_save_applied_digest(struct config*, const unsigned char*);
+static void main_forget_applied_digest(struct config*);
 static bool main_parse_config(struct config*, struct string*);
 static void main_parse_opts(struct config*, int, char**);
-static int main_request_config(struct config*, struct string*);
+static int main_request_config(struct config*, struct string*, unsigned char*);
 static void main_tempsave_fetched_config(struct config*, struct string*);
 static void main_terminate_old_tincd(struct config*);
 static void main_unlink_pidfile(struct config*);
@@ -55,6 +73,7 @@ static void handler_start_tincd(void);
 static void handler_restart_tincd(void);
 static void handler_stop(void);
 static void handler_signal_old_tincd(void);
+static void handler_apply_routes(void);
 
 /* functions only used by slave process */
 static void sigchild(int);
@@ -66,7 +85,6 @@ main (int argc,char *argv[])
 {
 	struct config *config;
 	int err;
-	struct string oldconfig;
 
 #ifdef WIN32
 	struct WSAData wsa_state;
@@ -85,6 +103,7 @@ main (int argc,char *argv[])
 	log_info("ChaosVPN client v%s starting.", VERSION);
 
 	crypto_warn_openssl_version_changed();
+	crypto_init();
 
 	config = config_alloc();
 	if (config == NULL) {
@@ -141,8 +160,8 @@ main (int argc,char *argv[])
 	(void)signal(SIGHUP, p_sighup);
 #endif
 
-	string_init(&oldconfig, 4096, 4096);
-	main_fetch_and_apply_config(config, &oldconfig);
+	main_load_applied_digest(config);
+	main_fetch_and_apply_config(config);
 	main_warn_about_old_tincd(config);
 
 	main_updated(config);
@@ -152,6 +171,7 @@ main (int argc,char *argv[])
 
 	log_info("signalling worker <%d> to start tincd.", pid_tincd_handler);
 	handler_start_tincd();
+	config->tincd_restart_needed = false;
 
 	if (!config->oneshot) {
 		do {
@@ -171,7 +191,7 @@ main (int argc,char *argv[])
 				}
 			}
 
-			switch (main_fetch_and_apply_config(config, &oldconfig)) {
+			switch (err = main_fetch_and_apply_config(config)) {
 			case -1:
 				log_err("Error while updating config. Not terminating tincd.");
 				break;
@@ -180,9 +200,18 @@ main (int argc,char *argv[])
 				log_info("No update needed.");
 				break;
 
+			case 1:
+				/* no route flap, only the difference is applied */
+				log_info("Reloading tincd.");
+				handler_apply_routes();
+				main_count_update(config, err);
+				break;
+
 			default:
 				log_info("Restarting tincd.");
 				handler_restart_tincd();
+				config->tincd_restart_needed = false;
+				main_count_update(config, err);
 				break;
 			}
 		} while (!r_sigterm && !r_sigint);
@@ -192,9 +221,9 @@ main (int argc,char *argv[])
 		handler_stop();
 	}
 
-	string_free(&oldconfig);
 	config_free(config);
 	config = NULL;
+	crypto_finish();
 	string_free(&HTTP_USER_AGENT);
 
 	return 0;
@@ -206,23 +235,83 @@ main_updated(struct config *config)
     nextupdate = time(NULL) + config->update_interval;
 }
 
+/* logs the restarts and reloads of the last 24 hours, and writes them */
+/* to chaosvpn.stats for monitoring */
+static void
+main_count_update(struct config *config, int result)
+{
+	time_t hour = time(NULL) / 3600;
+	unsigned int slot = hour % STATS_HOURS;
+	unsigned int restarts = 0;
+	unsigned int reloads = 0;
+	unsigned int i;
+	struct string stats;
+	struct string fn;
+
+	if (stats_hour[slot] != hour) {
+		stats_hour[slot] = hour;
+		stats_restarts[slot] = 0;
+		stats_reloads[slot] = 0;
+	}
+	if (result == 2) {
+		stats_restarts[slot]++;
+	} else {
+		stats_reloads[slot]++;
+	}
+
+	for (i = 0; i < STATS_HOURS; i++) {
+		if (hour - stats_hour[i] < STATS_HOURS) {
+			restarts += stats_restarts[i];
+			reloads += stats_reloads[i];
+		}
+	}
+	log_info("tincd restarts in the last 24 hours: %u, reloads: %u.", restarts, reloads);
+
+	string_init(&fn, 512, 512);
+	string_init(&stats, 256, 256);
+	if (string_concat_sprintf(&fn, "%s/chaosvpn.stats", config->base_path) &&
+			string_ensurez(&fn) &&
+			string_concat_sprintf(&stats, "chaosvpn_tincd_restarts_24h %u\n"
+				"chaosvpn_tincd_reloads_24h %u\n", restarts, reloads) &&
+			!fs_replacecontents(string_get(&fn), string_get(&stats), string_length(&stats), 0644)) {
+		log_debug("Error writing %s: %s", string_get(&fn), strerror(errno));
+	}
+	string_free(&stats);
+	string_free(&fn);
+}
+
+/* true if data with this digest was already written out, with the */
+/* current local settings */
+static bool
+main_is_applied(struct config *config, const unsigned char *digest)
+{
+	return config->have_applied_digest &&
+		(memcmp(config->applied_local_digest, config->local_digest, CRYPTO_DIGEST_LENGTH) == 0) &&
+		((digest == NULL) ||
+			(memcmp(config->applied_digest, digest, CRYPTO_DIGEST_LENGTH) == 0));
+}
+
 static int
-main_fetch_and_apply_config(struct config* config, struct string* oldconfig)
+main_fetch_and_apply_config(struct config* config)
 /*
  * Returns:
  * -1: Error
- *  0: Not changed
- *  1: Everything ok
+ *  0: Not changed, or nothing tincd uses
+ *  1: Written, tincd has to reload
+ *  2: Written, tincd has to restart
  */
 {
 	int err;
 	struct string http_response;
+	unsigned char digest[CRYPTO_DIGEST_LENGTH];
+	struct peerdiff diff;
+	bool staged;
 
 	log_debug("Fetching information.");
 
-	string_init(&http_response, 4096, 512);
+	string_init(&http_response, 4096, STRING_GROWBY_DOUBLE);
 
-	err = main_request_config(config, &http_response);
+	err = main_request_config(config, &http_response, digest);
 	if (err < 1) {
 	        /* errors and "not modified" response */
 		string_free(&http_response);
@@ -230,50 +319,87 @@ main_fetch_and_apply_config(struct config* config, struct string* oldconfig)
 		        /* only warn for errors */
         		log_warn("Warning: Unable to fetch config; using last stored config.");
                 }
-		if (!main_load_previous_config(config, &http_response)) {
+		if (main_is_applied(config, NULL)) {
+			/* the stored config is the one already applied */
+			return 0;
+		}
+		if (!main_load_previous_config(config, &http_response) ||
+				!crypto_digest_buffer(string_get(&http_response),
+					string_length(&http_response), digest)) {
 		        string_free(&http_response);
 			return -1;
 		}
 	}
 
-	if (string_equals(&http_response, oldconfig)) {
+	if (main_is_applied(config, digest)) {
 		string_free(&http_response);
 		return 0;
 	}
 
 	err = !main_parse_config(config, &http_response);
 	if (err) {
+		main_free_parsed_info(config);
 		string_free(&http_response);
 		return -1;
 	}
 
+	/* compare with the peers tincd runs with, before $tmpconffile */
+	/* with the applied config is overwritten */
+	if (main_load_applied_peers(config)) {
+		peerdiff_compare(&diff, config->peerid,
+			&config->applied_peer_config, &config->applied_peer_index,
+			&config->peer_config, &config->peer_index);
+	} else {
+		memset(&diff, 0, sizeof(diff));
+		diff.action = PEERDIFF_RESTART;
+		strcpy(diff.reason, "no applied config to compare with");
+	}
+	log_info("Config update: %u nodes added, %u removed, %u changed.",
+		diff.added, diff.removed, diff.changed);
+
 	// tempsave new config
 	main_tempsave_fetched_config(config, &http_response);
+	string_free(&http_response);
 
-	string_free(oldconfig);
-	string_move(&http_response, oldconfig);
-
-	log_debug("Backing up old configs.");
-	if (!main_create_backup(config)) {
-		log_warn("Unable to complete config backup copy from %s to %s.old - ignored.", config->base_path, config->base_path);
+	if (diff.action == PEERDIFF_NONE) {
+		/* the files on disk are what they would be rewritten to */
+		log_info("Config update: %s (%s).", peerdiff_action_name(diff.action), diff.reason);
+		main_keep_applied_peers(config);
+		main_save_applied_digest(config, digest);
+		return 0;
 	}
 
-	log_debug("Cleanup previous host entries.");
-	if (!main_cleanup_hosts_subdir(config)) {
-		log_err("Unable to remove previous host subconfigs from %s/hosts/", config->base_path);
+	/* from here on what is applied is unknown until all is written */
+	main_forget_applied_digest(config);
+	main_forget_applied_peers(config);
+
+	staged = main_stage_begin(config);
+
+	if (!tinc_write_config(config) ||
+			!tinc_write_hosts(config) ||
+			!tinc_write_updown(config, true) ||
+			!tinc_write_updown(config, false) ||
+			!tinc_write_subnetupdown(config, true) ||
+			!tinc_write_subnetupdown(config, false) ||
+			(staged && !main_stage_commit(config))) {
+		if (staged) {
+			main_stage_abort(config);
+		}
+		main_free_parsed_info(config);
 		return -1;
 	}
 
-	if (!tinc_write_config(config)) return -1;
-	if (!tinc_write_hosts(config)) return -1;
-	if (!tinc_write_updown(config, true)) return -1;
-	if (!tinc_write_updown(config, false)) return -1;
-	if (!tinc_write_subnetupdown(config, true)) return -1;
-	if (!tinc_write_subnetupdown(config, false)) return -1;
+	if (config->tincd_restart_needed && (diff.action < PEERDIFF_RESTART)) {
+		diff.action = PEERDIFF_RESTART;
+		strcpy(diff.reason, "tinc.conf settings changed");
+	}
+	log_info("Config update: %s (%s).", peerdiff_action_name(diff.action), diff.reason);
+
+	main_keep_applied_peers(config);
 
-	main_free_parsed_info(config);
+	main_save_applied_digest(config, digest);
 
-	return 1;
+	return diff.action == PEERDIFF_RESTART ? 2 : 1;
 }
 
 static void
@@ -374,12 +500,27 @@ main_check_root(void)
 #endif
 }
 
+/* fans decoded config data out to signature check and digest */
+struct main_config_observer {
+	struct crypto_verify *verify;
+	struct crypto_digest *digest;
+};
+
+static bool
+main_observe_config(void *ctx, const char *buf, size_t len)
+{
+	struct main_config_observer *observer = ctx;
+
+	return crypto_verify_update(observer->verify, buf, len) &&
+		crypto_digest_update(observer->digest, buf, len);
+}
+
 static int
-main_request_config(struct config *config, struct string *http_response)
+main_request_config(struct config *config, struct string *http_response, unsigned char *digest)
 /*
  return -1: error
  return  0: not modified, 304
- return  1: success
+ return  1: success, digest holds the SHA256 of http_response
  */
 {
 	int retval = -1;
@@ -387,13 +528,18 @@ main_request_config(struct config *config, struct string *http_response)
 	int httpres;
 	struct string httpurl;
 	struct string archive;
-	struct string chaosvpn_version;
 	struct string signature;
-	struct string compressed;
-	struct string encrypted;
 	struct string rsa_decrypted;
-	struct string aes_key;
-	struct string aes_iv;
+	struct crypto_verify verify;
+	struct crypto_digest configdigest;
+	struct main_config_observer observer;
+	unsigned long sizehint;
+	struct ar_index index;
+	struct string_view member;
+	struct string_view aes_key;
+	struct string_view aes_iv;
+	struct string_view size;
+	const struct uncompress_codec *codec;
 	char *buf;
 	time_t startfetchtime;
 
@@ -401,21 +547,18 @@ main_request_config(struct config *config, struct string *http_response)
 
 	/* fetch main configfile */
 
-	crypto_init();
-
 	/* basic string inits first, makes for way easier error-cleanup */
 	string_init(&httpurl, 512, 128);
-	string_init(&archive, 8192, 8192);
-	string_lazyinit(&chaosvpn_version, 16);
+	string_init(&archive, 8192, STRING_GROWBY_DOUBLE);
 	string_lazyinit(&signature, 1024);
-	string_lazyinit(&compressed, 8192);
-	string_lazyinit(&encrypted, 8192);
+	memset(&index, 0, sizeof(index));
+	memset(&verify, 0, sizeof(verify));
+	memset(&configdigest, 0, sizeof(configdigest));
 	string_lazyinit(&rsa_decrypted, 1024);
-	string_lazyinit(&aes_key, 64);
-	string_lazyinit(&aes_iv, 64);
 
-	string_concat_sprintf(&httpurl, "%s?id=%s",
+	string_concat_sprintf(&httpurl, "%s?id=%s&codecs=",
 		config->master_url, config->peerid);
+	uncompress_codec_list(&httpurl);
 
 	if ((httpretval = http_get(&httpurl, &archive, config->ifmodifiedsince, &HTTP_USER_AGENT, &httpres, NULL))) {
 		if (httpretval == HTTP_ESRVERR) {
@@ -447,7 +590,10 @@ main_request_config(struct config *config, struct string *http_response)
 			string_free(http_response);
 			string_move(&archive, http_response);
 
-			retval = 1; /* no error */
+			if (crypto_digest_buffer(string_get(http_response),
+					string_length(http_response), digest)) {
+				retval = 1; /* no error */
+			}
 		} else {
 			log_err("Invalid data format received from %s\n", config->master_url);
 		}
@@ -455,28 +601,39 @@ main_request_config(struct config *config, struct string *http_response)
 	}
 
 
+	/* parse and validate all member headers once */
+	/* all members are only referenced in place, not copied */
+	if (!ar_index_build(&index, string_get(&archive), string_length(&archive))) {
+		log_err("Invalid archive received from %s\n", config->master_url);
+		goto bail_out;
+	}
+
 	/* check chaosvpn-version in received ar archive */
-	if (!ar_extract(&archive, "chaosvpn-version", &chaosvpn_version)) {
-		string_free(&chaosvpn_version);
+	if (!ar_index_lookup(&index, "chaosvpn-version", &member)) {
 		log_err("chaosvpn-version missing - can't work with this config\n");
 		goto bail_out;
 	}
-	string_ensurez(&chaosvpn_version);
-	if (strcmp(string_get(&chaosvpn_version), "3") != 0) {
-		string_free(&chaosvpn_version);
+	if (!string_view_equalsz(&member, "3")) {
 		log_err("unusable data-version from backend, we only support version 3!\n");
 		goto bail_out;
 	}
-	string_free(&chaosvpn_version);
 
 	if (str_is_empty(config->masterdata_signkey)) {
 		/* no public key defined, nothing to verify against or to decrypt with */
 		/* expect cleartext part */
 
-		if (!ar_extract(&archive, "cleartext", http_response)) {
+		if (!ar_index_lookup(&index, "cleartext", &member)) {
 			log_err("cleartext part missing - can't work with this config\n");
 			goto bail_out;
 		}
+		string_free(http_response);
+		if (!string_concatb(http_response, member.s, member.length)) {
+			log_err("cleartext copy failed\n");
+			goto bail_out;
+		}
+		if (!crypto_digest_buffer(member.s, member.length, digest)) {
+			goto bail_out;
+		}
 
 		/* return success */
 		retval = 1;
@@ -485,15 +642,14 @@ main_request_config(struct config *config, struct string *http_response)
 
 
 	/* get and decrypt rsa data block */
-	if (!ar_extract(&archive, "rsa", &encrypted)) {
+	if (!ar_index_lookup(&index, "rsa", &member)) {
 		log_err("rsa part in data from %s missing\n", config->master_url);
 		goto bail_out;
 	}
-	if (!crypto_rsa_decrypt(&encrypted, string_get(&config->privkey), &rsa_decrypted)) {
+	if (!crypto_rsa_decrypt_key(&member, crypto_cached_private_key(), &rsa_decrypted)) {
 		log_err("rsa decrypt failed\n");
 		goto bail_out;
 	}
-	string_free(&encrypted);
 
 	/* check and copy data decrypted from rsa block */
 	/* structure:
@@ -519,38 +675,57 @@ main_request_config(struct config *config, struct string *http_response)
 		log_err("rsa decrypt result too short\n");
 		goto bail_out;
 	}
-	string_concatb(&aes_key, buf+2, buf[0]);
-	string_concatb(&aes_iv, buf+2+buf[0], buf[1]);
+	string_view_init(&aes_key, buf+2, buf[0]);
+	string_view_init(&aes_iv, buf+2+buf[0], buf[1]);
 
-	/* get, decrypt and uncompress config data */
-	if (!ar_extract(&archive, "encrypted", &encrypted)) {
-		log_err("encrypted data part in data from %s missing\n", config->master_url);
+	/* get and decrypt signature first, it is needed to verify while inflating */
+	if (!ar_index_lookup(&index, "signature", &member)) {
+		log_err("signature part in data from %s missing\n", config->master_url);
 		goto bail_out;
 	}
-	if (!crypto_aes_decrypt(&encrypted, &aes_key, &aes_iv, &compressed)) {
-		log_err("data decrypt failed\n");
+	if (!crypto_aes_decrypt(&member, &aes_key, &aes_iv, &signature)) {
+		log_err("signature decrypt failed\n");
 		goto bail_out;
 	}
-	string_free(&encrypted);
-	if (!uncompress_inflate(&compressed, http_response)) {
-		log_err("data uncompress failed\n");
+
+	/* decrypt, uncompress and hash config data in one pass */
+	if (!crypto_verify_init_key(&verify, crypto_cached_public_key()) ||
+			!crypto_digest_init(&configdigest)) {
 		goto bail_out;
 	}
-	string_free(&compressed);
+	observer.verify = &verify;
+	observer.digest = &configdigest;
 
-	/* get and decrypt signature */
-	if (!ar_extract(&archive, "signature", &encrypted)) {
-		log_err("signature part in data from %s missing\n", config->master_url);
+	/* optional uncompressed size, only used to size the buffer */
+	sizehint = 0;
+	if (ar_index_lookup(&index, "size", &size)) {
+		(void)string_view_to_ulong(&size, 10, &sizehint);
+	}
+
+	/* optional compression format, zlib if missing */
+	codec = NULL;
+	if (ar_index_lookup(&index, "compression", &member)) {
+		codec = uncompress_codec_find(&member);
+		if (codec == NULL) {
+			log_err("unsupported compression '%.*s' in data from %s\n",
+				(int)member.length, member.s, config->master_url);
+			goto bail_out;
+		}
+	}
+
+	if (!ar_index_lookup(&index, "encrypted", &member)) {
+		log_err("encrypted data part in data from %s missing\n", config->master_url);
 		goto bail_out;
 	}
-	if (!crypto_aes_decrypt(&encrypted, &aes_key, &aes_iv, &signature)) {
-		log_err("signature decrypt failed\n");
+	if (!uncompress_decrypt_inflate(&member, &aes_key, &aes_iv, codec, http_response,
+			sizehint, main_observe_config, &observer)) {
+		log_err("data decrypt or uncompress failed\n");
 		goto bail_out;
 	}
-	string_free(&encrypted);
 
 	/* verify signature */
-	if (crypto_rsa_verify_signature(http_response, &signature, config->masterdata_signkey)) {
+	if (crypto_digest_final(&configdigest, digest) &&
+			crypto_verify_final(&verify, &signature)) {
 	        retval = 1;
         } else {
                 retval = -1;
@@ -560,40 +735,38 @@ bail_out:
 	/* free all strings, even if we may already freed them above */
 	/* double string_free() is ok, and the error cleanup this way is easier */
 	string_free(&httpurl);
+	ar_index_free(&index);
 	string_free(&archive);
-	string_free(&chaosvpn_version);
 	string_free(&signature);
-	string_free(&compressed);
-	string_free(&encrypted);
 	string_free(&rsa_decrypted);
-	string_free(&aes_key);
-	string_free(&aes_iv);
+	crypto_verify_free(&verify);
+	crypto_digest_free(&configdigest);
 
 	// make sure result is null-terminated
-	// ar_extract() and crypto_*_decrypt() do not guarantee this!
+	// the cleartext copy and crypto_*_decrypt() do not guarantee this!
 	string_ensurez(http_response);
 
-	crypto_finish();
-
 	return retval;
 }
 
 static bool
 main_parse_config(struct config *config, struct string *http_response)
 {
-	struct list_head *p = NULL;
+	struct string_view data;
 
-	if (!parser_parse_config(string_get(http_response), &config->peer_config)) {
+	string_view_fromstring(&data, http_response);
+	if (!parser_parse_config(&data, &config->peer_config, &config->peer_arena, &config->peer_index)) {
 		log_err("\nUnable to parse config\n");
 		return false;
 	}
-
-	list_for_each(p, &config->peer_config) {
-		struct peer_config_list *i = container_of(p,
-				struct peer_config_list, list);
-		if (strcmp(i->peer_config->name, config->peerid) == 0) {
-				config->my_peer = i->peer_config;
-		}
+	log_debug("Parsed config: %u allocations served from %u arena blocks (%lu bytes).",
+		config->peer_arena.stat_allocs, config->peer_arena.stat_mallocs,
+		(unsigned long)config->peer_arena.stat_bytes);
+
+	/* the index is case insensitive, our own name has to match exactly */
+	config->my_peer = name_index_lookup(&config->peer_index, config->peerid);
+	if ((config->my_peer != NULL) && strcmp(config->my_peer->name, config->peerid)) {
+		config->my_peer = NULL;
 	}
 
 	if (config->my_peer == NULL) {
@@ -607,7 +780,65 @@ main_parse_config(struct config *config, struct string *http_response)
 static void
 main_free_parsed_info(struct config* config)
 {
-	parser_free_config(&config->peer_config);
+	parser_free_config(&config->peer_config, &config->peer_arena);
+	name_index_clear(&config->peer_index);
+	config->my_peer = NULL;
+}
+
+/* the parsed config is written out, the next update is compared to it */
+static void
+main_keep_applied_peers(struct config *config)
+{
+	struct name_index index;
+
+	main_forget_applied_peers(config);
+
+	list_splice_init(&config->peer_config, &config->applied_peer_config);
+	config->applied_peer_arena = config->peer_arena;
+	arena_init(&config->peer_arena, config->applied_peer_arena.blocksize);
+
+	index = config->applied_peer_index;
+	config->applied_peer_index = config->peer_index;
+	config->peer_index = index;
+	name_index_clear(&config->peer_index);
+
+	config->my_peer = NULL;
+	config->have_applied_peers = true;
+}
+
+static void
+main_forget_applied_peers(struct config *config)
+{
+	parser_free_config(&config->applied_peer_config, &config->applied_peer_arena);
+	name_index_clear(&config->applied_peer_index);
+	config->have_applied_peers = false;
+}
+
+/* after a restart of chaosvpn the applied config is only in $tmpconffile */
+static bool
+main_load_applied_peers(struct config *config)
+{
+	struct string previous;
+	struct string_view data;
+	unsigned char digest[CRYPTO_DIGEST_LENGTH];
+
+	if (config->have_applied_peers) return true;
+	if (!main_is_applied(config, NULL)) return false;
+
+	string_init(&previous, 4096, STRING_GROWBY_DOUBLE);
+	if (main_load_previous_config(config, &previous) &&
+			crypto_digest_buffer(string_get(&previous), string_length(&previous), digest) &&
+			(memcmp(digest, config->applied_digest, CRYPTO_DIGEST_LENGTH) == 0)) {
+		string_view_fromstring(&data, &previous);
+		config->have_applied_peers = parser_parse_config(&data, &config->applied_peer_config,
+			&config->applied_peer_arena, &config->applied_peer_index);
+		if (!config->have_applied_peers) {
+			main_forget_applied_peers(config);
+		}
+	}
+	string_free(&previous);
+
+	return config->have_applied_peers;
 }
 
 static void
@@ -650,41 +881,239 @@ bail_out:
 	return retval;
 }
 
+/* the digest of the applied config is kept next to $tmpconffile */
 static bool
-main_create_backup(struct config *config)
+main_applied_digest_filename(struct config *config, struct string *fn)
 {
-	int retval = false;
-	struct string base_backup_fn;
+	if (str_is_empty(config->tmpconffile)) return false;
 
-	if (!string_init(&base_backup_fn, 512, 512)) return false; /* don't goto bail_out here */
-	if (!string_concat(&base_backup_fn, config->base_path)) goto bail_out;
-	if (!string_concat(&base_backup_fn, ".old")) goto bail_out;
-	string_ensurez(&base_backup_fn);
+	string_init(fn, 512, 512);
+	if (!string_concat(fn, config->tmpconffile) ||
+			!string_concat(fn, ".sha256")) {
+		string_free(fn);
+		return false;
+	}
+	string_ensurez(fn);
+	return true;
+}
 
-	retval = fs_cp_r(config->base_path, string_get(&base_backup_fn));
+static void
+main_hex_encode(struct string *s, const unsigned char *digest)
+{
+	int i;
 
-	/* fall through */
-bail_out:
-	string_free(&base_backup_fn);
-	return retval;
+	for (i = 0; i < CRYPTO_DIGEST_LENGTH; i++) {
+		string_concat_sprintf(s, "%02x", digest[i]);
+	}
 }
 
 static bool
-main_cleanup_hosts_subdir(struct config *config)
+main_hex_decode(struct string_view *hex, unsigned char *digest)
 {
-	bool retval = false;
-	struct string hosts_dir;
+	int i;
+	unsigned int byte;
+	char tmp[3];
+
+	if (hex->length != CRYPTO_DIGEST_LENGTH * 2) return false;
+
+	tmp[2] = 0;
+	for (i = 0; i < CRYPTO_DIGEST_LENGTH; i++) {
+		tmp[0] = hex->s[i * 2];
+		tmp[1] = hex->s[i * 2 + 1];
+		if (!isxdigit((unsigned char)tmp[0]) || !isxdigit((unsigned char)tmp[1]) ||
+				(sscanf(tmp, "%x", &byte) != 1)) {
+			return false;
+		}
+		digest[i] = byte;
+	}
+	return true;
+}
 
-	if (!string_init(&hosts_dir, 512, 512)) return false; /* don't goto bail_out here */
-	if (!string_concat(&hosts_dir, config->base_path)) goto bail_out;
-	if (!string_concat(&hosts_dir, "/hosts")) goto bail_out;
+/*
+ * Restore the digest of the last applied config, saved by a previous run.
+ * Only trusted if the generated tinc config is still there.
+ */
+static void
+main_load_applied_digest(struct config *config)
+{
+	struct string fn;
+	struct string contents;
+	struct string_view rest;
+	struct string_view line;
+	char tmp[1024];
+	struct stat st;
+
+	snprintf(tmp, sizeof(tmp), "%s/tinc.conf", config->base_path);
+	if (stat(tmp, &st)) return;
+
+	if (!main_applied_digest_filename(config, &fn)) return;
+
+	string_lazyinit(&contents, 256);
+	if (fs_read_file(&contents, string_get(&fn))) {
+		/* first line: data digest, second line: local settings digest */
+		string_view_fromstring(&rest, &contents);
+		if (string_view_split(&rest, '\n', &line) &&
+				main_hex_decode(&line, config->applied_digest) &&
+				string_view_split(&rest, '\n', &line) &&
+				main_hex_decode(&line, config->applied_local_digest)) {
+			config->have_applied_digest = true;
+		}
+	}
+
+	string_free(&contents);
+	string_free(&fn);
+}
+
+/* called once everything generated from digest is completely written */
+static void
+main_save_applied_digest(struct config *config, const unsigned char *digest)
+{
+	struct string fn;
+	struct string contents;
+
+	memcpy(config->applied_digest, digest, CRYPTO_DIGEST_LENGTH);
+	memcpy(config->applied_local_digest, config->local_digest, CRYPTO_DIGEST_LENGTH);
+	config->have_applied_digest = true;
+
+	if (!main_applied_digest_filename(config, &fn)) return;
+
+	string_init(&contents, 160, 64);
+	main_hex_encode(&contents, config->applied_digest);
+	string_putc(&contents, '\n');
+	main_hex_encode(&contents, config->applied_local_digest);
+	string_putc(&contents, '\n');
+
+	if (!fs_writecontents(string_get(&fn), string_get(&contents), string_length(&contents), 0600)) {
+		(void)unlink(string_get(&fn));
+		log_debug("Error writing %s: %s", string_get(&fn), strerror(errno));
+	}
+
+	string_free(&contents);
+	string_free(&fn);
+}
+
+static void
+main_forget_applied_digest(struct config *config)
+{
+	struct string fn;
+
+	config->have_applied_digest = false;
+
+	if (!main_applied_digest_filename(config, &fn)) return;
+	(void)unlink(string_get(&fn));
+	string_free(&fn);
+}
+
+/*
+ * An update is generated into base_path.new, which starts as a hard link
+ * snapshot of base_path: keys and *.local files are there, and files the
+ * writers do not replace stay links. main_stage_commit() flushes it and
+ * swaps it with base_path, so tincd and its scripts never see a half
+ * written tree; the previous generation becomes base_path.old.
+ * If no staging directory can be created, everything is written in place.
+ */
+static bool
+main_stage_begin(struct config *config)
+{
+#ifndef WIN32
+	struct string stage;
+	struct stat st;
+	int err;
+
+	if (lstat(config->base_path, &st) || !S_ISDIR(st.st_mode)) {
+		/* a symlink would be replaced by the staged directory */
+		return false;
+	}
+
+	if (!string_init(&stage, 512, 512)) return false;
+	if (!string_concat_sprintf(&stage, "%s.new", config->base_path) ||
+			!string_ensurez(&stage)) {
+		string_free(&stage);
+		return false;
+	}
+
+	/* leftover of an interrupted update */
+	(void)fs_rm_r(string_get(&stage));
+
+	if (!fs_link_r(config->base_path, string_get(&stage))) {
+		err = errno;
+		(void)fs_rm_r(string_get(&stage));
+		log_warn("Unable to create staging directory %s: %s - writing in place.",
+			string_get(&stage), strerror(err));
+		string_free(&stage);
+		return false;
+	}
+
+	config->output_path = strdup(string_get(&stage));
+	string_free(&stage);
+	if (config->output_path == NULL) {
+		return false;
+	}
+	log_debug("Writing configs to %s.", config->output_path);
+	return true;
+#else
+	return false;
+#endif
+}
+
+static bool
+main_stage_commit(struct config *config)
+{
+	struct string backup;
+	bool res = false;
+
+	if (!string_init(&backup, 512, 512)) return false;
+	if (!string_concat_sprintf(&backup, "%s.old", config->base_path) ||
+			!string_ensurez(&backup)) goto bail_out;
+
+	/* one flush for the whole tree instead of one per file */
+	if (!fs_syncfs(config->output_path)) {
+		log_warn("Unable to flush %s: %s", config->output_path, strerror(errno));
+	}
+
+	if (fs_exchange(config->output_path, config->base_path)) {
+		/* the staging directory holds the previous generation now */
+		if (!fs_rm_r(string_get(&backup)) ||
+				rename(config->output_path, string_get(&backup))) {
+			log_warn("Unable to keep the previous configs as %s: %s",
+				string_get(&backup), strerror(errno));
+		}
+	} else {
+		/* no atomic exchange, base_path is missing for a moment */
+		if (!fs_rm_r(string_get(&backup)) ||
+				rename(config->base_path, string_get(&backup))) {
+			log_err("Unable to move %s to %s: %s", config->base_path,
+				string_get(&backup), strerror(errno));
+			goto bail_out;
+		}
+		if (rename(config->output_path, config->base_path)) {
+			log_err("Unable to move %s to %s: %s", config->output_path,
+				config->base_path, strerror(errno));
+			(void)rename(string_get(&backup), config->base_path);
+			goto bail_out;
+		}
+	}
 
-	retval = fs_empty_dir(string_get(&hosts_dir));
+	free(config->output_path);
+	config->output_path = NULL;
+	res = true;
 
 	/* fall through */
 bail_out:
-	string_free(&hosts_dir);
-	return retval;
+	string_free(&backup);
+	return res;
+}
+
+/* discards the staging directory, base_path is unchanged */
+static void
+main_stage_abort(struct config *config)
+{
+	(void)fs_rm_r(config->output_path);
+	free(config->output_path);
+	config->output_path = NULL;
+
+	/* the host files written are gone with it */
+	tinc_forget_hosts(config);
 }
 
 static void
@@ -762,6 +1191,7 @@ fire_up_tincd_handler(struct config* config)
 	snprintf(tincd_debugparam, sizeof(tincd_debugparam), "--debug=%u", config->tincd_debuglevel);
 
 	daemon_init(&di_tincd, config->tincd_bin, config->tincd_bin, "-n", config->networkname, tincd_debugparam, NULL);
+	handler_routes_init(&handler_routes);
 
 	if (!config->oneshot) {
 	        daemon_addparam(&di_tincd, "-D");
@@ -777,6 +1207,16 @@ fire_up_tincd_handler(struct config* config)
 	(void)signal(SIGCHLD, sigchild); 
 	(void)signal(SIGHUP, SIG_IGN);
 
+	if (config->netlink_routes) {
+		/* one socket for the routes, one to learn when the interface is up */
+		handler_routes.fd_netlink = netlink_open(false);
+		fd_netlink_events = netlink_open(true);
+		if ((handler_routes.fd_netlink == -1) || (fd_netlink_events == -1)) {
+			log_err("netlink route backend not available.");
+			exit(1);
+		}
+	}
+
 	/* tell the parent we've started up */
 	if(write(pipefds[1], &foo, 1) != 1) exit(1);
 
@@ -793,6 +1233,11 @@ fire_up_tincd_handler(struct config* config)
 	                        nfds = fileno(di_tincd.di_stderr);
 	                FD_SET(fileno(di_tincd.di_stderr), &readfdset);
                 }
+                if (fd_netlink_events != -1) {
+                        if (fd_netlink_events > nfds)
+                                nfds = fd_netlink_events;
+                        FD_SET(fd_netlink_events, &readfdset);
+                }
 
                 if (select(nfds+1, &readfdset, NULL, NULL, NULL) < 1) {
                         log_err("select failed: %s", strerror(errno));
@@ -808,14 +1253,34 @@ fire_up_tincd_handler(struct config* config)
                                         log_err("error: unable to run tincd.");
                                         exit(1);
                                 }
+                                if (!config->netlink_routes) {
+                                        /* installed by tinc-up */
+                                        handler_routes_load(&handler_routes, config);
+                                } else if (netlink_link_is_up(config->tincd_interface)) {
+                                        /* interface survived from an earlier run */
+                                        handler_routes_add(&handler_routes, config);
+                                }
                                 if (config->oneshot) exit(0);
                                 break;
                         case HANDLER_RESTART_TINCD:
                                 daemon_stop(&di_tincd, 5);
+                                handler_routes_remove(&handler_routes, config);
                                 tinc_invoke_ifdown(config);
+                                if (!config->netlink_routes) {
+                                        /* tinc-up of the restarted tincd */
+                                        handler_routes_load(&handler_routes, config);
+                                }
+                                break;
+                        case HANDLER_APPLY_ROUTES:
+                                handler_routes_apply(&handler_routes, config);
+                                /* rereads hosts/ and the ConnectTo lines */
+                                if (di_tincd.di_pid > 0) {
+                                        (void)kill(di_tincd.di_pid, SIGHUP);
+                                }
                                 break;
                         case HANDLER_STOP:
                                 (void)signal(SIGCHLD, SIG_IGN);
+                                handler_routes_remove(&handler_routes, config);
                                 tinc_invoke_ifdown(config);
                                 daemon_stop(&di_tincd, 5);
                                 exit(0);
@@ -824,6 +1289,19 @@ fire_up_tincd_handler(struct config* config)
                                 break;
                         }
                 }
+                if ((fd_netlink_events != -1) && FD_ISSET(fd_netlink_events, &readfdset)) {
+                        switch (netlink_link_event(fd_netlink_events, config->tincd_interface)) {
+                        case 1:
+                                /* up, usually right after tinc-up */
+                                if (!handler_routes.installed)
+                                        handler_routes_add(&handler_routes, config);
+                                break;
+                        case 0:
+                                /* the kernel dropped the routes with the interface */
+                                handler_routes.installed = false;
+                                break;
+                        }
+                }
                 if (di_tincd.di_stderr && FD_ISSET(fileno(di_tincd.di_stderr), &readfdset)) {
                         char *end;
                         size_t len;
@@ -940,6 +1418,18 @@ handler_signal_old_tincd(void)
 #endif
 }
 
+static void
+handler_apply_routes(void)
+{
+#ifndef WIN32
+	char buf = HANDLER_APPLY_ROUTES;
+	if(write(fd_tincd_handler, &buf, 1) != 1) exit(1);
+#else
+	handler_stop();
+	handler_start_tincd();
+#endif
+}
+
 #ifndef WIN32
 static void
 p_sigchild(int sig/*__unused*/)
@@ -960,12 +1450,18 @@ sigchild(int sig /*__unused*/)
 	pid_t pid;
 	int status;
 
-	pid = waitpid(-1, &status, 0);
-	if ((pid == 0) || (pid == -1 && errno == ECHILD)) {
-	        /* ignore */
-	} else if (pid == -1) {
-	        log_err("some child has terminated, but waitpid() returned error: %s", strerror(errno));
-	} else if (pid == di_tincd.di_pid) {
+	/* never block: a child someone else waits for, like the route */
+	/* shell, may already be gone when this runs */
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if (pid != di_tincd.di_pid) {
+			log_err("some child (pid %d, returncode %d) has terminated; reaping.", pid, WEXITSTATUS(status));
+			continue;
+		}
+
+		/* its interface is gone, and with it all routes via netlink */
+		if (config->netlink_routes) {
+			handler_routes.installed = false;
+		}
 		tinc_invoke_ifdown(config);
 
 		if (WIFEXITED(status) && (WEXITSTATUS(status) == 1)) {
@@ -982,8 +1478,9 @@ sigchild(int sig /*__unused*/)
 			log_err("unable to restart tincd. Terminating.");
 			exit(1);
 		}
-	} else {
-		log_err("some child (pid %d, returncode %d) has terminated; reaping.", pid, WEXITSTATUS(status));
+	}
+	if ((pid == -1) && (errno != ECHILD)) {
+	        log_err("some child has terminated, but waitpid() returned error: %s", strerror(errno));
 	}
 }
 #endif
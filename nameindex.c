@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#include "chaosvpn.h"
+
+/*
+
+name_index: case insensitive hash table from names to pointers
+
+open addressing with linear probing, kept at most half full. names are
+not copied, they have to stay valid while they are in the index, e.g.
+peer names living in the parser arena.
+
+*/
+
+#define NAME_INDEX_MINSLOTS 16
+
+static uint32_t
+name_index_hash(const char *name)
+{
+	/* FNV-1a over the lowercase name */
+	uint32_t hash = 2166136261u;
+	unsigned char c;
+
+	while ((c = *name++)) {
+		if ((c >= 'A') && (c <= 'Z')) {
+			c += 'a' - 'A';
+		}
+		hash ^= c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct name_index_slot *
+name_index_find(struct name_index *index, const char *name, uint32_t hash)
+{
+	struct name_index_slot *slot;
+	unsigned int i;
+
+	for (i = hash & index->slotmask; ; i = (i + 1) & index->slotmask) {
+		slot = &index->slots[i];
+		if ((slot->name == NULL) ||
+				((slot->hash == hash) && (strcasecmp(slot->name, name) == 0))) {
+			return slot;
+		}
+	}
+}
+
+static bool
+name_index_grow(struct name_index *index)
+{
+	struct name_index_slot *old = index->slots;
+	unsigned int oldsize = old ? index->slotmask + 1 : 0;
+	unsigned int size = oldsize ? oldsize * 2 : NAME_INDEX_MINSLOTS;
+	unsigned int i;
+
+	index->slots = calloc(size, sizeof(struct name_index_slot));
+	if (index->slots == NULL) {
+		index->slots = old;
+		log_err("name_index: malloc error\n");
+		return false;
+	}
+	index->slotmask = size - 1;
+
+	for (i = 0; i < oldsize; i++) {
+		if (old[i].name != NULL) {
+			*name_index_find(index, old[i].name, old[i].hash) = old[i];
+		}
+	}
+	free(old);
+
+	return true;
+}
+
+void
+name_index_init(struct name_index *index)
+{
+	memset(index, 0, sizeof(struct name_index));
+}
+
+/* an existing entry with the same name gets the new value, the last one wins */
+bool
+name_index_add(struct name_index *index, const char *name, void *value)
+{
+	struct name_index_slot *slot;
+	uint32_t hash;
+
+	if (((index->count + 1) * 2 > index->slotmask + 1) || (index->slots == NULL)) {
+		if (!name_index_grow(index)) {
+			return false;
+		}
+	}
+
+	hash = name_index_hash(name);
+	slot = name_index_find(index, name, hash);
+	if (slot->name == NULL) {
+		index->count++;
+	}
+	slot->name = name;
+	slot->hash = hash;
+	slot->value = value;
+
+	return true;
+}
+
+/* @returns NULL if name is not in the index */
+void *
+name_index_lookup(struct name_index *index, const char *name)
+{
+	if (index->count == 0) {
+		return NULL;
+	}
+	return name_index_find(index, name, name_index_hash(name))->value;
+}
+
+/* remove all entries, the table is kept for reuse */
+void
+name_index_clear(struct name_index *index)
+{
+	if (index->slots != NULL) {
+		memset(index->slots, 0, (index->slotmask + 1) * sizeof(struct name_index_slot));
+	}
+	index->count = 0;
+}
+
+void
+name_index_free(struct name_index *index)
+{
+	free(index->slots);
+	name_index_init(index);
+}
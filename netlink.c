@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#include "chaosvpn.h"
+
+/*
+
+netlink: route programming for $route_backend "netlink"
+
+instead of forking ip/route once per subnet all routes go through one
+rtnetlink socket. the RTM_NEWROUTE/RTM_DELROUTE requests are packed
+back to back into large datagrams, the kernel acknowledges each one of
+them, failures are matched back to the route by sequence number.
+
+linux only, elsewhere everything fails and config_init() rejects the
+setting.
+
+*/
+
+#ifdef __linux__
+
+/* requests per datagram, their acks have to fit into the receive buffer */
+#define NETLINK_BATCH	128
+
+/* largest request, a route with an ipv6 destination */
+#define NETLINK_ROUTE_SIZE	(NLMSG_SPACE(sizeof(struct rtmsg)) + RTA_SPACE(ADDR_V6_BYTES) + 2 * RTA_SPACE(sizeof(uint32_t)))
+
+/* receive buffer we ask for, room for the acks of several batches */
+#define NETLINK_RCVBUF	(512 * 1024)
+
+/* log at most that many failed routes per batch */
+#define NETLINK_MAXLOG	10
+
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK	10
+#endif
+
+int
+netlink_open(bool link_events)
+{
+	struct sockaddr_nl nladdr;
+	int one = 1;
+	int rcvbuf = NETLINK_RCVBUF;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd == -1) {
+		log_err("netlink: unable to open socket: %s", strerror(errno));
+		return -1;
+	}
+	(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	/* acks without a copy of the request, keeps them small */
+	(void)setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1) {
+		(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	}
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	nladdr.nl_groups = link_events ? RTMGRP_LINK : 0;
+	if (bind(fd, (struct sockaddr *)&nladdr, sizeof(nladdr)) == -1) {
+		log_err("netlink: unable to bind socket: %s", strerror(errno));
+		(void)close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+netlink_add_attr(struct nlmsghdr *nlh, unsigned short type, const void *data, unsigned short len)
+{
+	struct rtattr *rta = (struct rtattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/* append one route request at buf, returns its size */
+static size_t
+netlink_put_route(char *buf, uint32_t seq, bool add, const struct addr_subnet *route, uint32_t ifindex, uint32_t metric)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct rtmsg *rtm;
+
+	memset(buf, 0, NLMSG_SPACE(sizeof(struct rtmsg)));
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	nlh->nlmsg_type = add ? RTM_NEWROUTE : RTM_DELROUTE;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (add) {
+		/* existing routes are taken over, adding is idempotent */
+		nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+	}
+	nlh->nlmsg_seq = seq;
+
+	rtm = NLMSG_DATA(nlh);
+	rtm->rtm_family = route->addr_family;
+	rtm->rtm_dst_len = route->mask_shift;
+	rtm->rtm_table = RT_TABLE_MAIN;
+	rtm->rtm_protocol = RTPROT_BOOT;
+	rtm->rtm_scope = add ? RT_SCOPE_LINK : RT_SCOPE_NOWHERE;
+	rtm->rtm_type = RTN_UNICAST;
+
+	netlink_add_attr(nlh, RTA_DST, route->net_bytes,
+		route->addr_family == AF_INET6 ? ADDR_V6_BYTES : ADDR_V4_BYTES);
+	netlink_add_attr(nlh, RTA_OIF, &ifindex, sizeof(ifindex));
+	netlink_add_attr(nlh, RTA_PRIORITY, &metric, sizeof(metric));
+
+	return NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+static bool
+netlink_send(int fd, const char *buf, size_t len)
+{
+	struct sockaddr_nl nladdr;
+	ssize_t res;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	do {
+		res = sendto(fd, buf, len, 0, (struct sockaddr *)&nladdr, sizeof(nladdr));
+	} while ((res == -1) && (errno == EINTR));
+
+	if (res != (ssize_t)len) {
+		log_err("netlink: send failed: %s", res == -1 ? strerror(errno) : "short write");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Reads acks until all requests from first to last (sequence numbers,
+ * same as the index into routes plus base) are answered.
+ */
+static bool
+netlink_wait_acks(int fd, uint32_t base, unsigned int first, unsigned int last, bool add, const struct route_set *routes, unsigned int *failed)
+{
+	char buf[8192];
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *err;
+	struct string address;
+	unsigned int pending = last - first;
+	unsigned int n;
+	ssize_t len;
+
+	while (pending) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len == -1) {
+			if (errno == EINTR) continue;
+			log_err("netlink: receive failed: %s", strerror(errno));
+			return false;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, (size_t)len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type != NLMSG_ERROR) {
+				continue;
+			}
+			n = nlh->nlmsg_seq - base;
+			if ((n < first) || (n >= last)) {
+				/* late answer from an earlier batch */
+				continue;
+			}
+			pending--;
+
+			err = NLMSG_DATA(nlh);
+			if (err->error == 0) {
+				continue;
+			}
+			if (!add && ((err->error == -ESRCH) || (err->error == -ENOENT) ||
+					(err->error == -ENODEV))) {
+				/* already gone, e.g. with the interface */
+				continue;
+			}
+
+			if (*failed < NETLINK_MAXLOG) {
+				string_init(&address, 64, 64);
+				if (routes_format(&address, &routes->prefix[n]) && string_ensurez(&address)) {
+					log_warn("netlink: unable to %s route %s: %s", add ? "add" : "delete",
+						string_get(&address), strerror(-err->error));
+				}
+				string_free(&address);
+			}
+			(*failed)++;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Adds or deletes all routes via interface ifname in batches of
+ * NETLINK_BATCH requests. failed counts routes the kernel refused, the
+ * result is false only if the socket itself fails.
+ */
+bool
+netlink_route_batch(int fd, const char *ifname, unsigned int metric, bool add, const struct route_set *routes, unsigned int *failed)
+{
+	char *buf;
+	size_t len = 0;
+	uint32_t ifindex;
+	uint32_t base;
+	unsigned int first = 0;
+	unsigned int n;
+	bool res = true;
+
+	*failed = 0;
+	if (routes->count == 0) {
+		return true;
+	}
+
+	ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		if (!add) {
+			/* the kernel removed the routes together with the interface */
+			return true;
+		}
+		log_err("netlink: interface %s not found", ifname);
+		return false;
+	}
+
+	buf = malloc(NETLINK_BATCH * NETLINK_ROUTE_SIZE);
+	if (buf == NULL) {
+		log_err("netlink: malloc error");
+		return false;
+	}
+
+	/* requests carry base + index as sequence number */
+	base = (uint32_t)time(NULL) << 8;
+
+	for (n = 0; n < routes->count; n++) {
+		if (n - first == NETLINK_BATCH) {
+			if (!netlink_send(fd, buf, len) ||
+					!netlink_wait_acks(fd, base, first, n, add, routes, failed)) {
+				res = false;
+				goto bail_out;
+			}
+			len = 0;
+			first = n;
+		}
+		len += netlink_put_route(buf + len, base + n, add, &routes->prefix[n], ifindex, metric);
+	}
+	if (!netlink_send(fd, buf, len) ||
+			!netlink_wait_acks(fd, base, first, n, add, routes, failed)) {
+		res = false;
+	}
+
+bail_out:
+	free(buf);
+	return res;
+}
+
+/*
+ * Drains pending link notifications of a netlink_open(true) socket.
+ * Returns 1 if ifname was reported up, 0 if down or removed, -1 if it
+ * was not mentioned; the last notification wins.
+ */
+int
+netlink_link_event(int fd, const char *ifname)
+{
+	char buf[8192];
+	struct nlmsghdr *nlh;
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	int attrlen;
+	int state = -1;
+	ssize_t len;
+
+	while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, (size_t)len); nlh = NLMSG_NEXT(nlh, len)) {
+			if ((nlh->nlmsg_type != RTM_NEWLINK) && (nlh->nlmsg_type != RTM_DELLINK)) {
+				continue;
+			}
+			ifi = NLMSG_DATA(nlh);
+			attrlen = IFLA_PAYLOAD(nlh);
+			for (rta = IFLA_RTA(ifi); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+				if ((rta->rta_type == IFLA_IFNAME) &&
+						!strncmp(RTA_DATA(rta), ifname, RTA_PAYLOAD(rta))) {
+					state = (nlh->nlmsg_type == RTM_NEWLINK) && (ifi->ifi_flags & IFF_UP);
+					break;
+				}
+			}
+		}
+	}
+
+	return state;
+}
+
+bool
+netlink_link_is_up(const char *ifname)
+{
+	struct ifreq ifr;
+	int fd;
+	bool up;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		return false;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	up = (ioctl(fd, SIOCGIFFLAGS, &ifr) == 0) && (ifr.ifr_flags & IFF_UP);
+	(void)close(fd);
+
+	return up;
+}
+
+#else
+
+int
+netlink_open(bool link_events)
+{
+	log_err("netlink: not supported on this platform");
+	return -1;
+}
+
+bool
+netlink_route_batch(int fd, const char *ifname, unsigned int metric, bool add, const struct route_set *routes, unsigned int *failed)
+{
+	*failed = routes->count;
+	return false;
+}
+
+int
+netlink_link_event(int fd, const char *ifname)
+{
+	return -1;
+}
+
+bool
+netlink_link_is_up(const char *ifname)
+{
+	return false;
+}
+
+#endif
@@ -8,303 +8,605 @@
 
 static struct peer_config *my_config = NULL;
 static struct list_head done_unknown_warnings;
-static bool parse_key_mode;
+static const char *parser_key_start;	/* BEGIN line of the open key, or NULL */
+static struct arena *parser_arena;
+static struct name_index *parser_names;
+static const char *parser_section_start;
+
+enum {
+	PARSER_SUBNETS_NETWORK,
+	PARSER_SUBNETS_NETWORK6,
+	PARSER_SUBNETS_ROUTE_NETWORK,
+	PARSER_SUBNETS_ROUTE_NETWORK6,
+	PARSER_SUBNET_LISTS
+};
+
+/* subnets of the current section are collected here, and copied into */
+/* the arena as one array per list when the section is finished */
+struct parser_subnet_buffer {
+	struct addr_subnet *subnet;
+	unsigned int count;
+	unsigned int alloc;
+};
+static struct parser_subnet_buffer parser_subnets[PARSER_SUBNET_LISTS];
+
+/* shared default for all empty text fields, never modified */
+static char parser_empty[] = "";
+
+enum parser_keyword_id {
+	PARSER_KW_GATEWAYHOST,
+	PARSER_KW_OWNER,
+	PARSER_KW_USE_TCP_ONLY,
+	PARSER_KW_NETWORK,
+	PARSER_KW_NETWORK6,
+	PARSER_KW_ROUTE_NETWORK,
+	PARSER_KW_ROUTE_NETWORK6,
+	PARSER_KW_HIDDEN,
+	PARSER_KW_SILENT,
+	PARSER_KW_PORT,
+	PARSER_KW_INDIRECTDATA,
+	PARSER_KW_CIPHER,
+	PARSER_KW_COMPRESSION,
+	PARSER_KW_DIGEST,
+	PARSER_KW_PRIMARY,
+	PARSER_KW_ED25519PUBLICKEY,
+	PARSER_KW_PINGTEST,
+};
+
+struct parser_keyword {
+	const char *name;
+	size_t length;
+	enum parser_keyword_id id;
+};
+
+/* perfect hash over the text before '=', see parser_keyword_hash() */
+#define PARSER_KEYWORD_SLOTS 64
+
+/*
+ * Keyword table, indexed by parser_keyword_hash(). The hash has no
+ * collisions for this set of keywords; when adding one, put it at the
+ * slot parser_keyword_hash() returns for it, and if that is already
+ * taken choose new multipliers for the hash.
+ */
+static const struct parser_keyword parser_keywords[PARSER_KEYWORD_SLOTS] = {
+	[3] = { "indirectdata", 12, PARSER_KW_INDIRECTDATA },
+	[16] = { "hidden", 6, PARSER_KW_HIDDEN },
+	[18] = { "network", 7, PARSER_KW_NETWORK },
+	[19] = { "cipher", 6, PARSER_KW_CIPHER },
+	[21] = { "compression", 11, PARSER_KW_COMPRESSION },
+	[24] = { "digest", 6, PARSER_KW_DIGEST },
+	[29] = { "owner", 5, PARSER_KW_OWNER },
+	[32] = { "port", 4, PARSER_KW_PORT },
+	[34] = { "route_network", 13, PARSER_KW_ROUTE_NETWORK },
+	[37] = { "gatewayhost", 11, PARSER_KW_GATEWAYHOST },
+	[39] = { "silent", 6, PARSER_KW_SILENT },
+	[40] = { "pingtest", 8, PARSER_KW_PINGTEST },
+	[42] = { "network6", 8, PARSER_KW_NETWORK6 },
+	[48] = { "primary", 7, PARSER_KW_PRIMARY },
+	[55] = { "ed25519publickey", 16, PARSER_KW_ED25519PUBLICKEY },
+	[58] = { "route_network6", 14, PARSER_KW_ROUTE_NETWORK6 },
+	[63] = { "use-tcp-only", 12, PARSER_KW_USE_TCP_ONLY },
+};
+
+/* case insensitive, only looks at first and last char and the length */
+static inline unsigned int
+parser_keyword_hash(const char *s, size_t length)
+{
+	return (((unsigned char)s[0] | 0x20) +
+		2 * ((unsigned char)s[length - 1] | 0x20) +
+		2 * length) & (PARSER_KEYWORD_SLOTS - 1);
+}
+
+/* @returns NULL if label is no known keyword */
+static const struct parser_keyword *
+parser_lookup_keyword(struct string_view *label)
+{
+	const struct parser_keyword *kw;
+
+	if (label->length == 0) {
+		return NULL;
+	}
+	kw = &parser_keywords[parser_keyword_hash(label->s, label->length)];
+	if ((kw->length != label->length) ||
+			(strncasecmp(label->s, kw->name, kw->length) != 0)) {
+		return NULL;
+	}
+	return kw;
+}
 
-static char*
-parser_check_configitem(char *line, char *config)
+static void *
+parser_alloc(size_t size)
 {
-	int len;
+	void *p;
 
-	len = strlen(config);
-	if (!strncasecmp(line, config, len)) {
-		return line + len;
+	p = arena_alloc(parser_arena, size);
+	if (p == NULL) {
+		log_err("parser_alloc: arena_alloc() failed!\n");
+		exit(1);
+	}
+	return p;
+}
+
+static char *
+parser_strdup(struct string_view *item)
+{
+	char *p;
+
+	p = arena_strndup(parser_arena, item->s, item->length);
+	if (p == NULL) {
+		log_err("parser_strdup: arena_strndup() failed!\n");
+		exit(1);
 	}
-	return NULL;
+	return p;
 }
 
 static struct list_head*
-parser_stringlist(char *item)
+parser_stringlist(struct string_view *item)
 {
-	struct string_list *i = malloc(sizeof(struct string_list));
-	if (i == NULL) return NULL;
+	struct string_list *i = parser_alloc(sizeof(struct string_list));
 	memset(i, 0, sizeof(struct string_list));
-	i->text = strdup(item);
+	i->text = parser_strdup(item);
 	return &i->list;
 }
 
+#define PARSER_KEY_BEGIN "-----BEGIN RSA PUBLIC KEY-----"
+#define PARSER_KEY_END "-----END RSA PUBLIC KEY-----"
+
+/* base64 alphabet, '=' is handled separately */
+static const char parser_base64_chars[256] = {
+	['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1,
+	['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1,
+	['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1,
+	['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+	['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1,
+	['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1,
+	['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1,
+	['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+	['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1,
+	['7'] = 1, ['8'] = 1, ['9'] = 1, ['+'] = 1, ['/'] = 1,
+};
+
+/*
+ * Checks one body line of a PEM block, counts base64 chars and '='
+ * padding. Padding is only allowed at the very end of the body.
+ */
+static bool
+parser_check_key_line(struct string_view *line, size_t *chars, int *padding)
+{
+	const unsigned char *c = (const unsigned char *)line->s;
+	const unsigned char *end = c + line->length;
+
+	if (!*padding) {
+		while ((c < end) && parser_base64_chars[*c]) {
+			c++;
+		}
+	}
+	while ((c < end) && (*c == '=')) {
+		c++;
+		if (++*padding > 2) return false;
+	}
+	if (c != end) {
+		return false;
+	}
+	*chars += line->length;
+	return true;
+}
+
+/*
+ * The key is the span of the config from the BEGIN to the END line,
+ * nothing is collected while parsing the lines in between. Once the
+ * END line is seen the span is validated as PEM block and copied into
+ * the arena in one pass, with whitespace around each line removed.
+ * Malformed keys are rejected and leave the key of the peer empty.
+ */
 static void
-parser_extend_key(char *line)
+parser_store_key(const char *end)
 {
-	my_config->key = realloc(
-			my_config->key, 
-			strlen(my_config->key) + strlen(line) + 2
-	);
-	if (my_config->key == NULL) {
-		log_err("parser_extend_key: realloc() failed!\n");
+	struct string_view rest;
+	struct string_view line;
+	size_t chars = 0;
+	int padding = 0;
+	int body = 0;
+	char *key;
+	char *p;
+	const char *error = NULL;
+
+	string_view_init(&rest, parser_key_start, end - parser_key_start);
+	parser_key_start = NULL;
+
+	key = parser_alloc(rest.length + 2);
+	p = key;
+
+	while (string_view_split(&rest, '\n', &line)) {
+		if ((line.length > 0) && (*line.s == '#')) {
+			/* comments and empty lines are skipped, as everywhere else */
+			continue;
+		}
+		string_view_trim(&line);
+		if (line.length == 0) {
+			continue;
+		}
+		if (p == key) {
+			if (!string_view_iequalsz(&line, PARSER_KEY_BEGIN)) {
+				error = "invalid BEGIN line";
+				break;
+			}
+		} else if (rest.length == 0) {
+			if (!string_view_iequalsz(&line, PARSER_KEY_END)) {
+				error = "invalid END line";
+			}
+		} else if (parser_check_key_line(&line, &chars, &padding)) {
+			body++;
+		} else {
+			error = "invalid base64 line";
+			break;
+		}
+		memcpy(p, line.s, line.length);
+		p += line.length;
+		*p++ = '\n';
+	}
+	*p = 0;
+
+	if ((error == NULL) && ((body == 0) || (chars % 4 != 0))) {
+		error = "truncated base64 data";
+	}
+	if (error != NULL) {
+		log_err("node [%s]: rejected malformed public key: %s", my_config->name, error);
+		return;
+	}
+
+	my_config->key = key;
+}
+
+/* called at section end, a key without END line is rejected */
+static void
+parser_finish_key(void)
+{
+	if (parser_key_start == NULL)
+		return;
+
+	log_err("node [%s]: rejected malformed public key: END line missing", my_config->name);
+	parser_key_start = NULL;
+}
+
+static struct subnet_array *
+parser_subnet_array(int list)
+{
+	switch (list) {
+	case PARSER_SUBNETS_NETWORK:
+		return &my_config->network;
+	case PARSER_SUBNETS_NETWORK6:
+		return &my_config->network6;
+	case PARSER_SUBNETS_ROUTE_NETWORK:
+		return &my_config->route_network;
+	default:
+		return &my_config->route_network6;
+	}
+}
+
+static void
+parser_free_subnet_buffers(void)
+{
+	int list;
+
+	for (list = 0; list < PARSER_SUBNET_LISTS; list++) {
+		free(parser_subnets[list].subnet);
+		memset(&parser_subnets[list], 0, sizeof(struct parser_subnet_buffer));
+	}
+}
+
+static void
+parser_finish_section(const char *end)
+{
+	struct parser_subnet_buffer *buffer;
+	struct subnet_array *array;
+	int list;
+
+	/* digest over the raw text of the current section, header included, */
+	/* lets later stages tell which peers changed without comparing fields */
+	if (!crypto_digest_buffer(parser_section_start, end - parser_section_start,
+			my_config->sectiondigest)) {
+		log_err("parser_finish_section: digest failed!\n");
 		exit(1);
 	}
-	strcat(my_config->key, line);
-	strcat(my_config->key, "\n");
+
+	for (list = 0; list < PARSER_SUBNET_LISTS; list++) {
+		buffer = &parser_subnets[list];
+		if (buffer->count == 0)
+			continue;
+
+		array = parser_subnet_array(list);
+		array->subnet = parser_alloc(buffer->count * sizeof(struct addr_subnet));
+		memcpy(array->subnet, buffer->subnet, buffer->count * sizeof(struct addr_subnet));
+		array->count = buffer->count;
+		buffer->count = 0;
+	}
 }
 
 static bool
-parser_create_config(char *name)
+parser_create_config(struct string_view *name)
 {
-	my_config = malloc(sizeof(struct peer_config));
-	if (my_config == NULL) return false;
+	my_config = parser_alloc(sizeof(struct peer_config));
 
 	memset(my_config, 0, sizeof(struct peer_config));
 
-	INIT_LIST_HEAD(&my_config->network);
-	INIT_LIST_HEAD(&my_config->network6);
-	INIT_LIST_HEAD(&my_config->route_network);
-	INIT_LIST_HEAD(&my_config->route_network6);
-
-	my_config->name = strdup(name);
-	my_config->gatewayhost = strdup("");
-	my_config->owner = strdup("");
+	my_config->name = parser_strdup(name);
+	my_config->gatewayhost = parser_empty;
+	my_config->owner = parser_empty;
 	my_config->use_tcp_only = false;
 	my_config->hidden = false;
 	my_config->silent = false;
 	my_config->port = TINC_DEFAULT_PORT;
 	my_config->indirectdata = false;
-	my_config->key = strdup("");
-	my_config->ed25519publickey = strdup("");
-	my_config->cipher = strdup("");
-	my_config->compression = strdup("");
-	my_config->digest = strdup("");
+	my_config->key = parser_empty;
+	my_config->ed25519publickey = parser_empty;
+	my_config->cipher = parser_empty;
+	my_config->compression = parser_empty;
+	my_config->digest = parser_empty;
 	my_config->primary = false;
 
 	return true;
 }
 
-static void
-parser_delete_string_list(struct list_head* list)
+/* everything in configlist lives in arena, so just drop it at once */
+void
+parser_free_config(struct list_head* configlist, struct arena *arena)
 {
-	struct list_head* i;
-	struct list_head* tmp;
-	struct string_list* item;
-
-	list_for_each_safe(i, tmp, list) {
-		item = container_of(i, struct string_list, list);
-		free(item->text);
-		list_del(i);
-		free(item);
-	}
+	INIT_LIST_HEAD(configlist);
+	arena_free(arena);
 }
 
 static void
-parser_free_peer_config(struct peer_config *config)
+parser_replace_item(char **var, struct string_view *newitem)
 {
-	free(config->name);
-	free(config->gatewayhost);
-	free(config->owner);
-	free(config->key);
-	free(config->ed25519publickey);
-	free(config->cipher);
-	free(config->compression);
-	free(config->digest);
-	parser_delete_string_list(&config->network);
-	parser_delete_string_list(&config->network6);
-	parser_delete_string_list(&config->route_network);
-	parser_delete_string_list(&config->route_network6);
+	/* previous value stays in the arena until parser_free_config() */
+	*var = parser_strdup(newitem);
 }
 
-void
-parser_free_config(struct list_head* configlist)
+/* subnets are parsed once here, later stages only use the binary form */
+/* and keep the text for output */
+static void
+parser_add_subnet(int list, struct string_view *item, const unsigned short int family, const char *label)
 {
-	struct list_head* i;
-	struct list_head* tmp;
-	struct peer_config_list* item;
-
-	list_for_each_safe(i, tmp, configlist) {
-		item = container_of(i, struct peer_config_list, list);
-		parser_free_peer_config(item->peer_config);
-		free(item->peer_config);
-		list_del(i);
-		free(item);
+	struct parser_subnet_buffer *buffer = &parser_subnets[list];
+	struct addr_subnet subnet;
+	struct addr_subnet *grown;
+	struct string_view address;
+	char *text;
+
+	text = parser_strdup(item);
+	if (!addrmask_parse_subnet(&subnet, text) || (subnet.addr_family != family)) {
+		log_err("node [%s]: received invalid %s %s='%s'", my_config->name,
+			family == AF_INET ? "ipv4" : "ipv6", label, text);
+		return;
 	}
-	
-}
 
-static void
-parser_replace_item(char **var, char *newitem)
-{
-	free(*var);
-	*var = strdup(newitem);
+	subnet.text = text;
+	subnet.address = text;
+	if (subnet.address_length != item->length) {
+		/* subnet#weight, routes are set without the weight */
+		string_view_init(&address, item->s, subnet.address_length);
+		subnet.address = parser_strdup(&address);
+	}
+
+	if (buffer->count == buffer->alloc) {
+		buffer->alloc = buffer->alloc ? buffer->alloc * 2 : 8;
+		grown = realloc(buffer->subnet, buffer->alloc * sizeof(struct addr_subnet));
+		if (grown == NULL) {
+			log_err("parser_add_subnet: realloc() failed!\n");
+			exit(1);
+		}
+		buffer->subnet = grown;
+	}
+	buffer->subnet[buffer->count++] = subnet;
 }
 
 static void
-parser_warn_unknown(char *line)
+parser_warn_unknown(struct string_view *line)
 {
-	char *label;
-	char *saveptr;
+	struct string_view label;
+	struct string_view rest;
 	struct list_head* ptr;
 	struct string_list *si;
 
-	if (line == NULL)
-		return;
-
-	label = strtok_r(line, "=", &saveptr);
-	if (label == NULL)
+	rest = *line;
+	if (!string_view_split(&rest, '=', &label) || string_view_is_empty(&label))
 		goto output;
 
 	list_for_each(ptr, &done_unknown_warnings) {
 		si = container_of(ptr, struct string_list, list);
 
-		if (strcasecmp(label, si->text) == 0) {
+		if (string_view_iequalsz(&label, si->text)) {
 			/* output already happened */
 			return;
 		}
 	}
 
 	/* remember output */
-	list_add_tail(parser_stringlist(label), &done_unknown_warnings);
+	list_add_tail(parser_stringlist(&label), &done_unknown_warnings);
 
 output:
-	log_warn("parser: warning: unparsed and ignored: '%s' - maybe a newer chaosvpn version needed?\n", line);
+	log_warn("parser: warning: unparsed and ignored: '%.*s' - maybe a newer chaosvpn version needed?\n", (int)line->length, line->s);
+}
+
+static void
+parser_handle_keyword(const struct parser_keyword *kw, struct string_view *item)
+{
+	unsigned long int longport;
+
+	switch (kw->id) {
+	case PARSER_KW_GATEWAYHOST:
+		parser_replace_item(&my_config->gatewayhost, item);
+		break;
+	case PARSER_KW_OWNER:
+		parser_replace_item(&my_config->owner, item);
+		break;
+	case PARSER_KW_USE_TCP_ONLY:
+		my_config->use_tcp_only = string_view_is_true(item, false);
+		break;
+	case PARSER_KW_NETWORK:
+		parser_add_subnet(PARSER_SUBNETS_NETWORK, item, AF_INET, "network");
+		break;
+	case PARSER_KW_NETWORK6:
+		parser_add_subnet(PARSER_SUBNETS_NETWORK6, item, AF_INET6, "network6");
+		break;
+	case PARSER_KW_ROUTE_NETWORK:
+		parser_add_subnet(PARSER_SUBNETS_ROUTE_NETWORK, item, AF_INET, "route_network");
+		break;
+	case PARSER_KW_ROUTE_NETWORK6:
+		parser_add_subnet(PARSER_SUBNETS_ROUTE_NETWORK6, item, AF_INET6, "route_network6");
+		break;
+	case PARSER_KW_HIDDEN:
+		my_config->hidden = string_view_is_true(item, false);
+		break;
+	case PARSER_KW_SILENT:
+		my_config->silent = string_view_is_true(item, false);
+		break;
+	case PARSER_KW_PORT:
+		if (string_view_to_ulong(item, 0, &longport)) {
+			my_config->port = (unsigned short) longport;
+		} else {
+			log_err("node [%s]: received invalid port number '%.*s'", my_config->name, (int)item->length, item->s);
+		}
+		break;
+	case PARSER_KW_INDIRECTDATA:
+		my_config->indirectdata = string_view_is_true(item, false);
+		break;
+	case PARSER_KW_CIPHER:
+		parser_replace_item(&my_config->cipher, item);
+		break;
+	case PARSER_KW_COMPRESSION:
+		parser_replace_item(&my_config->compression, item);
+		break;
+	case PARSER_KW_DIGEST:
+		parser_replace_item(&my_config->digest, item);
+		break;
+	case PARSER_KW_PRIMARY:
+		my_config->primary = string_view_is_true(item, false);
+		break;
+	case PARSER_KW_ED25519PUBLICKEY:
+		parser_replace_item(&my_config->ed25519publickey, item);
+		break;
+	case PARSER_KW_PINGTEST:
+		/* allow, but ignore in chaosvpn client */
+		break;
+	}
+}
+
+/* lines that are neither section header, keyword nor key marker */
+static void
+parser_other_line(struct string_view *line)
+{
+	if (parser_key_start != NULL) {
+		/* part of the key span, checked in parser_store_key() */
+	} else {
+		parser_warn_unknown(line);
+	}
 }
 
 static bool
-parser_parse_line(char *line, struct list_head *configlist)
+parser_parse_line(struct string_view *line, struct list_head *configlist)
 {
-	int len;
-	char *item;
+	struct string_view item;
+	struct string_view label;
+	const struct parser_keyword *kw;
+	const char *equals;
 
-	line = str_trim(line);
-	len = strlen(line);
-	if ((*line == '[') && (line[len - 1] == ']')) {
+	string_view_trim(line);
+	if ((line->length >= 2) && (line->s[0] == '[') && (line->s[line->length - 1] == ']')) {
 		struct peer_config_list *i;
-		parse_key_mode = false;
 
-		item = calloc(sizeof(char), len - 1);
-		if (item == NULL) {
-			free(my_config);
-			my_config = NULL;
-			return false;
-		}
-		memcpy(item, line + 1, len - 2);
-		item[len - 2] = 0;
-
-		i = malloc(sizeof(struct peer_config_list));
-		if (i == NULL) {
-			free(my_config);
-			my_config = NULL;
-			free(item);
-			return false;
+		if (my_config != NULL) {
+			parser_finish_key();
+			parser_finish_section(line->s);
 		}
 
+		i = parser_alloc(sizeof(struct peer_config_list));
 		memset(i, 0, sizeof(struct peer_config_list));
 
-		parser_create_config(item);
+		string_view_init(&item, line->s + 1, line->length - 2);
+		if (!parser_create_config(&item)) {
+			return false;
+		}
 		i->peer_config = my_config;
 		list_add_tail(&i->list, configlist);
-		free(item);
+		if ((parser_names != NULL) &&
+				!name_index_add(parser_names, my_config->name, my_config)) {
+			exit(1);
+		}
+		parser_section_start = line->s;
 	} else if (my_config == NULL) {
 		/* we did not start with a [...] header */
 		/* and my_config is not allocated+initialized yet */
 		/* skip until after first valid header initialized a config section */
 		return true;
-	} else if ((item = parser_check_configitem(line, "gatewayhost="))) {
-		parser_replace_item(&my_config->gatewayhost, item);
-	} else if ((item = parser_check_configitem(line, "owner="))) {
-		parser_replace_item(&my_config->owner, item);
-	} else if ((item = parser_check_configitem(line, "use-tcp-only="))) {
-		my_config->use_tcp_only = str_is_true(item, false);
-	} else if ((item = parser_check_configitem(line, "network="))) {
-		if (addrmask_verify_subnet(item, AF_INET)) {
-			list_add_tail(parser_stringlist(item), &my_config->network);
-		} else {
-			log_err("node [%s]: received invalid ipv4 network='%s'", my_config->name, item);
-		}
-	} else if ((item = parser_check_configitem(line, "network6="))) {
-		if (addrmask_verify_subnet(item, AF_INET6)) {
-			list_add_tail(parser_stringlist(item), &my_config->network6);
-		} else {
-			log_err("node [%s]: received invalid ipv6 network6='%s'", my_config->name, item);
-		}
-	} else if ((item = parser_check_configitem(line, "route_network="))) {
-		if (addrmask_verify_subnet(item, AF_INET)) {
-			list_add_tail(parser_stringlist(item), &my_config->route_network);
-		} else {
-			log_err("node [%s]: received invalid ipv4 route_network='%s'", my_config->name, item);
-		}
-	} else if ((item = parser_check_configitem(line, "route_network6="))) {
-		if (addrmask_verify_subnet(item, AF_INET6)) {
-			list_add_tail(parser_stringlist(item), &my_config->route_network6);
+	} else if ((line->length > 0) && (*line->s == '-')) {
+		if (string_view_has_iprefix(line, PARSER_KEY_BEGIN)) {
+			/* a second BEGIN restarts the key */
+			parser_key_start = line->s;
+		} else if (string_view_has_iprefix(line, PARSER_KEY_END)) {
+			if (parser_key_start != NULL) {
+				parser_store_key(line->s + line->length);
+			} else {
+				log_err("node [%s]: rejected malformed public key: BEGIN line missing", my_config->name);
+			}
 		} else {
-			log_err("node [%s]: received invalid ipv6 route_network6='%s'", my_config->name, item);
+			parser_other_line(line);
 		}
-	} else if ((item = parser_check_configitem(line, "hidden="))) {
-		my_config->hidden = str_is_true(item, false);
-	} else if ((item = parser_check_configitem(line, "silent="))) {
-		my_config->silent = str_is_true(item, false);
-	} else if ((item = parser_check_configitem(line, "port="))) {
-		unsigned long int longport = strtoul(item, NULL, 0);
-		if (longport != ULONG_MAX) {
-			my_config->port = (unsigned short) longport;
-		} else {
-			log_err("node [%s]: received invalid port number '%s'", my_config->name, item);
-		}
-	} else if ((item = parser_check_configitem(line, "indirectdata="))) {
-		my_config->indirectdata = str_is_true(item, false);
-	} else if ((item = parser_check_configitem(line, "cipher="))) {
-		parser_replace_item(&my_config->cipher, item);
-	} else if ((item = parser_check_configitem(line, "compression="))) {
-		parser_replace_item(&my_config->compression, item);
-	} else if ((item = parser_check_configitem(line, "digest="))) {
-		parser_replace_item(&my_config->digest, item);
-	} else if ((item = parser_check_configitem(line, "primary="))) {
-		my_config->primary = str_is_true(item, false);
-	} else if ((item = parser_check_configitem(line, "ed25519publickey="))) {
-		parser_replace_item(&my_config->ed25519publickey, item);
-	} else if ((item = parser_check_configitem(line, "pingtest="))) {
-		/* allow, but ignore in chaosvpn client */
-	} else if ((item = parser_check_configitem(line, "-----BEGIN RSA PUBLIC KEY-----"))) {
-		free(my_config->key);
-		my_config->key = calloc(sizeof(char), strlen(line) + 2);
-		memcpy(my_config->key, line, strlen(line));
-		strcat(my_config->key, "\n");
-		parse_key_mode = true;
-	} else if ((item = parser_check_configitem(line, "-----END RSA PUBLIC KEY-----"))) {
-		parser_extend_key(line);
-		parse_key_mode = false;
+	} else if ((equals = memchr(line->s, '=', line->length)) == NULL) {
+		/* key body lines end up here without any keyword lookup */
+		parser_other_line(line);
 	} else {
-		if (parse_key_mode) {
-			parser_extend_key(line);
-		} else {
-			parser_warn_unknown(line);
+		string_view_init(&label, line->s, equals - line->s);
+		kw = parser_lookup_keyword(&label);
+		if (kw == NULL) {
+			/* includes base64 lines with '=' padding */
+			parser_other_line(line);
+			return true;
 		}
+		string_view_init(&item, equals + 1, line->length - label.length - 1);
+		parser_handle_keyword(kw, &item);
 	}
 	return true;
 }
 
+/* parses the config in data without modifying or copying it as a whole */
+/* all results are allocated from arena, see parser_free_config() */
+/* if names is not NULL, every peer is added to it by name */
 bool
-parser_parse_config (char *data, struct list_head *config_list)
+parser_parse_config (struct string_view *data, struct list_head *config_list, struct arena *arena, struct name_index *names)
 {
-	char *token;
-	char *search = "\n";
-	char *saveptr;
+	struct string_view rest;
+	struct string_view line;
+	bool retval = false;
 
 	my_config = NULL;
-	parse_key_mode = false;
+	parser_key_start = NULL;
+	parser_arena = arena;
+	parser_names = names;
 	INIT_LIST_HEAD(&done_unknown_warnings);
 
-	data = strdup(data);
-	token = strtok_r(data, search, &saveptr);
-	while (token) {
-		if (strncmp(token, "#", 1) &&
-				!parser_parse_line(token, config_list))  {
-			free(data);
-			parser_delete_string_list(&done_unknown_warnings);
-			return false;
+	rest = *data;
+	while (string_view_split(&rest, '\n', &line)) {
+		if (string_view_is_empty(&line) || (*line.s == '#')) {
+			continue;
+		}
+		if (!parser_parse_line(&line, config_list))  {
+			goto bail_out;
 		}
-		token = strtok_r(NULL, search, &saveptr);
 	}
-	free(data);
+	if (my_config != NULL) {
+		parser_finish_key();
+		parser_finish_section(data->s + data->length);
+	}
 
-	parser_delete_string_list(&done_unknown_warnings);
+	retval = true;
 
-	return true;
-}
+bail_out:
+	parser_free_subnet_buffers();
+	parser_arena = NULL;
+	parser_names = NULL;
+	my_config = NULL;
 
+	return retval;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "chaosvpn.h"
+
+/*
+
+peerdiff: compares the peers of a new config with the ones tincd runs
+with, and classifies what the update needs:
+
+- nothing, only fields no generated file uses changed (owner, ...)
+- reload, host files or ConnectTo lines changed, tincd rereads them on
+  SIGHUP and the routes are updated by difference
+- restart, our own node or a key changed
+
+unchanged sections are skipped by their sectiondigest, only the others
+are compared field by field.
+
+*/
+
+static const char *peerdiff_action_names[] = {
+	"nothing to do",
+	"reload tincd",
+	"restart tincd",
+};
+
+const char *
+peerdiff_action_name(enum peerdiff_action action)
+{
+	return peerdiff_action_names[action];
+}
+
+static bool
+peerdiff_subnets_equal(const struct subnet_array *a, const struct subnet_array *b)
+{
+	unsigned int n;
+
+	if (a->count != b->count) {
+		return false;
+	}
+	for (n = 0; n < a->count; n++) {
+		if ((a->subnet[n].addr_family != b->subnet[n].addr_family) ||
+				(a->subnet[n].mask_shift != b->subnet[n].mask_shift) ||
+				(a->subnet[n].weight != b->subnet[n].weight) ||
+				memcmp(a->subnet[n].net_bytes, b->subnet[n].net_bytes, ADDR_MAX_BYTES)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* @returns the first field tincd sees that differs, NULL if none */
+static const char *
+peerdiff_tinc_field(const struct peer_config *a, const struct peer_config *b)
+{
+	if (strcmp(a->name, b->name)) return "name";
+	if (strcmp(a->gatewayhost, b->gatewayhost)) return "gatewayhost";
+	if (a->hidden != b->hidden) return "hidden";
+	if (a->silent != b->silent) return "silent";
+	if (a->primary != b->primary) return "primary";
+	if (a->port != b->port) return "port";
+	if (strcmp(a->cipher, b->cipher)) return "cipher";
+	if (strcmp(a->compression, b->compression)) return "compression";
+	if (strcmp(a->digest, b->digest)) return "digest";
+	if (a->indirectdata != b->indirectdata) return "indirectdata";
+	if (a->use_tcp_only != b->use_tcp_only) return "use-tcp-only";
+	if (!peerdiff_subnets_equal(&a->network, &b->network)) return "network";
+	if (!peerdiff_subnets_equal(&a->network6, &b->network6)) return "network6";
+	return NULL;
+}
+
+/* raise diff to action, the first reason for the highest action stays */
+static void
+peerdiff_note(struct peerdiff *diff, enum peerdiff_action action, const char *format, ...)
+{
+	va_list args;
+
+	if (action <= diff->action) {
+		return;
+	}
+	diff->action = action;
+	va_start(args, format);
+	vsnprintf(diff->reason, sizeof(diff->reason), format, args);
+	va_end(args);
+}
+
+/*
+ * Compares the peers in list/index (new) with prev_list/prev_index (the
+ * applied config). ownname is our own node.
+ */
+void
+peerdiff_compare(struct peerdiff *diff, const char *ownname, struct list_head *prev_list, struct name_index *prev_index, struct list_head *list, struct name_index *index)
+{
+	struct list_head *p;
+	struct peer_config *peer;
+	struct peer_config *prev;
+	const char *field;
+	bool own;
+
+	memset(diff, 0, sizeof(struct peerdiff));
+	strcpy(diff->reason, "no relevant change");
+
+	list_for_each(p, list) {
+		peer = container_of(p, struct peer_config_list, list)->peer_config;
+		own = !strcmp(peer->name, ownname);
+
+		prev = name_index_lookup(prev_index, peer->name);
+		if (prev == NULL) {
+			diff->added++;
+			peerdiff_note(diff, own ? PEERDIFF_RESTART : PEERDIFF_RELOAD, "node %s added", peer->name);
+			continue;
+		}
+		if (!memcmp(prev->sectiondigest, peer->sectiondigest, CRYPTO_DIGEST_LENGTH)) {
+			continue;
+		}
+		diff->changed++;
+
+		if (strcmp(prev->key, peer->key) || strcmp(prev->ed25519publickey, peer->ed25519publickey)) {
+			peerdiff_note(diff, PEERDIFF_RESTART, "key of node %s changed", peer->name);
+		} else if ((field = peerdiff_tinc_field(prev, peer)) != NULL) {
+			peerdiff_note(diff, own ? PEERDIFF_RESTART : PEERDIFF_RELOAD,
+				"node %s changed %s", peer->name, field);
+		}
+	}
+
+	list_for_each(p, prev_list) {
+		prev = container_of(p, struct peer_config_list, list)->peer_config;
+		if (name_index_lookup(index, prev->name) == NULL) {
+			diff->removed++;
+			peerdiff_note(diff, !strcmp(prev->name, ownname) ? PEERDIFF_RESTART : PEERDIFF_RELOAD,
+				"node %s removed", prev->name);
+		}
+	}
+}
@@ -0,0 +1,373 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+
+#include "chaosvpn.h"
+
+/*
+
+routes: reduces the subnets routed through the vpn interface to the
+minimal set of prefixes that cover exactly the same addresses.
+
+redundant prefixes (inside another one) are dropped, and two sibling
+prefixes (the two halves of the same parent) are replaced by the parent
+for as long as possible. an aggregate is only the union of routes that
+are installed anyway, but it still never grows over a protected prefix
+(excluded, ignored or local subnets), those keep their neighbours as
+separate routes.
+
+*/
+
+#define ROUTES_MINSIZE 64
+
+static int
+routes_compare(const void *a, const void *b)
+{
+	const struct addr_subnet *x = a;
+	const struct addr_subnet *y = b;
+	int res;
+
+	if (x->addr_family != y->addr_family) {
+		return x->addr_family < y->addr_family ? -1 : 1;
+	}
+	res = memcmp(x->net_bytes, y->net_bytes, ADDR_MAX_BYTES);
+	if (res) {
+		return res;
+	}
+	return (int)x->mask_shift - (int)y->mask_shift;
+}
+
+/* does a cover b */
+static bool
+routes_covers(const struct addr_subnet *a, const struct addr_subnet *b)
+{
+	unsigned int bytes = a->mask_shift / CHAR_BIT;
+	unsigned int bits = a->mask_shift % CHAR_BIT;
+
+	if ((a->addr_family != b->addr_family) || (a->mask_shift > b->mask_shift)) {
+		return false;
+	}
+	if (memcmp(a->net_bytes, b->net_bytes, bytes)) {
+		return false;
+	}
+	return !bits ||
+		!((a->net_bytes[bytes] ^ b->net_bytes[bytes]) & (0xff << (CHAR_BIT - bits)));
+}
+
+bool
+routes_set_add(struct route_set *set, const struct addr_subnet *subnet)
+{
+	struct addr_subnet *prefix;
+	unsigned int size;
+
+	if (set->count == set->size) {
+		size = set->size ? set->size * 2 : ROUTES_MINSIZE;
+		prefix = realloc(set->prefix, size * sizeof(struct addr_subnet));
+		if (prefix == NULL) {
+			log_err("routes: malloc error\n");
+			return false;
+		}
+		set->prefix = prefix;
+		set->size = size;
+	}
+
+	set->prefix[set->count++] = *subnet;
+	return true;
+}
+
+void
+routes_init(struct route_aggregate *agg)
+{
+	memset(agg, 0, sizeof(struct route_aggregate));
+}
+
+/* a subnet routed through the vpn interface */
+bool
+routes_add(struct route_aggregate *agg, const struct addr_subnet *subnet)
+{
+	agg->subnets++;
+	return routes_set_add(&agg->routes, subnet);
+}
+
+/* a subnet no aggregate may cover */
+bool
+routes_protect(struct route_aggregate *agg, const struct addr_subnet *subnet)
+{
+	return routes_set_add(&agg->protected, subnet);
+}
+
+void
+routes_subnet_from_info(struct addr_subnet *subnet, const struct addr_info *info)
+{
+	memset(subnet, 0, sizeof(struct addr_subnet));
+	memcpy(subnet->net_bytes, info->net_bytes, info->addr_byte_count);
+	subnet->addr_family = info->addr_family;
+	subnet->mask_shift = info->mask_shift;
+	subnet->weight = -1;
+}
+
+bool
+routes_protect_list(struct route_aggregate *agg, struct addr_info *list)
+{
+	struct addr_subnet subnet;
+
+	for (; list; list = list->next) {
+		routes_subnet_from_info(&subnet, list);
+		if (!routes_protect(agg, &subnet)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* is there a protected prefix inside parent, protected is sorted */
+static bool
+routes_is_protected(struct route_aggregate *agg, const struct addr_subnet *parent)
+{
+	struct route_set *protected = &agg->protected;
+	unsigned int low = 0;
+	unsigned int high = protected->count;
+	unsigned int mid;
+
+	/* first protected prefix not sorting before parent, prefixes */
+	/* inside parent follow it directly */
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (routes_compare(&protected->prefix[mid], parent) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return (low < protected->count) && routes_covers(parent, &protected->prefix[low]);
+}
+
+/* if a and b are the two halves of one prefix, store it in parent */
+static bool
+routes_siblings(const struct addr_subnet *a, const struct addr_subnet *b, struct addr_subnet *parent)
+{
+	unsigned int bit;
+
+	if ((a->addr_family != b->addr_family) || (a->mask_shift != b->mask_shift) ||
+			(a->mask_shift == 0)) {
+		return false;
+	}
+
+	bit = a->mask_shift - 1;
+	memset(parent, 0, sizeof(struct addr_subnet));
+	memcpy(parent->net_bytes, a->net_bytes, ADDR_MAX_BYTES);
+	parent->net_bytes[bit / CHAR_BIT] &= ~(0x80 >> (bit % CHAR_BIT));
+	parent->addr_family = a->addr_family;
+	parent->mask_shift = bit;
+	parent->weight = -1;
+
+	/* a is the lower half, b the upper one */
+	return !memcmp(parent->net_bytes, a->net_bytes, ADDR_MAX_BYTES) &&
+		(b->net_bytes[bit / CHAR_BIT] & (0x80 >> (bit % CHAR_BIT))) &&
+		routes_covers(parent, b);
+}
+
+/*
+ * Replaces agg->routes with the aggregated routes, sorted by address.
+ * One pass over the sorted prefixes with the result as a stack: a
+ * prefix inside the top of the stack is redundant, otherwise it is
+ * pushed and merged with its sibling below as long as that works.
+ */
+void
+routes_aggregate(struct route_aggregate *agg)
+{
+	struct addr_subnet *prefix = agg->routes.prefix;
+	struct addr_subnet parent;
+	unsigned int count = 0;
+	unsigned int n;
+
+	if (agg->routes.count == 0) {
+		return;
+	}
+
+	qsort(agg->routes.prefix, agg->routes.count, sizeof(struct addr_subnet), routes_compare);
+	qsort(agg->protected.prefix, agg->protected.count, sizeof(struct addr_subnet), routes_compare);
+
+	for (n = 0; n < agg->routes.count; n++) {
+		if (count && routes_covers(&prefix[count - 1], &prefix[n])) {
+			continue;
+		}
+		prefix[count++] = prefix[n];
+
+		while ((count >= 2) &&
+				routes_siblings(&prefix[count - 2], &prefix[count - 1], &parent) &&
+				!routes_is_protected(agg, &parent)) {
+			prefix[count - 2] = parent;
+			count--;
+		}
+	}
+	agg->routes.count = count;
+}
+
+/* address/prefixlen of route, the received text if it is unchanged */
+bool
+routes_format(struct string *target, const struct addr_subnet *route)
+{
+	char address[INET6_ADDRSTRLEN];
+
+	if (route->address) {
+		return string_concatb(target, route->address, route->address_length);
+	}
+
+	if (inet_ntop(route->addr_family, route->net_bytes, address, sizeof(address)) == NULL) {
+		return false;
+	}
+	return string_concat_sprintf(target, "%s/%d", address, route->mask_shift);
+}
+
+/* one route per line, as read by routes_load() */
+bool
+routes_save(const struct route_set *set, const char *filename)
+{
+	struct string contents;
+	unsigned int n;
+	bool res = true;
+
+	if (!string_init(&contents, 32 * set->count + 64, STRING_GROWBY_DOUBLE)) return false;
+
+	for (n = 0; n < set->count; n++) {
+		if (!routes_format(&contents, &set->prefix[n]) || !string_putc(&contents, '\n')) {
+			res = false;
+			break;
+		}
+	}
+	if (res && !fs_replacecontents(filename, string_get(&contents), string_length(&contents), 0600)) {
+		log_err("unable to write %s", filename);
+		res = false;
+	}
+
+	string_free(&contents);
+	return res;
+}
+
+/* replaces the contents of set, a missing file is an empty set */
+bool
+routes_load(struct route_set *set, const char *filename)
+{
+	struct string contents;
+	struct string_view view;
+	struct string_view line;
+	struct addr_subnet subnet;
+	char text[INET6_ADDRSTRLEN + 8];
+	bool res = true;
+
+	set->count = 0;
+
+	string_init(&contents, 4096, STRING_GROWBY_DOUBLE);
+	if (!fs_read_file(&contents, (char *)filename)) {
+		string_free(&contents);
+		return true;
+	}
+
+	string_view_fromstring(&view, &contents);
+	while (string_view_split(&view, '\n', &line)) {
+		if (line.length == 0) {
+			continue;
+		}
+		if (line.length >= sizeof(text)) {
+			log_err("%s: invalid route", filename);
+			res = false;
+			break;
+		}
+		memcpy(text, line.s, line.length);
+		text[line.length] = 0;
+		if (!addrmask_parse_subnet(&subnet, text)) {
+			log_err("%s: invalid route '%s'", filename, text);
+			res = false;
+			break;
+		}
+		if (!routes_set_add(set, &subnet)) {
+			res = false;
+			break;
+		}
+	}
+
+	string_free(&contents);
+	return res;
+}
+
+/* sort set and drop duplicates, a shell generated set has them */
+static void
+routes_set_sort(struct route_set *set)
+{
+	unsigned int count = 0;
+	unsigned int n;
+
+	if (set->count == 0) {
+		return;
+	}
+
+	qsort(set->prefix, set->count, sizeof(struct addr_subnet), routes_compare);
+	for (n = 1; n < set->count; n++) {
+		if (routes_compare(&set->prefix[count], &set->prefix[n])) {
+			set->prefix[++count] = set->prefix[n];
+		}
+	}
+	set->count = count + 1;
+}
+
+/*
+ * Routes to change to get from the installed set prev to next: added
+ * gets the ones only in next, removed the ones only in prev. Both input
+ * sets are sorted and deduplicated in place, then merged in one pass.
+ */
+bool
+routes_diff(struct route_set *prev, struct route_set *next, struct route_set *added, struct route_set *removed)
+{
+	unsigned int p = 0;
+	unsigned int n = 0;
+	int res;
+
+	routes_set_sort(prev);
+	routes_set_sort(next);
+
+	while ((p < prev->count) || (n < next->count)) {
+		if (p == prev->count) {
+			res = 1;
+		} else if (n == next->count) {
+			res = -1;
+		} else {
+			res = routes_compare(&prev->prefix[p], &next->prefix[n]);
+		}
+
+		if (res < 0) {
+			if (!routes_set_add(removed, &prev->prefix[p])) return false;
+			p++;
+		} else if (res > 0) {
+			if (!routes_set_add(added, &next->prefix[n])) return false;
+			n++;
+		} else {
+			p++;
+			n++;
+		}
+	}
+
+	return true;
+}
+
+void
+routes_set_free(struct route_set *set)
+{
+	free(set->prefix);
+	memset(set, 0, sizeof(struct route_set));
+}
+
+void
+routes_free(struct route_aggregate *agg)
+{
+	routes_set_free(&agg->routes);
+	routes_set_free(&agg->protected);
+	agg->subnets = 0;
+}
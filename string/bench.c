@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "string.h"
+
+/*
+ * micro-benchmark for struct string growth policies.
+ *
+ * appends chunks the same way httprecv() fills the download buffer and
+ * compares fixed growby steps against STRING_GROWBY_DOUBLE.
+ */
+
+#define BENCH_TOTAL (4 * 1024 * 1024)
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(const char *label, size_t isize, size_t growby, size_t chunk)
+{
+    struct string s;
+    char *buf;
+    size_t appends;
+    size_t i;
+    double start;
+    double elapsed;
+
+    buf = malloc(chunk);
+    if (buf == NULL) exit(1);
+    for (i = 0; i < chunk; i++) buf[i] = 'a' + (i % 26);
+
+    appends = BENCH_TOTAL / chunk;
+    start = now();
+    string_init(&s, isize, growby);
+    for (i = 0; i < appends; i++) {
+        if (!string_concatb(&s, buf, chunk)) {
+            printf("%s: append failed\n", label);
+            exit(1);
+        }
+    }
+    elapsed = now() - start;
+
+    printf("%-8s chunk=%5lu growby=%6s: %10.0f appends/s (%lu bytes, size %lu)\n",
+            label, (unsigned long)chunk,
+            growby == STRING_GROWBY_DOUBLE ? "double" : "fixed",
+            appends / (elapsed > 0 ? elapsed : 1e-9),
+            (unsigned long)string_length(&s), (unsigned long)string_size(&s));
+
+    string_free(&s);
+    free(buf);
+}
+
+int main(int argc, char** argv)
+{
+    /* download path: 8 KB recv() chunks into a 4096/512 buffer */
+    bench("before", 4096, 512, 8192);
+    bench("after", 4096, STRING_GROWBY_DOUBLE, 8192);
+
+    /* many small appends, e.g. from string_concat_sprintf() */
+    bench("before", 4096, 512, 16);
+    bench("after", 4096, STRING_GROWBY_DOUBLE, 16);
+
+    return 0;
+}
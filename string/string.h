@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdarg.h>
 
 
 /* FUNCTIONS WORKING WITH struct string */
@@ -19,6 +20,9 @@ struct string {
     char* s;
 };
 
+/* special growby value: double the allocation instead of fixed steps */
+#define STRING_GROWBY_DOUBLE ((size_t)-1)
+
 void string_clear(struct string*);
 bool string_concat(struct string*, const char*);
 bool string_concatb(struct string*, const char*, size_t);
@@ -33,10 +37,29 @@ bool string_equals(struct string*, struct string*);
 void string_lazyinit(struct string*, size_t);
 bool string_initfromstringz(struct string*, const char *);
 bool string_read(struct string*, const int, const size_t, intptr_t*);
+bool string_reserve(struct string*, size_t);
 void string_hexdump(struct string*, const void *, const size_t);
 void debug_hexdump(const void *, const size_t);
 
 
+struct string_template_part;
+
+/* format string split into literal spans and argument slots */
+struct string_template {
+    struct string_template_part* parts;
+    size_t count;
+    size_t alloc;
+    size_t literal_length;  /* sum of all literal spans */
+    size_t nargs;           /* number of arguments consumed */
+    char* text;
+};
+
+bool string_template_compile(struct string_template*, const char*);
+bool string_template_render(struct string*, const struct string_template*, ...);
+bool string_template_vrender(struct string*, const struct string_template*, va_list);
+void string_template_free(struct string_template*);
+
+
 static inline size_t string_length(struct string *s) {
     /* amount of bytes filled with content */
     return s->length;
@@ -74,6 +97,126 @@ string_mkstatic(struct string* s, char* z)
 }
 
 
+/* FUNCTIONS WORKING WITH struct string_view */
+/* ----------------------------------------- */
+
+/* non-owning reference to length bytes at s, not zero-terminated */
+struct string_view {
+    const char* s;
+    size_t length;
+};
+
+bool string_view_split(struct string_view*, int, struct string_view*);
+bool string_view_to_ulong(struct string_view*, int, unsigned long*);
+char* string_view_strdup(struct string_view*);
+
+
+static inline void
+string_view_init(struct string_view* v, const char* s, size_t length)
+{
+    v->s = s;
+    v->length = length;
+}
+
+static inline void
+string_view_fromz(struct string_view* v, const char* z)
+{
+    v->s = z;
+    v->length = strlen(z);
+}
+
+static inline void
+string_view_fromstring(struct string_view* v, struct string* s)
+{
+    v->s = s->s;
+    v->length = s->length;
+}
+
+static inline bool
+string_view_is_empty(struct string_view* v)
+{
+    return v->length == 0;
+}
+
+static inline bool
+string_view_equals(struct string_view* v1, struct string_view* v2)
+{
+    if (v1->length != v2->length) return false;
+    return memcmp(v1->s, v2->s, v1->length) == 0;
+}
+
+static inline bool
+string_view_equalsz(struct string_view* v, const char* z)
+{
+    size_t l = strlen(z);
+
+    if (v->length != l) return false;
+    return memcmp(v->s, z, l) == 0;
+}
+
+static inline bool
+string_view_iequalsz(struct string_view* v, const char* z)
+{
+    size_t l = strlen(z);
+
+    if (v->length != l) return false;
+    return strncasecmp(v->s, z, l) == 0;
+}
+
+/* case sensitive prefix match */
+static inline bool
+string_view_has_prefix(struct string_view* v, const char* prefix)
+{
+    size_t l = strlen(prefix);
+
+    if (v->length < l) return false;
+    return memcmp(v->s, prefix, l) == 0;
+}
+
+/* case insensitive prefix match */
+static inline bool
+string_view_has_iprefix(struct string_view* v, const char* prefix)
+{
+    size_t l = strlen(prefix);
+
+    if (v->length < l) return false;
+    return strncasecmp(v->s, prefix, l) == 0;
+}
+
+/* drop n bytes from the front of the view */
+static inline void
+string_view_skip(struct string_view* v, size_t n)
+{
+    if (n > v->length) n = v->length;
+    v->s += n;
+    v->length -= n;
+}
+
+/* remove leading and trailing whitespace, no data is modified */
+static inline void
+string_view_trim(struct string_view* v)
+{
+    while (v->length && isspace((unsigned char)*v->s)) {
+        ++v->s;
+        --v->length;
+    }
+    while (v->length && isspace((unsigned char)v->s[v->length - 1]))
+        --v->length;
+}
+
+static inline bool
+string_view_is_true(struct string_view* v, bool def)
+{
+    if (string_view_equalsz(v, "0") || string_view_iequalsz(v, "no")) {
+        return false;
+    } else if (string_view_equalsz(v, "1") || string_view_iequalsz(v, "yes")) {
+        return true;
+    } else {
+        return def;
+    }
+}
+
+
 /* FUNCTIONS WORKING WITH PLAIN char* */
 /* ---------------------------------- */
 
@@ -7,16 +7,8 @@
 bool
 string_putc(struct string* s, char c)
 {
-    size_t growby;
-    char* buf;
-
     if (s->size == s->length) {
-        growby = s->growby;
-        buf = realloc(s->s, s->size + growby);
-        if (!buf) return false;
-        memset(buf+s->size, 0, growby);
-        s->size += growby;
-        s->s = buf;
+        if (!string_reserve(s, 1)) return false;
     }
     *(s->s + s->length) = c;
     ++s->length;
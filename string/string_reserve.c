@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "string.h"
+
+/* first allocation for geometric growth of a yet unallocated string */
+#define STRING_DOUBLE_MINSIZE 64
+
+/**
+ * Makes sure that at least len more bytes fit into the string without
+ * another realloc(). Callers knowing the final size in advance can use
+ * this as a capacity hint.
+ *
+ * Growth follows s->growby: either fixed steps of growby bytes, or
+ * doubling of the current size for STRING_GROWBY_DOUBLE, which keeps
+ * repeated appends at amortised O(1).
+ * Newly allocated memory is not zero-filled.
+ *
+ * @returns false on overflow, allocation failure or a non-growing string
+ */
+bool
+string_reserve(struct string* s, size_t len)
+{
+    size_t needed;
+    size_t newsize;
+    size_t steps;
+    char* buf;
+
+    if (len <= (s->size - s->length)) return true;
+    if (s->growby == 0) return false;
+
+    needed = s->length + len;
+    if (needed < s->length) return false;
+
+    if (s->growby == STRING_GROWBY_DOUBLE) {
+        newsize = s->size ? s->size : STRING_DOUBLE_MINSIZE;
+        while (newsize < needed) {
+            if ((newsize * 2) < newsize) {
+                newsize = needed;
+                break;
+            }
+            newsize *= 2;
+        }
+    } else {
+        /* smallest multiple of growby on top of the current size */
+        steps = (needed - s->size + s->growby - 1) / s->growby;
+        if (steps > (((size_t)-1) - s->size) / s->growby) return false;
+        newsize = s->size + steps * s->growby;
+    }
+
+    buf = realloc(s->s, newsize);
+    if (!buf) return false;
+    s->size = newsize;
+    s->s = buf;
+    return true;
+}
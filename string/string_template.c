@@ -0,0 +1,280 @@
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "string.h"
+
+/*
+ * Precompiled format strings.
+ *
+ * string_template_compile() splits a format once into literal spans and
+ * argument slots, string_template_render() then only copies spans and
+ * arguments into the target string. Formats and arguments are the same as
+ * for string_concat_sprintf(): %s, %S (struct string*), %d and printf
+ * style conversions with flags, width, precision and an optional 'l'.
+ */
+
+enum {
+    STRING_TEMPLATE_LITERAL,
+    STRING_TEMPLATE_S,
+    STRING_TEMPLATE_BIGS,
+    STRING_TEMPLATE_D,
+    STRING_TEMPLATE_FORMAT
+};
+
+struct string_template_part {
+    int type;
+    const char* s;      /* literal text, or zero-terminated printf format */
+    size_t length;      /* length of literal text */
+    char conversion;    /* conversion char for STRING_TEMPLATE_FORMAT */
+    bool islong;        /* 'l' length modifier seen */
+};
+
+/* rough space per argument used for the initial reservation */
+#define STRING_TEMPLATE_ARGSIZE 16
+
+static bool
+string_template_addpart(struct string_template* t, int type, const char* s, size_t length)
+{
+    struct string_template_part* parts;
+    size_t alloc;
+
+    if (t->count == t->alloc) {
+        alloc = t->alloc ? t->alloc * 2 : 8;
+        parts = realloc(t->parts, alloc * sizeof(struct string_template_part));
+        if (parts == NULL) return false;
+        t->parts = parts;
+        t->alloc = alloc;
+    }
+    memset(&t->parts[t->count], 0, sizeof(struct string_template_part));
+    t->parts[t->count].type = type;
+    t->parts[t->count].s = s;
+    t->parts[t->count].length = length;
+    t->count++;
+
+    if (type == STRING_TEMPLATE_LITERAL) {
+        t->literal_length += length;
+    } else {
+        t->nargs++;
+    }
+    return true;
+}
+
+static bool
+string_template_isflag(char c)
+{
+    return ((c >= '0') && (c <= '9')) || (c == '.') || (c == ' ') ||
+        (c == '#') || (c == '+') || (c == '-') || (c == '\'');
+}
+
+/**
+ * Parses fmt into t. fmt is copied, it does not need to stay around.
+ * @returns false on allocation failure or unsupported conversions
+ */
+bool
+string_template_compile(struct string_template* t, const char* fmt)
+{
+    size_t len;
+    char* text;
+    char* spec;
+    char* p;
+    char* lit;
+    char* start;
+    struct string_template_part* part;
+
+    memset(t, 0, sizeof(struct string_template));
+
+    /* fmt copy for literals, followed by zero-terminated conversions */
+    len = strlen(fmt);
+    t->text = malloc(2 * len + 2);
+    if (t->text == NULL) return false;
+    text = t->text;
+    memcpy(text, fmt, len + 1);
+    spec = text + len + 1;
+
+    lit = text;
+    for (p = text; *p; p++) {
+        if (*p != '%') continue;
+
+        if (p > lit) {
+            if (!string_template_addpart(t, STRING_TEMPLATE_LITERAL, lit, p - lit)) goto bail_out;
+        }
+
+        start = p++;
+        switch (*p) {
+        case '\0':
+            /* trailing '%' is dropped, as by string_concat_sprintf() */
+            lit = p--;
+            continue;
+
+        case '%':
+            if (!string_template_addpart(t, STRING_TEMPLATE_LITERAL, p, 1)) goto bail_out;
+            break;
+
+        case 's':
+            if (!string_template_addpart(t, STRING_TEMPLATE_S, NULL, 0)) goto bail_out;
+            break;
+
+        case 'S':
+            if (!string_template_addpart(t, STRING_TEMPLATE_BIGS, NULL, 0)) goto bail_out;
+            break;
+
+        case 'd':
+            if (!string_template_addpart(t, STRING_TEMPLATE_D, NULL, 0)) goto bail_out;
+            break;
+
+        default:
+            while (string_template_isflag(*p)) p++;
+            if (!string_template_addpart(t, STRING_TEMPLATE_FORMAT, spec, 0)) goto bail_out;
+            part = &t->parts[t->count - 1];
+            if (*p == 'l') {
+                part->islong = true;
+                p++;
+            }
+            if ((*p == '\0') || !strchr("diouxXcsfeEgG", *p)) goto bail_out;
+            if (part->islong && !strchr("diouxX", *p)) goto bail_out;
+            part->conversion = *p;
+            memcpy(spec, start, p - start + 1);
+            spec += p - start + 1;
+            *spec++ = '\0';
+        }
+        lit = p + 1;
+    }
+    if (p > lit) {
+        if (!string_template_addpart(t, STRING_TEMPLATE_LITERAL, lit, p - lit)) goto bail_out;
+    }
+
+    return true;
+
+bail_out:
+    string_template_free(t);
+    return false;
+}
+
+void
+string_template_free(struct string_template* t)
+{
+    free(t->parts);
+    free(t->text);
+    memset(t, 0, sizeof(struct string_template));
+}
+
+/* printf one argument of a complex conversion directly into s */
+static bool
+string_template_format(struct string* s, struct string_template_part* part, va_list* args)
+{
+    char* a_s = NULL;
+    int a_i = 0;
+    long a_l = 0;
+    unsigned int a_u = 0;
+    unsigned long a_ul = 0;
+    double a_f = 0;
+    int len;
+    int pass;
+
+    switch (part->conversion) {
+    case 's':
+        a_s = va_arg(*args, char*);
+        break;
+    case 'd': case 'i': case 'c':
+        if (part->islong) a_l = va_arg(*args, long);
+        else a_i = va_arg(*args, int);
+        break;
+    case 'o': case 'u': case 'x': case 'X':
+        if (part->islong) a_ul = va_arg(*args, unsigned long);
+        else a_u = va_arg(*args, unsigned int);
+        break;
+    default:
+        a_f = va_arg(*args, double);
+    }
+
+    /* first pass measures, second pass writes into reserved space */
+    len = 0;
+    for (pass = 0; pass < 2; pass++) {
+        char* out = pass ? s->s + s->length : NULL;
+        size_t outlen = pass ? (size_t)len + 1 : 0;
+
+        switch (part->conversion) {
+        case 's':
+            len = snprintf(out, outlen, part->s, a_s);
+            break;
+        case 'd': case 'i': case 'c':
+            if (part->islong) len = snprintf(out, outlen, part->s, a_l);
+            else len = snprintf(out, outlen, part->s, a_i);
+            break;
+        case 'o': case 'u': case 'x': case 'X':
+            if (part->islong) len = snprintf(out, outlen, part->s, a_ul);
+            else len = snprintf(out, outlen, part->s, a_u);
+            break;
+        default:
+            len = snprintf(out, outlen, part->s, a_f);
+        }
+        if (len < 0) return false;
+        if (!pass && !string_reserve(s, (size_t)len + 1)) return false;
+    }
+    s->length += len;
+    return true;
+}
+
+bool
+string_template_vrender(struct string* s, const struct string_template* t, va_list args)
+{
+    struct string_template_part* part;
+    char* a_s;
+    struct string* a_S;
+    va_list ap;
+    bool retval = false;
+
+    if (!string_reserve(s, t->literal_length + t->nargs * STRING_TEMPLATE_ARGSIZE + 1)) return false;
+
+    va_copy(ap, args);
+    for (part = t->parts; part < t->parts + t->count; part++) {
+        switch (part->type) {
+        case STRING_TEMPLATE_LITERAL:
+            if (!string_concatb(s, part->s, part->length)) goto bail_out;
+            break;
+
+        case STRING_TEMPLATE_S:
+            a_s = va_arg(ap, char*);
+            if (!string_concatb(s, a_s, strlen(a_s))) goto bail_out;
+            break;
+
+        case STRING_TEMPLATE_BIGS:
+            a_S = va_arg(ap, struct string*);
+            if (!string_concats(s, a_S)) goto bail_out;
+            break;
+
+        case STRING_TEMPLATE_D:
+            if (!string_putint(s, va_arg(ap, int))) goto bail_out;
+            break;
+
+        default:
+            if (!string_template_format(s, part, &ap)) goto bail_out;
+        }
+    }
+
+    /* zero-terminate like string_concat_sprintf(), without counting it */
+    if (!string_putc(s, 0)) goto bail_out;
+    --s->length;
+
+    retval = true;
+
+bail_out:
+    va_end(ap);
+    return retval;
+}
+
+bool
+string_template_render(struct string* s, const struct string_template* t, ...)
+{
+    va_list args;
+    bool retval;
+
+    va_start(args, t);
+    retval = string_template_vrender(s, t, args);
+    va_end(args);
+
+    return retval;
+}
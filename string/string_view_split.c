@@ -0,0 +1,32 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "string.h"
+
+/**
+ * Cuts the next token up to delimiter from the front of rest. The
+ * delimiter itself is consumed, but not part of token. Nothing is copied,
+ * token points into the memory referenced by rest.
+ * @returns false if rest was already empty
+ */
+bool
+string_view_split(struct string_view* rest, int delimiter, struct string_view* token)
+{
+    const char* end;
+
+    if (rest->length == 0) return false;
+
+    token->s = rest->s;
+    end = memchr(rest->s, delimiter, rest->length);
+    if (end == NULL) {
+        token->length = rest->length;
+        rest->s += rest->length;
+        rest->length = 0;
+    } else {
+        token->length = end - rest->s;
+        rest->s = end + 1;
+        rest->length -= token->length + 1;
+    }
+    return true;
+}
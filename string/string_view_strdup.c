@@ -0,0 +1,17 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "string.h"
+
+/* returns a malloc()ed, zero-terminated copy of the view */
+char*
+string_view_strdup(struct string_view* v)
+{
+    char* z;
+
+    z = malloc(v->length + 1);
+    if (z == NULL) return NULL;
+    memcpy(z, v->s, v->length);
+    z[v->length] = 0;
+    return z;
+}
@@ -0,0 +1,30 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+#include "string.h"
+
+/**
+ * Parses the complete view as unsigned number, base as for strtoul().
+ * @returns false on empty input, trailing garbage or overflow
+ */
+bool
+string_view_to_ulong(struct string_view* v, int base, unsigned long* result)
+{
+    char buf[32];
+    char* endp;
+    unsigned long r;
+
+    if ((v->length == 0) || (v->length >= sizeof(buf))) return false;
+    if (*v->s == '-') return false;
+
+    memcpy(buf, v->s, v->length);
+    buf[v->length] = 0;
+    r = strtoul(buf, &endp, base);
+    if (*endp) return false;
+    if (r == ULONG_MAX) return false;
+
+    *result = r;
+    return true;
+}
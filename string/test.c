@@ -6,12 +6,13 @@
 int main(int argc, char** argv)
 {
     struct string args;
+    struct string_template tmpl;
     int i; int j; int k;
 
     string_init(&args, 1, 1);
     string_concatb(&args, "foo", 3);
     string_concatb(&args, "b", 1);
-    printf("%d\n", args.length);
+    printf("%zu\n", args.length);
     for (i = 0; i < argc; i++) string_concat(&args, *argv++);
     puts(string_get(&args));
     string_free(&args);
@@ -23,11 +24,30 @@ int main(int argc, char** argv)
             for (i = 0; i < 100; i++) {
                 string_concat(&args, "test");
             }
-            printf("100x test == %d len, %d size, %d grow\n", args.length,
+            printf("100x test == %zu len, %zu size, %zu grow\n", args.length,
                     args.size, args.growby);
             string_free(&args);
         }
     }
 
+    printf("Testing with isize=1 growby=double\n");
+    string_init(&args, 1, STRING_GROWBY_DOUBLE);
+    for (i = 0; i < 100; i++) {
+        string_concat(&args, "test");
+    }
+    printf("100x test == %zu len, %zu size\n", args.length, args.size);
+    string_free(&args);
+
+    printf("Testing templates\n");
+    string_init(&args, 1, STRING_GROWBY_DOUBLE);
+    if (!string_template_compile(&tmpl, "%s=%d %5.2f%% [%-4s|%lx]%")) {
+        puts("template compile failed");
+        return 1;
+    }
+    string_template_render(&args, &tmpl, "port", 655, 3.14159, "ab", 255UL);
+    puts(string_get(&args));
+    string_template_free(&tmpl);
+    string_free(&args);
+
     return 0;
 }
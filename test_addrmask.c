@@ -7,12 +7,165 @@
 #include <netdb.h>
 
 #include "chaosvpn.h"
+#include "bench.h"
 #include "addrmask.h"
 
 struct addr_info ip;
 struct string str;
 bool ret;
 
+#define TEST_PREFIXES	400
+#define TEST_QUERIES	100000
+
+static unsigned int test_seed = 12345;
+
+/* deterministic, results are reproducible */
+static unsigned int
+test_random(void)
+{
+	test_seed = test_seed * 1103515245 + 12345;
+	return (test_seed >> 8) & 0xffffff;
+}
+
+/* random prefix in a small part of the address space, so that */
+/* queries and prefixes overlap a lot */
+static void
+test_random_subnet(char *buf, size_t len, bool v6, int minbits)
+{
+	unsigned char addr[ADDR_MAX_BYTES];
+	char text[INET6_ADDRSTRLEN];
+	int bits;
+	int i;
+
+	memset(addr, 0, sizeof(addr));
+	if (v6) {
+		addr[0] = 0xfd;
+		for (i = 1; i < 16; i++) {
+			addr[i] = (i < 3) ? (test_random() & 3) : test_random();
+		}
+		bits = minbits + test_random() % (129 - minbits);
+	} else {
+		addr[0] = 10;
+		addr[1] = test_random() & 7;
+		addr[2] = test_random();
+		addr[3] = test_random();
+		bits = minbits + test_random() % (33 - minbits);
+	}
+	inet_ntop(v6 ? AF_INET6 : AF_INET, addr, text, sizeof(text));
+	snprintf(buf, len, "%s/%d", text, bits);
+}
+
+/* reference: does entry cover subnet */
+static bool
+test_covers(struct addr_info *entry, struct addr_subnet *subnet)
+{
+	int i;
+
+	if ((entry->addr_family != subnet->addr_family) ||
+			(subnet->mask_shift < entry->mask_shift)) {
+		return false;
+	}
+	for (i = 0; i < entry->addr_byte_count; i++) {
+		if ((subnet->net_bytes[i] & entry->mask_bytes[i]) != entry->net_bytes[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Cross-checks addrmask_trie against the list matcher and a brute force
+ * search for the longest and shortest covering prefix, then compares the
+ * speed of both.
+ */
+static void
+test_trie(void)
+{
+	struct addr_info *list = NULL;
+	struct addr_info *entry;
+	struct addr_info *longest;
+	struct addr_info *shortest;
+	struct addr_subnet *queries;
+	struct addrmask_trie trie;
+	char buf[64];
+	int maxbits;
+	int minbits;
+	int matches = 0;
+	int i;
+	double start;
+	double listtime;
+	double trietime;
+
+	for (i = 0; i < TEST_PREFIXES; i++) {
+		test_random_subnet(buf, sizeof(buf), i & 1, (i & 1) ? 16 : 8);
+		entry = addrmask_init(buf);
+		if (entry == NULL) {
+			log_err("addrmask_init(\"%s\") failed.\n", buf);
+			exit(1);
+		}
+		entry->next = list;
+		list = entry;
+	}
+	if (!addrmask_trie_build(&trie, list)) {
+		log_err("addrmask_trie_build() failed.\n");
+		exit(1);
+	}
+
+	queries = malloc(TEST_QUERIES * sizeof(struct addr_subnet));
+	for (i = 0; i < TEST_QUERIES; i++) {
+		test_random_subnet(buf, sizeof(buf), i & 1, (i & 1) ? 16 : 8);
+		if (!addrmask_parse_subnet(&queries[i], buf)) {
+			log_err("addrmask_parse_subnet(\"%s\") failed.\n", buf);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < TEST_QUERIES; i++) {
+		maxbits = -1;
+		minbits = 256;
+		for (entry = list; entry; entry = entry->next) {
+			if (test_covers(entry, &queries[i])) {
+				if (entry->mask_shift > maxbits) maxbits = entry->mask_shift;
+				if (entry->mask_shift < minbits) minbits = entry->mask_shift;
+			}
+		}
+		longest = addrmask_trie_match(&trie, &queries[i]);
+		shortest = addrmask_trie_covering(&trie, &queries[i]);
+
+		if (((maxbits >= 0) != (addrmask_match_subnet(list, &queries[i]) != NULL)) ||
+				((maxbits >= 0) != (longest != NULL)) ||
+				((maxbits >= 0) != (shortest != NULL)) ||
+				(longest && (longest->mask_shift != maxbits)) ||
+				(shortest && (shortest->mask_shift != minbits))) {
+			log_err("trie mismatch for query %d: expected /%d../%d\n", i, minbits, maxbits);
+			exit(1);
+		}
+		if (longest) {
+			matches++;
+		}
+	}
+	log_info("trie cross-check ok: %d prefixes, %d queries, %d covered\n",
+		TEST_PREFIXES, TEST_QUERIES, matches);
+
+	start = bench_now();
+	for (i = 0; i < TEST_QUERIES; i++) {
+		(void)addrmask_match_subnet(list, &queries[i]);
+	}
+	listtime = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < TEST_QUERIES; i++) {
+		(void)addrmask_trie_covering(&trie, &queries[i]);
+	}
+	trietime = bench_now() - start;
+
+	log_info("%d lookups: list %.3fs, trie %.3fs\n", TEST_QUERIES, listtime, trietime);
+
+	free(queries);
+	addrmask_trie_free(&trie);
+	addrmask_free(list);
+}
+
 int
 main (int argc,char *argv[])
 {
@@ -62,6 +215,8 @@ main (int argc,char *argv[])
 	log_info("addrmask_to_string(): %s\n", string_get(&str));
 	string_free(&str);
 
+	test_trie();
+
 	log_info("test_addrmask finished.\n");
 	exit(0);
 }
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
+
+#include "chaosvpn.h"
+
+/*
+ * Drives the shell route backend of the tincd handler: the routes file
+ * tinc-up installed is loaded, a config update replaces half of the
+ * routes, and handler_routes_apply() has to run $routedel for exactly
+ * the vanished routes and $routeadd for the new ones, with INTERFACE
+ * set. The commands only log into a file, no privileges needed. A
+ * SIGCHLD handler that reaps every child, like the one of the handler
+ * process, is installed the whole time.
+ *
+ * usage: test_handler_routes [routes]
+ */
+
+#ifndef WIN32
+
+#define TEST_INTERFACE	"cvtest0"
+
+static unsigned int test_reaped = 0;
+
+static void
+test_sigchild(int sig)
+{
+	int status;
+
+	while (waitpid(-1, &status, WNOHANG) > 0) {
+		test_reaped++;
+	}
+}
+
+/* routes numbered from first on, even ones ipv4, odd ones ipv6 */
+static void
+test_write_routes(struct config *config, unsigned int first, unsigned int count)
+{
+	struct string contents;
+	struct string filename;
+	unsigned int n;
+
+	string_init(&contents, 32 * count, STRING_GROWBY_DOUBLE);
+	for (n = first; n < first + count; n++) {
+		if (n & 1) {
+			string_concat_sprintf(&contents, "2001:db8:%x:%x::/64\n", n >> 16, n & 0xffff);
+		} else {
+			string_concat_sprintf(&contents, "198.18.%u.%u/32\n", (n >> 8) & 255, n & 255);
+		}
+	}
+	if (!tinc_routes_filename(config->base_path, &filename) ||
+			!fs_writecontents(string_get(&filename), string_get(&contents), string_length(&contents), 0600)) {
+		log_err("unable to write the routes file\n");
+		exit(1);
+	}
+	string_free(&filename);
+	string_free(&contents);
+}
+
+/* lines in log starting with prefix, all of them have to end with */
+/* the interface */
+static unsigned int
+test_count_commands(const char *log, const char *prefix)
+{
+	char line[256];
+	unsigned int count = 0;
+	FILE *f;
+
+	f = fopen(log, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, prefix, strlen(prefix))) {
+			continue;
+		}
+		if (strstr(line, " " TEST_INTERFACE "\n") == NULL) {
+			log_err("command without INTERFACE: %s", line);
+			exit(1);
+		}
+		count++;
+	}
+	fclose(f);
+	return count;
+}
+
+static char *
+test_command(const char *dir, const char *action)
+{
+	char buf[512];
+
+	snprintf(buf, sizeof(buf), "echo %s %%s $INTERFACE >>%s/log", action, dir);
+	return strdup(buf);
+}
+
+int
+main (int argc,char *argv[])
+{
+	char dir[] = "/tmp/test_handler_routes.XXXXXX";
+	char log[sizeof(dir) + 8];
+	struct handler_routes handler;
+	struct route_set routes;
+	struct config *config;
+	unsigned int count = 1000;
+
+	log_init(&argc, &argv, LOG_PID, LOG_DAEMON);
+
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	/* the update replaces half of them, as many ipv4 as ipv6 */
+	count &= ~3U;
+
+	if (mkdtemp(dir) == NULL) {
+		log_err("unable to create a directory in /tmp\n");
+		exit(1);
+	}
+	snprintf(log, sizeof(log), "%s/log", dir);
+	(void)signal(SIGCHLD, test_sigchild);
+
+	config = config_alloc();
+	config->base_path = strdup(dir);
+	config->tincd_interface = strdup(TEST_INTERFACE);
+	config->routeadd = test_command(dir, "add");
+	config->routeadd6 = test_command(dir, "add6");
+	config->routedel = test_command(dir, "del");
+	config->routedel6 = test_command(dir, "del6");
+	config->netlink_routes = false;
+
+	/* what tinc-up installed */
+	handler_routes_init(&handler);
+	test_write_routes(config, 0, count);
+	handler_routes_load(&handler, config);
+	if (!handler.installed || (handler.routes.count != count)) {
+		log_err("load: %u routes, expected %u\n", handler.routes.count, count);
+		exit(1);
+	}
+
+	/* the update */
+	test_write_routes(config, count / 2, count);
+	handler_routes_apply(&handler, config);
+	if ((test_count_commands(log, "del ") != count / 4) ||
+			(test_count_commands(log, "del6 ") != count / 4) ||
+			(test_count_commands(log, "add ") != count / 4) ||
+			(test_count_commands(log, "add6 ") != count / 4)) {
+		log_err("apply: expected %u commands of each kind\n", count / 4);
+		exit(1);
+	}
+	if (handler.routes.count != count) {
+		log_err("apply: %u routes installed, expected %u\n", handler.routes.count, count);
+		exit(1);
+	}
+
+	/* the exit status counts, also of a command before the last one: */
+	/* installed routes are sorted, the ipv4 one runs first */
+	memset(&routes, 0, sizeof(routes));
+	routes_set_add(&routes, &handler.routes.prefix[0]);
+	routes_set_add(&routes, &handler.routes.prefix[count - 1]);
+	if (!handler_routes_run(config, &routes, true)) {
+		log_err("run: succeeding commands reported as failed\n");
+		exit(1);
+	}
+	free(config->routeadd);
+	free(config->routeadd6);
+	config->routeadd = strdup("false");
+	config->routeadd6 = strdup("true");
+	if (handler_routes_run(config, &routes, true)) {
+		log_err("run: failing command not reported\n");
+		exit(1);
+	}
+
+	log_info("test_handler_routes finished, %u children reaped by SIGCHLD.\n", test_reaped);
+
+	routes_set_free(&routes);
+	handler_routes_free(&handler);
+	(void)fs_rm_r(dir);
+	config_free(config);
+	return 0;
+}
+
+#else
+
+int
+main (int argc,char *argv[])
+{
+	fprintf(stderr, "the tincd handler does not run on windows\n");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#include "chaosvpn.h"
+#include "bench.h"
+
+/*
+ * Installs, re-installs, updates and removes a few thousand routes
+ * through the netlink backend and checks the kernel routing table after
+ * each step. The update replaces half of the routes, as the handler does
+ * it on a config update: only the difference is applied.
+ * Needs CAP_NET_ADMIN, best run in its own network namespace:
+ *
+ *   unshare -rn sh -c 'ip link add cvtest type dummy &&
+ *       ip link set cvtest up && ./test_netlink cvtest'
+ *
+ * usage: test_netlink <interface> [routes]
+ */
+
+#ifdef __linux__
+
+/* routes in the main table via ifindex that were added like ip route add */
+static int
+test_count_routes(int family, unsigned int ifindex)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct rtmsg rtm;
+	} req;
+	struct sockaddr_nl nladdr;
+	char buf[16384];
+	struct nlmsghdr *nlh;
+	struct rtmsg *rtm;
+	struct rtattr *rta;
+	int attrlen;
+	int count = 0;
+	int fd;
+	ssize_t len;
+
+	fd = netlink_open(false);
+	if (fd == -1) {
+		exit(1);
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.nlh.nlmsg_type = RTM_GETROUTE;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.rtm.rtm_family = family;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	if (sendto(fd, &req, req.nlh.nlmsg_len, 0, (struct sockaddr *)&nladdr, sizeof(nladdr)) == -1) {
+		log_err("route dump failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len <= 0) {
+			log_err("route dump failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, (size_t)len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				close(fd);
+				return count;
+			}
+			if (nlh->nlmsg_type != RTM_NEWROUTE) {
+				continue;
+			}
+			rtm = NLMSG_DATA(nlh);
+			if ((rtm->rtm_table != RT_TABLE_MAIN) || (rtm->rtm_protocol != RTPROT_BOOT)) {
+				continue;
+			}
+			attrlen = RTM_PAYLOAD(nlh);
+			for (rta = RTM_RTA(rtm); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+				if ((rta->rta_type == RTA_OIF) && (*(unsigned int *)RTA_DATA(rta) == ifindex)) {
+					count++;
+				}
+			}
+		}
+	}
+}
+
+/* count routes, numbered from first on */
+static void
+test_make_routes(struct route_set *routes, unsigned int first, unsigned int count)
+{
+	struct route_aggregate agg;
+	struct addr_subnet subnet;
+	char text[64];
+	unsigned int n;
+
+	routes_init(&agg);
+	for (n = first; n < first + count; n++) {
+		if (n & 1) {
+			snprintf(text, sizeof(text), "2001:db8:%x:%x::/64", n >> 16, n & 0xffff);
+		} else {
+			snprintf(text, sizeof(text), "198.18.%u.%u/32", (n >> 8) & 255, n & 255);
+		}
+		if (!addrmask_parse_subnet(&subnet, text) || !routes_add(&agg, &subnet)) {
+			log_err("unable to create route %s\n", text);
+			exit(1);
+		}
+	}
+	*routes = agg.routes;
+	routes_set_free(&agg.protected);
+}
+
+static void
+test_step(const char *name, int fd, const char *ifname, bool add, struct route_set *routes, int expected)
+{
+	unsigned int ifindex = if_nametoindex(ifname);
+	unsigned int failed;
+	double start;
+	int count;
+
+	start = bench_now();
+	if (!netlink_route_batch(fd, ifname, 0, add, routes, &failed)) {
+		log_err("%s: netlink_route_batch() failed\n", name);
+		exit(1);
+	}
+	if (failed) {
+		log_err("%s: %u routes failed\n", name, failed);
+		exit(1);
+	}
+	log_info("%s: %u routes in %.3fs\n", name, routes->count, bench_now() - start);
+
+	count = test_count_routes(AF_INET, ifindex) + test_count_routes(AF_INET6, ifindex);
+	if (count != expected) {
+		log_err("%s: %d routes via %s, expected %d\n", name, count, ifname, expected);
+		exit(1);
+	}
+}
+
+/* from routes installed to next installed, only the difference */
+static void
+test_update(int fd, const char *ifname, struct route_set *routes, struct route_set *next)
+{
+	struct route_set added;
+	struct route_set removed;
+
+	memset(&added, 0, sizeof(added));
+	memset(&removed, 0, sizeof(removed));
+	if (!routes_diff(routes, next, &added, &removed)) {
+		log_err("update: routes_diff() failed\n");
+		exit(1);
+	}
+	if ((added.count != next->count / 2) || (removed.count != routes->count / 2)) {
+		log_err("update: %u added, %u removed, expected %u each\n",
+			added.count, removed.count, routes->count / 2);
+		exit(1);
+	}
+
+	test_step("update, delete", fd, ifname, false, &removed, routes->count - removed.count);
+	test_step("update, add", fd, ifname, true, &added, next->count);
+
+	routes_set_free(&added);
+	routes_set_free(&removed);
+}
+
+int
+main (int argc,char *argv[])
+{
+	struct route_set routes;
+	struct route_set next;
+	unsigned int count = 4000;
+	int fd;
+
+	log_init(&argc, &argv, LOG_PID, LOG_DAEMON);
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <interface> [routes]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 2) {
+		count = atoi(argv[2]);
+	}
+	/* the update replaces half of them */
+	count &= ~1U;
+	if (!netlink_link_is_up(argv[1])) {
+		log_err("interface %s does not exist or is down\n", argv[1]);
+		exit(1);
+	}
+
+	fd = netlink_open(false);
+	if (fd == -1) {
+		exit(1);
+	}
+	test_make_routes(&routes, 0, count);
+	test_make_routes(&next, count / 2, count);
+
+	test_step("add", fd, argv[1], true, &routes, count);
+	test_step("add again", fd, argv[1], true, &routes, count);
+	test_update(fd, argv[1], &routes, &next);
+	test_step("delete", fd, argv[1], false, &next, 0);
+	test_step("delete again", fd, argv[1], false, &next, 0);
+
+	routes_set_free(&routes);
+	routes_set_free(&next);
+	close(fd);
+
+	log_info("test_netlink finished.\n");
+	return 0;
+}
+
+#else
+
+int
+main (int argc,char *argv[])
+{
+	fprintf(stderr, "netlink is only available on linux\n");
+	return 0;
+}
+
+#endif
@@ -1,45 +1,118 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <errno.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
 
 #include "chaosvpn.h"
 
-static bool tinc_add_subnet(struct string*, struct list_head*);
+static bool tinc_add_subnet(struct string*, struct subnet_array*);
 
 #define CONCAT(buffer, value)	if (!string_concat(buffer, value)) return false
 #define CONCAT_F(buffer, format, value)	if (!string_concat_sprintf(buffer, format, value)) return false
 #define CONCAT_DF(buffer, format, value, default_value)	if (!string_concat_sprintf(buffer, format, str_is_nonempty(value) ? value : default_value)) return false
 #define CONCAT_YN(buffer, format, value)    if (!string_concat_sprintf(buffer, format, (value ? "yes" : "no"))) return false
 #define CONCAT_SN(buffer, value)	if (!tinc_add_subnet(buffer, value)) return false
+#define CONCAT_T(buffer, id, args...)	if (!tinc_render(buffer, id , ## args)) return false
+
+/* fixed output formats, compiled once per process */
+enum {
+	TINC_TEMPLATE_ADDRESS,
+	TINC_TEMPLATE_PEER,
+	TINC_TEMPLATE_SUBNET,
+	TINC_TEMPLATE_KEY,
+	TINC_TEMPLATE_ED25519,
+	TINC_TEMPLATE_LOGGER_UP,
+	TINC_TEMPLATE_LOGGER_DOWN,
+	TINC_TEMPLATE_COUNT
+};
+
+static const char *tinc_template_formats[TINC_TEMPLATE_COUNT] = {
+	"Address=%s\n",
+	"Cipher=%s\nCompression=%s\nDigest=%s\nIndirectData=%s\nPort=%d\n",
+	"Subnet=%s\n",
+	"TCPonly=%s\n%s\n\n",
+	"Ed25519PublicKey=%s\n",
+	"logger -t \"tinc.$NETNAME.subnet-up\" -p daemon.debug \"subnet-up from $NODE for %s $SUBNET ($REMOTEADDRESS:$REMOTEPORT)%s\" 2>/dev/null\n",
+	"logger -t \"tinc.$NETNAME.subnet-down\" -p daemon.debug \"subnet-down from $NODE for %s $SUBNET ($REMOTEADDRESS:$REMOTEPORT)%s\" 2>/dev/null\n",
+};
+
+static struct string_template tinc_templates[TINC_TEMPLATE_COUNT];
+static bool tinc_templates_compiled = false;
+
+static void
+tinc_compile_templates(void)
+{
+	int t;
+
+	if (tinc_templates_compiled) {
+		return;
+	}
+	for (t = 0; t < TINC_TEMPLATE_COUNT; t++) {
+		if (!string_template_compile(&tinc_templates[t], tinc_template_formats[t])) {
+			log_err("unable to compile output template %d", t);
+			exit(1);
+		}
+	}
+	tinc_templates_compiled = true;
+}
 
 static bool
-tinc_check_if_excluded(struct config *config, char *peername)
+tinc_render(struct string *buffer, int id, ...)
 {
-	struct list_head* ptr;
-	struct settings_list* etr;
+	va_list args;
+	bool res;
 
-	if (config->exclude == NULL) {
-		return false;
+	tinc_compile_templates();
+
+	va_start(args, id);
+	res = string_template_vrender(buffer, &tinc_templates[id], args);
+	va_end(args);
+
+	return res;
+}
+
+/* compile a user supplied route command, which takes at most the subnet */
+static bool
+tinc_compile_routecmd(struct string_template *tmpl, const char *routecmd)
+{
+	memset(tmpl, 0, sizeof(struct string_template));
+	if (!str_is_nonempty(routecmd)) {
+		return true;
 	}
 
-	list_for_each(ptr, &config->exclude->list) {
-		etr = list_entry(ptr, struct settings_list, list);
-		if (etr->e->etype != LIST_STRING) {
-			/* only strings allowed */
-			continue;
-		}
-		if (strcasecmp(etr->e->evalue.s, peername) == 0) {
-			return true;
-		}
+	if (!string_template_compile(tmpl, routecmd)) {
+		log_err("invalid format in route command '%s'", routecmd);
+		return false;
 	}
-	
-	return false;
+	if (tmpl->nargs > 1) {
+		log_err("route command '%s' uses more than one argument", routecmd);
+		string_template_free(tmpl);
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+tinc_check_if_excluded(struct config *config, char *peername)
+{
+	return name_index_lookup(&config->exclude_index, peername) != NULL;
+}
+
+/* where the files are generated, during an update a staging directory */
+static const char *
+tinc_output_path(struct config *config)
+{
+	return config->output_path ? config->output_path : config->base_path;
 }
 
 static bool
@@ -48,20 +121,20 @@ tinc_generate_peer_config(struct config *config, struct string* buffer, struct p
 	CONCAT(buffer, COMMENT "this is an autogenerated file - do not edit!\n\n");
 
 	if (str_is_nonempty(peer->gatewayhost) && !peer->hidden) {
-		CONCAT_F(buffer, "Address=%s\n", peer->gatewayhost);
+		CONCAT_T(buffer, TINC_TEMPLATE_ADDRESS, peer->gatewayhost);
 	}
 
-	CONCAT_DF(buffer, "Cipher=%s\n", peer->cipher, TINC_DEFAULT_CIPHER);
-	CONCAT_DF(buffer, "Compression=%s\n", peer->compression, TINC_DEFAULT_COMPRESSION);
-	CONCAT_DF(buffer, "Digest=%s\n", peer->digest, TINC_DEFAULT_DIGEST);
-	CONCAT_YN(buffer, "IndirectData=%s\n", peer->indirectdata);
-	CONCAT_F(buffer, "Port=%d\n", peer->port);
+	CONCAT_T(buffer, TINC_TEMPLATE_PEER,
+		str_is_nonempty(peer->cipher) ? peer->cipher : TINC_DEFAULT_CIPHER,
+		str_is_nonempty(peer->compression) ? peer->compression : TINC_DEFAULT_COMPRESSION,
+		str_is_nonempty(peer->digest) ? peer->digest : TINC_DEFAULT_DIGEST,
+		peer->indirectdata ? "yes" : "no",
+		peer->port);
 
 	CONCAT_SN(buffer, &peer->network);
 	CONCAT_SN(buffer, &peer->network6);
 
-	CONCAT_YN(buffer, "TCPonly=%s\n", peer->use_tcp_only);
-	CONCAT_F(buffer, "%s\n\n", peer->key);
+	CONCAT_T(buffer, TINC_TEMPLATE_KEY, peer->use_tcp_only ? "yes" : "no", peer->key);
 
 	if (strnatcmp(config->tincd_version, "1.1") > 0) {
 	        /* write Ed25519 public key only for tinc 1.1+ */
@@ -77,7 +150,7 @@ tinc_generate_peer_config(struct config *config, struct string* buffer, struct p
 	                /* for other nodes include Ed25519 public key */
 	                /* if specified in central config */
         	        if (str_is_nonempty(peer->ed25519publickey)) {
-                	        CONCAT_F(buffer, "Ed25519PublicKey=%s\n", peer->ed25519publickey);
+                	        CONCAT_T(buffer, TINC_TEMPLATE_ED25519, peer->ed25519publickey);
                         }
                 }
         }
@@ -85,48 +158,302 @@ tinc_generate_peer_config(struct config *config, struct string* buffer, struct p
 	return true;
 }
 
+/* fs_prune_dir() callback, ctx is the name_index of the written files */
+static bool
+tinc_keep_host_file(void *ctx, const char *name)
+{
+	return name_index_lookup(ctx, name) != NULL;
+}
+
+/* true if the file at path has exactly contents */
+static bool
+tinc_host_file_equals(const char *path, struct string *contents, struct string *existing)
+{
+	string_clear(existing);
+	return fs_read_file(existing, (char *)path) &&
+		(string_length(existing) == string_length(contents)) &&
+		!memcmp(string_get(existing), string_get(contents), string_length(contents));
+}
+
+/* the host files on disk are unknown, e.g. a staged update was discarded */
+void
+tinc_forget_hosts(struct config *config)
+{
+	name_index_clear(&config->host_files);
+	arena_free(&config->host_files_arena);
+}
+
+/* one share of the nodes for tinc_write_hosts(), for one thread */
+struct tinc_hosts_job {
+	struct config *config;
+	const char *dir;		/* hosts/ with a trailing slash */
+	struct peer_config **peers;	/* NULL: a later node has the same name */
+	struct host_file *files;
+	unsigned int first;
+	unsigned int end;
+	unsigned int written;
+	unsigned int unchanged;
+	bool failed;			/* a host file could not be written */
+	bool ok;
+};
+
+/* result of one host file from the batch writer */
+static void
+tinc_host_file_written(void *ctx, const char *fn, int error)
+{
+	struct tinc_hosts_job *job = ctx;
+	char reason[128];
+
+	if (error) {
+		/* called from the worker threads, no strerror() */
+#ifndef WIN32
+		if (strerror_r(error, reason, sizeof(reason)) != 0) {
+			snprintf(reason, sizeof(reason), "error %d", error);
+		}
+#else
+		snprintf(reason, sizeof(reason), "%s", strerror(error));
+#endif
+		log_err("unable to write host config file %s: %s", fn, reason);
+		job->failed = true;
+		return;
+	}
+	job->written++;
+}
+
+/* generates, compares and writes the host files from first to end */
+static void *
+tinc_write_hosts_job(void *arg)
+{
+	struct tinc_hosts_job *job = arg;
+	struct string hostfilepath;
+	struct string peer_config;
+	struct string existing;
+	struct fs_batch batch;
+	struct host_file *file;
+	struct host_file *cached;
+	size_t dirlen;
+	unsigned int n;
+
+	job->ok = false;
+	string_init(&hostfilepath, 512, 512);
+	string_concat(&hostfilepath, job->dir);
+	dirlen = string_length(&hostfilepath);
+
+	string_lazyinit(&existing, 2048);
+	/* the whole hosts/ generation is synced once when it is swapped in */
+	fs_batch_init(&batch, false, tinc_host_file_written, job);
+	/* one buffer for all peers, it grows to the largest host file */
+	if (!string_init(&peer_config, 2048, STRING_GROWBY_DOUBLE)) goto bail_out;
+
+	for (n = job->first; n < job->end; n++) {
+		if (job->peers[n] == NULL) {
+			continue;
+		}
+		file = &job->files[n];
+
+		string_clear(&peer_config);
+		if (!tinc_generate_peer_config(job->config, &peer_config, job->peers[n]) ||
+				!crypto_digest_buffer(string_get(&peer_config), string_length(&peer_config), file->digest)) {
+			goto bail_out;
+		}
+
+		hostfilepath.length = dirlen;
+		if (!string_concat(&hostfilepath, file->name) || !string_ensurez(&hostfilepath)) {
+			goto bail_out;
+		}
+
+		cached = name_index_lookup(&job->config->host_files, file->name);
+		if (cached ? !memcmp(cached->digest, file->digest, CRYPTO_DIGEST_LENGTH) :
+				tinc_host_file_equals(string_get(&hostfilepath), &peer_config, &existing)) {
+			job->unchanged++;
+			continue;
+		}
+
+		log_debug("Writing config file for peer %s", job->peers[n]->name);
+		if (!fs_batch_add(&batch, string_get(&hostfilepath), string_get(&peer_config),
+				string_length(&peer_config), 0600) || job->failed) {
+			goto bail_out;
+		}
+	}
+	job->ok = fs_batch_flush(&batch) && !job->failed;
+
+bail_out:
+	fs_batch_free(&batch);
+	string_free(&existing);
+	string_free(&peer_config);
+	string_free(&hostfilepath);
+	return NULL;
+}
+
+/* splits the nodes into $generation_threads jobs and runs them */
+static bool
+tinc_run_hosts_jobs(struct tinc_hosts_job *jobs, unsigned int count)
+{
+	unsigned int threads = jobs[0].config->generation_threads;
+	unsigned int t;
+	bool res = true;
+#ifndef WIN32
+	pthread_t thread[TINC_MAX_THREADS];
+	bool started[TINC_MAX_THREADS];
+#endif
+#ifdef _SC_NPROCESSORS_ONLN
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* more threads than cores only fight over the hosts/ directory */
+	if ((cpus > 0) && (threads > (unsigned long)cpus)) {
+		threads = cpus;
+	}
+#endif
+
+	if ((threads < 1) || (threads > count)) {
+		threads = count ? count : 1;
+	}
+	for (t = 0; t < threads; t++) {
+		jobs[t] = jobs[0];
+		jobs[t].first = count * t / threads;
+		jobs[t].end = count * (t + 1) / threads;
+	}
+
+#ifndef WIN32
+	/* the calling thread takes the first share itself */
+	for (t = 1; t < threads; t++) {
+		started[t] = pthread_create(&thread[t], NULL, tinc_write_hosts_job, &jobs[t]) == 0;
+		if (!started[t]) {
+			tinc_write_hosts_job(&jobs[t]);
+		}
+	}
+	tinc_write_hosts_job(&jobs[0]);
+	for (t = 1; t < threads; t++) {
+		if (started[t]) {
+			(void)pthread_join(thread[t], NULL);
+		}
+	}
+#else
+	for (t = 0; t < threads; t++) {
+		tinc_write_hosts_job(&jobs[t]);
+	}
+#endif
+
+	for (t = 1; t < threads; t++) {
+		jobs[0].written += jobs[t].written;
+		jobs[0].unchanged += jobs[t].unchanged;
+		res = res && jobs[t].ok;
+	}
+	return res && jobs[0].ok;
+}
+
+/*
+ * Writes only host files whose contents changed, and removes the files
+ * of nodes that are gone. What was written is remembered by digest in
+ * config->host_files; without an entry there (first run) the file on
+ * disk is compared instead. With $generation_threads the nodes are
+ * split into that many consecutive shares, each generated and written
+ * by its own thread; the files are the same either way. Changed files
+ * are queued in a batch per thread, see fs_batch_add().
+ */
 bool
 tinc_write_hosts(struct config *config)
 {
 	struct list_head *p = NULL;
 	struct string hostfilepath;
+	struct name_index written;
+	struct arena arena;
+	struct tinc_hosts_job jobs[TINC_MAX_THREADS];
+	struct peer_config **peers = NULL;
+	struct host_file *files;
+	struct host_file *prev;
+	unsigned int count = 0;
+	unsigned int n;
+	char *c;
+	unsigned int removed = 0;
+	bool res = false;
 
 	string_init(&hostfilepath, 512, 512);
-	string_concat(&hostfilepath, config->base_path);
+	string_concat(&hostfilepath, tinc_output_path(config));
 	string_concat(&hostfilepath, "/hosts/");
 	string_ensurez(&hostfilepath);
 
 	fs_mkdir_p(string_get(&hostfilepath), 0700);
 
-	list_for_each(p, &config->peer_config) {
-		struct string peer_config;
-		struct peer_config_list *i = container_of(p, 
-				struct peer_config_list, list);
+	/* templates are compiled before any thread renders them */
+	tinc_compile_templates();
 
-		log_debug("Writing config file for peer %s", i->peer_config->name);
-		(void)fflush(stdout);
+	name_index_init(&written);
+	arena_init(&arena, 64 * 1024);
 
-		if (!string_init(&peer_config, 2048, 512)) return false;
+	list_for_each(p, &config->peer_config) {
+		count++;
+	}
+	peers = malloc((count ? count : 1) * sizeof(struct peer_config *));
+	files = arena_alloc(&arena, (count ? count : 1) * sizeof(struct host_file));
+	if ((peers == NULL) || (files == NULL)) {
+		log_err("tinc_write_hosts: malloc error");
+		goto bail_out;
+	}
 
-		if (!tinc_generate_peer_config(config, &peer_config, i->peer_config)) {
-			string_free(&peer_config);
-			return false;
+	/* names and the index are set up here, the jobs only fill in */
+	/* the digests */
+	n = 0;
+	list_for_each(p, &config->peer_config) {
+		peers[n] = container_of(p, struct peer_config_list, list)->peer_config;
+
+		files[n].name = arena_strdup(&arena, peers[n]->name);
+		if (files[n].name == NULL) {
+			log_err("tinc_write_hosts: malloc error");
+			goto bail_out;
+		}
+		/* no directories in hosts/ */
+		for (c = files[n].name; *c; c++) {
+			if (*c == '/') *c = '_';
 		}
 
-		if (!fs_writecontents_safe(string_get(&hostfilepath), 
-				i->peer_config->name, string_get(&peer_config),
-				string_length(&peer_config), 0600)) {
-			log_err("unable to write host config file %s/%s.", string_get(&hostfilepath), i->peer_config->name);
-			string_free(&peer_config);
-			return false;
+		/* the last node of a name wins, as if written one after the other */
+		prev = name_index_lookup(&written, files[n].name);
+		if (prev != NULL) {
+			peers[prev - files] = NULL;
 		}
+		if (!name_index_add(&written, files[n].name, &files[n])) {
+			goto bail_out;
+		}
+		n++;
+	}
+
+	memset(&jobs[0], 0, sizeof(struct tinc_hosts_job));
+	jobs[0].config = config;
+	jobs[0].dir = string_get(&hostfilepath);
+	jobs[0].peers = peers;
+	jobs[0].files = files;
+	if (!tinc_run_hosts_jobs(jobs, count)) {
+		goto bail_out;
+	}
 
-		string_free(&peer_config);
+	if (!fs_prune_dir(string_get(&hostfilepath), tinc_keep_host_file, &written, &removed)) {
+		log_err("unable to remove old host config files from %s.", string_get(&hostfilepath));
+		goto bail_out;
 	}
 
+	log_info("hosts/: %u written, %u unchanged, %u removed.", jobs[0].written, jobs[0].unchanged, removed);
+
+	/* what is on disk now */
+	name_index_free(&config->host_files);
+	arena_free(&config->host_files_arena);
+	config->host_files = written;
+	config->host_files_arena = arena;
+	name_index_init(&written);
+	arena_init(&arena, 64 * 1024);
+	res = true;
+
+bail_out:
+	if (!res) {
+		/* the disk is partly updated, compare with the files next time */
+		tinc_forget_hosts(config);
+	}
+	free(peers);
+	name_index_free(&written);
+	arena_free(&arena);
 	string_free(&hostfilepath);
 	
-	return true;
+	return res;
 }
 
 bool
@@ -135,6 +462,7 @@ tinc_write_config(struct config *config)
 	struct list_head *p;
 	struct string configfilename;
 	struct string buffer;
+	unsigned char digest[CRYPTO_DIGEST_LENGTH];
 
 	log_debug("Writing global config file.");
 
@@ -196,6 +524,19 @@ tinc_write_config(struct config *config)
 	if (str_is_nonempty(config->tincd_raw_config)) {
 		CONCAT_F(&buffer, "%s\n", config->tincd_raw_config);
 	}
+
+	/* tincd rereads its ConnectTo lines on SIGHUP, everything above */
+	/* needs a restart to change */
+	if (!crypto_digest_buffer(string_get(&buffer), string_length(&buffer), digest)) {
+		string_free(&buffer);
+		return false;
+	}
+	if (!config->have_tincconf_digest ||
+			memcmp(config->tincconf_digest, digest, CRYPTO_DIGEST_LENGTH)) {
+		config->tincd_restart_needed = true;
+	}
+	memcpy(config->tincconf_digest, digest, CRYPTO_DIGEST_LENGTH);
+	config->have_tincconf_digest = true;
 	
 	if (!config->my_peer->silent) {
 	        /* Only Non-Silent nodes have ConnectTo lines */
@@ -233,11 +574,11 @@ tinc_write_config(struct config *config)
 	/* write tinc.conf */
 
 	string_init(&configfilename, 512, 512);
-	string_concat(&configfilename, config->base_path);
+	string_concat(&configfilename, tinc_output_path(config));
 	string_concat(&configfilename, "/tinc.conf");
 	string_ensurez(&configfilename);
 
-	if (!fs_writecontents(string_get(&configfilename), string_get(&buffer),
+	if (!fs_replacecontents(string_get(&configfilename), string_get(&buffer),
 			string_length(&buffer), 0600)) {
 		log_err("unable to write tinc config file!");
 		string_free(&buffer);
@@ -251,6 +592,169 @@ tinc_write_config(struct config *config)
 	return true;
 }
 
+/* one route command per subnet, classified without parsing again */
+/* with agg, installed subnets are collected there; aggregated ones are */
+/* commented out, the netlink backend has no commands, only the subnets */
+static bool
+tinc_add_routes(struct config *config, struct string *buffer, struct string_template *routecmd, struct subnet_array *network, struct route_aggregate *agg)
+{
+	struct addr_subnet *subnet;
+	unsigned int n;
+
+	for (n = 0; n < network->count; n++) {
+		subnet = &network->subnet[n];
+
+		if (addrmask_trie_covering(&config->mergeroutes_trie, subnet)) {
+			CONCAT(buffer, COMMENT "*merged* ");
+		} else if (addrmask_trie_covering(&config->ignore_trie, subnet)) {
+			CONCAT(buffer, COMMENT "*ignored* ");
+		} else if (config->whitelist_subnets &&
+				!addrmask_trie_covering(&config->whitelist_trie, subnet)) {
+			CONCAT(buffer, COMMENT "*not whitelisted, ignored* ");
+		} else if (agg) {
+			if (!routes_add(agg, subnet)) return false;
+			if (config->netlink_routes) {
+				CONCAT(buffer, COMMENT "*netlink* ");
+			} else if (config->auto_aggregate_routes) {
+				CONCAT(buffer, COMMENT "*aggregated* ");
+			}
+		}
+
+		if (config->netlink_routes) {
+			CONCAT(buffer, subnet->address);
+		} else if (!string_template_render(buffer, routecmd, subnet->address)) {
+			return false;
+		}
+		CONCAT(buffer, "\n");
+	}
+
+	return true;
+}
+
+/* subnets of a peer whose traffic must not go into an aggregate */
+static bool
+tinc_protect_routes(struct route_aggregate *agg, struct peer_config *peer)
+{
+	unsigned int n;
+
+	for (n = 0; n < peer->network.count; n++) {
+		if (!routes_protect(agg, &peer->network.subnet[n])) return false;
+	}
+	for (n = 0; n < peer->network6.count; n++) {
+		if (!routes_protect(agg, &peer->network6.subnet[n])) return false;
+	}
+	return true;
+}
+
+/* the routes file in the config directory dir */
+bool
+tinc_routes_filename(const char *dir, struct string *filename)
+{
+	if (!string_init(filename, 512, 512)) return false;
+	if (!string_concat(filename, dir) ||
+			!string_concat(filename, "/" ROUTES_FILE) ||
+			!string_ensurez(filename)) {
+		string_free(filename);
+		return false;
+	}
+	return true;
+}
+
+/* one command per route, for routes without a command nothing */
+static bool
+tinc_render_route_set(struct string *buffer, const struct route_set *routes, struct string_template *route4, struct string_template *route6)
+{
+	const struct addr_subnet *route;
+	struct string_template *routecmd;
+	struct string address;
+	unsigned int n;
+	bool res = true;
+
+	string_init(&address, 64, 64);
+	for (n = 0; n < routes->count; n++) {
+		route = &routes->prefix[n];
+		routecmd = route->addr_family == AF_INET6 ? route6 : route4;
+		if (!routecmd->count) {
+			continue;
+		}
+
+		string_clear(&address);
+		if (!routes_format(&address, route) || !string_ensurez(&address) ||
+				!string_template_render(buffer, routecmd, string_get(&address)) ||
+				!string_putc(buffer, '\n')) {
+			res = false;
+			break;
+		}
+	}
+	string_free(&address);
+
+	return res;
+}
+
+/* $routeadd or $routedel commands for routes, as a shell script */
+bool
+tinc_render_routes(struct config *config, struct string *buffer, const struct route_set *routes, bool add)
+{
+	struct string_template route4;
+	struct string_template route6;
+	bool res;
+
+	if (!tinc_compile_routecmd(&route4, add ? config->routeadd : config->routedel)) return false;
+	if (!tinc_compile_routecmd(&route6, add ? config->routeadd6 : config->routedel6)) {
+		string_template_free(&route4);
+		return false;
+	}
+
+	res = tinc_render_route_set(buffer, routes, &route4, &route6);
+
+	string_template_free(&route4);
+	string_template_free(&route6);
+	return res;
+}
+
+/* routes collected by tinc_add_routes(), aggregated if enabled, then */
+/* written as commands or handed to the netlink backend in the handler; */
+/* with up, everything installed (plus the supernets) goes to the */
+/* routes file, the handler diffs it against the previous one on updates */
+static bool
+tinc_add_collected_routes(struct config *config, struct string *buffer, struct route_aggregate *agg, struct route_set *supernets, struct string_template *route4, struct string_template *route6, bool up)
+{
+	struct string filename;
+	unsigned int n;
+	bool res;
+
+	if (config->auto_aggregate_routes) {
+		routes_aggregate(agg);
+
+		if (up) {
+			log_info("auto_aggregate_routes: %u subnets installed as %u routes, %u saved",
+				agg->subnets, agg->routes.count, agg->subnets - agg->routes.count);
+		}
+
+		if (!string_concat_sprintf(buffer, "\n" COMMENT "Aggregated routes: %u subnets as %u routes, %u saved\n",
+				agg->subnets, agg->routes.count, agg->subnets - agg->routes.count)) return false;
+	}
+
+	if (config->netlink_routes) {
+		if (!string_concat_sprintf(buffer, "\n" COMMENT "%u routes are %s by chaosvpn via netlink\n",
+				agg->routes.count, up ? "installed" : "removed")) return false;
+	} else if (config->auto_aggregate_routes) {
+		if (!tinc_render_route_set(buffer, &agg->routes, route4, route6)) return false;
+	}
+
+	if (!up) {
+		return true;
+	}
+
+	for (n = 0; n < supernets->count; n++) {
+		if (!routes_set_add(&agg->routes, &supernets->prefix[n])) return false;
+	}
+	if (!tinc_routes_filename(tinc_output_path(config), &filename)) return false;
+	res = routes_save(&agg->routes, string_get(&filename));
+	string_free(&filename);
+	return res;
+}
+
 bool
 tinc_write_updown(struct config *config, bool up)
 {
@@ -258,16 +762,24 @@ tinc_write_updown(struct config *config, bool up)
 	/* up == false: generate tinc-down */
 
 	struct list_head *p;
-	struct list_head *sp;
 	struct peer_config_list *i;
-	struct string_list *si;
 	struct string buffer;
 	struct string filepath;
-	const char *routecmd;
-	char *subnet;
-	char *weight;
+	struct string_template route4;
+	struct string_template route6;
+	struct string_template *routecmd;
+	struct route_aggregate agg;
+	struct route_aggregate *aggregate = NULL;
+	struct route_set supernets;
 	bool res = true;
 
+	/* route commands are rendered once per subnet, compile them first */
+	if (!tinc_compile_routecmd(&route4, up ? config->routeadd : config->routedel)) return false;
+	if (!tinc_compile_routecmd(&route6, up ? config->routeadd6 : config->routedel6)) {
+		string_template_free(&route4);
+		return false;
+	}
+
 	/* generate contents */
 
 	string_init(&buffer, 8192, 2048);
@@ -288,8 +800,21 @@ tinc_write_updown(struct config *config, bool up)
 		CONCAT(&buffer, "\n");
 	}
 
+	/* installed routes are collected, for aggregation, for the netlink */
+	/* backend and for the routes file */
+	memset(&supernets, 0, sizeof(supernets));
+	if (!config->use_dynamic_routes) {
+		routes_init(&agg);
+		aggregate = &agg;
+		if (config->auto_aggregate_routes) {
+			if (!routes_protect_list(aggregate, config->ignore_subnets)) return false;
+			if (config->my_peer && !tinc_protect_routes(aggregate, config->my_peer)) return false;
+		}
+	}
+
 	if (config->mergeroutes_supernet) {
 		struct addr_info *net = config->mergeroutes_supernet;
+		struct addr_subnet subnet;
 		struct string outputaddr;
 		char *vpnip;
 
@@ -298,23 +823,26 @@ tinc_write_updown(struct config *config, bool up)
 		while (net) {
 			if (net->addr_family == AF_INET) {
 				vpnip = config->vpn_ip;
-				if (up)
-					routecmd = config->routeadd;
-				else
-					routecmd = config->routedel;
+				routecmd = &route4;
 			} else {
 				vpnip = config->vpn_ip6;
-				if (up)
-					routecmd = config->routeadd6;
-				else
-					routecmd = config->routedel6;
+				routecmd = &route6;
 			}
 			string_init(&outputaddr, 128, 128);
-			if (str_is_nonempty(vpnip) && str_is_nonempty(routecmd) &&
+			if (str_is_nonempty(vpnip) && (routecmd->count || config->netlink_routes) &&
 				(addrmask_to_string(&outputaddr, net))
 			  ) {
 			  	string_ensurez(&outputaddr);
-				CONCAT_F(&buffer, routecmd, string_get(&outputaddr));
+				routes_subnet_from_info(&subnet, net);
+				if (config->netlink_routes) {
+					if (!routes_add(aggregate, &subnet)) return false;
+					CONCAT(&buffer, COMMENT "*netlink* ");
+					CONCAT(&buffer, string_get(&outputaddr));
+				} else {
+					if (!string_template_render(&buffer, routecmd, string_get(&outputaddr))) return false;
+					/* never aggregated, only recorded */
+					if (aggregate && !routes_set_add(&supernets, &subnet)) return false;
+				}
 				CONCAT(&buffer, "\n");
 			}
 
@@ -328,10 +856,6 @@ tinc_write_updown(struct config *config, bool up)
 	if (!config->use_dynamic_routes) {
 		/* setup / remove all routes unless using dynamic routes */
 
-		struct addr_info *merge_found;
-		struct addr_info *ignore_found;
-		struct addr_info *whitelist_found;
-
 		list_for_each(p, &config->peer_config) {
 			i = container_of(p, struct peer_config_list, list);
 
@@ -341,71 +865,23 @@ tinc_write_updown(struct config *config, bool up)
 
 			if (tinc_check_if_excluded(config, i->peer_config->name)) {
 				CONCAT_F(&buffer, COMMENT "excluded node: %s\n", i->peer_config->name);
+				if (config->auto_aggregate_routes && !tinc_protect_routes(aggregate, i->peer_config)) return false;
 				continue;
 			}
 
 			CONCAT_F(&buffer, COMMENT "node: %s\n", i->peer_config->name);
 
-			if (up)
-				routecmd = config->routeadd;
-			else
-				routecmd = config->routedel;
-			if (str_is_nonempty(config->vpn_ip) && str_is_nonempty(routecmd)) {
-				list_for_each(sp, &i->peer_config->network) {
-					si = container_of(sp, struct string_list, list);
-					subnet = strdup(si->text);
-					weight = strchr(subnet, '#');
-					if (weight)
-						*weight++ = 0;
-
-					merge_found = addrmask_match(config->mergeroutes_supernet, subnet);
-					ignore_found = addrmask_match(config->ignore_subnets, subnet);
-					whitelist_found = addrmask_match(config->whitelist_subnets, subnet);
-					
-					if (merge_found) {
-						CONCAT(&buffer, COMMENT "*merged* ");
-					} else if (ignore_found) {
-						CONCAT(&buffer, COMMENT "*ignored* ");
-					} else if (config->whitelist_subnets && !whitelist_found) {
-						CONCAT(&buffer, COMMENT "*not whitelisted, ignored* ");
-					}
-					
-					CONCAT_F(&buffer, routecmd, subnet);
-					CONCAT(&buffer, "\n");
-					free(subnet);
-				}
+			if (str_is_nonempty(config->vpn_ip) && (route4.count || config->netlink_routes)) {
+				if (!tinc_add_routes(config, &buffer, &route4, &i->peer_config->network, aggregate)) return false;
 			}
-			
-			if (up)
-				routecmd = config->routeadd6;
-			else
-				routecmd = config->routedel6;
-			if (str_is_nonempty(config->vpn_ip6) && str_is_nonempty(routecmd)) {
-				list_for_each(sp, &i->peer_config->network6) {
-					si = container_of(sp, struct string_list, list);
-					subnet = strdup(si->text);
-					weight = strchr(subnet, '#');
-					if (weight)
-						*weight++ = 0;
-
-					merge_found = addrmask_match(config->mergeroutes_supernet, subnet);
-					ignore_found = addrmask_match(config->ignore_subnets, subnet);
-					whitelist_found = addrmask_match(config->whitelist_subnets, subnet);
-
-					if (merge_found) {
-						CONCAT(&buffer, COMMENT "*merged* ");
-					} else if (ignore_found) {
-						CONCAT(&buffer, COMMENT "*ignored* ");
-					} else if (config->whitelist_subnets && !whitelist_found) {
-						CONCAT(&buffer, COMMENT "*not whitelisted, ignored* ");
-					}
-
-					CONCAT_F(&buffer, routecmd, subnet);
-					CONCAT(&buffer, "\n");
-					free(subnet);
-				}
+			if (str_is_nonempty(config->vpn_ip6) && (route6.count || config->netlink_routes)) {
+				if (!tinc_add_routes(config, &buffer, &route6, &i->peer_config->network6, aggregate)) return false;
 			}
 		}
+
+		if (!tinc_add_collected_routes(config, &buffer, aggregate, &supernets, &route4, &route6, up)) return false;
+		routes_free(aggregate);
+		routes_set_free(&supernets);
 	}
 
 
@@ -431,20 +907,22 @@ tinc_write_updown(struct config *config, bool up)
 	/* write contents into file */
 
 	string_init(&filepath, 512, 512);
-	string_concat(&filepath, config->base_path);
+	string_concat(&filepath, tinc_output_path(config));
 	if (up)
 		string_concat(&filepath, "/tinc-up" SCRIPT);
 	else
 		string_concat(&filepath, "/tinc-down" SCRIPT);
         string_ensurez(&filepath);
 
-	if (!fs_writecontents(string_get(&filepath), string_get(&buffer), string_length(&buffer), 0700)) {
+	if (!fs_replacecontents(string_get(&filepath), string_get(&buffer), string_length(&buffer), 0700)) {
 		log_err("unable to write to %s!", string_get(&filepath));
 		res = false;
 	}
 	
 	string_free(&buffer);
 	string_free(&filepath);
+	string_template_free(&route4);
+	string_template_free(&route6);
 
 	return res;
 }
@@ -459,11 +937,11 @@ tinc_write_subnetupdown(struct config *config, bool up)
 	struct string filepath;
 	const char *routecmd;
 	const char *routecmd6;
-	const char *logger;
+	int logger;
 	bool res = true;
 
 	string_init(&filepath, 512, 512);
-	string_concat(&filepath, config->base_path);
+	string_concat(&filepath, tinc_output_path(config));
 	if (up)
 		string_concat(&filepath, "/subnet-up" SCRIPT);
 	else
@@ -488,8 +966,11 @@ tinc_write_subnetupdown(struct config *config, bool up)
                 string_concat_sprintf(&localpath, "%s.local", string_get(&filepath));
                 string_ensurez(&localpath);
 
+                /* relative, the staging directory is renamed when it is */
+                /* swapped in */
                 if (access(string_get(&localpath), X_OK) == 0) {
-                        if (symlink(string_get(&localpath), string_get(&filepath)) != 0) {
+                        if (symlink(up ? "subnet-up" SCRIPT ".local" : "subnet-down" SCRIPT ".local",
+                                        string_get(&filepath)) != 0) {
                                 log_err("Symlink %s -> %s failed: %s",
                                         string_get(&localpath),
                                         string_get(&filepath),
@@ -522,11 +1003,11 @@ tinc_write_subnetupdown(struct config *config, bool up)
 		if (up) {
 			routecmd = config->routeadd;
 			routecmd6 = config->routeadd6;
-			logger = "logger -t \"tinc.$NETNAME.subnet-up\" -p daemon.debug \"subnet-up from $NODE for %s $SUBNET ($REMOTEADDRESS:$REMOTEPORT)%s\" 2>/dev/null\n";
+			logger = TINC_TEMPLATE_LOGGER_UP;
 		} else {
 			routecmd = config->routedel;
 			routecmd6 = config->routedel6;
-			logger = "logger -t \"tinc.$NETNAME.subnet-down\" -p daemon.debug \"subnet-down from $NODE for %s $SUBNET ($REMOTEADDRESS:$REMOTEPORT)%s\" 2>/dev/null\n";
+			logger = TINC_TEMPLATE_LOGGER_DOWN;
 		}
 
 		CONCAT_F(&buffer, "[ \"$NODE\" = '%s' ] && exit 0\n\n", config->peerid);
@@ -562,7 +1043,7 @@ tinc_write_subnetupdown(struct config *config, bool up)
 
 				CONCAT(&buffer, "if [ -n \"$excluded\" ] ; then\n");
 				CONCAT(&buffer, "\t");
-				if (!string_concat_sprintf(&buffer, logger, "ignore", " (excluded)")) return false;
+				CONCAT_T(&buffer, logger, "ignore", " (excluded)");
 				CONCAT(&buffer, "\t[ -x \"$0.local\" ] && \"$0.local\" \"$@\"\n");
 				CONCAT(&buffer, "\texit 0\n");
 				CONCAT(&buffer, "fi\n\n");
@@ -572,7 +1053,7 @@ tinc_write_subnetupdown(struct config *config, bool up)
 		if (str_is_nonempty(config->vpn_ip) && str_is_nonempty(routecmd)) {
 			CONCAT(&buffer, "if echo \"$SUBNET\" | grep -q -E '^((25[0-5]|(2[0-4]|1{0,1}[0-9]){0,1}[0-9])\\.){3,3}(25[0-5]|(2[0-4]|1{0,1}[0-9]){0,1}[0-9])(/([0-9]|[12][0-9]|3[012]))?$' ; then\n");
 			CONCAT(&buffer, "\t");
-			if (!string_concat_sprintf(&buffer, logger, "ipv4", "")) return false;
+			CONCAT_T(&buffer, logger, "ipv4", "");
 			
 			CONCAT(&buffer, "\t");
 			CONCAT_F(&buffer, routecmd, "$SUBNET");
@@ -584,7 +1065,7 @@ tinc_write_subnetupdown(struct config *config, bool up)
 		} else {
 			CONCAT(&buffer, "if echo \"$SUBNET\" | grep -q -E '^((25[0-5]|(2[0-4]|1{0,1}[0-9]){0,1}[0-9])\\.){3,3}(25[0-5]|(2[0-4]|1{0,1}[0-9]){0,1}[0-9])(/([0-9]|[12][0-9]|3[012]))?$' ; then\n");
 			CONCAT(&buffer, "\t");
-			if (!string_concat_sprintf(&buffer, logger, "ipv4", " (disabled)")) return false;
+			CONCAT_T(&buffer, logger, "ipv4", " (disabled)");
 			CONCAT(&buffer, "\t[ -x \"$0.local\" ] && \"$0.local\" \"$@\"\n");
 			CONCAT(&buffer, "\texit 0\n");
 
@@ -594,7 +1075,7 @@ tinc_write_subnetupdown(struct config *config, bool up)
 		if (str_is_nonempty(config->vpn_ip6) && str_is_nonempty(routecmd6)) {
 			CONCAT(&buffer, "if echo \"$SUBNET\" | grep -q -E '^(([0-9a-fA-F]{1,4}:){7,7}[0-9a-fA-F]{1,4}|([0-9a-fA-F]{1,4}:){1,7}:|([0-9a-fA-F]{1,4}:){1,6}:[0-9a-fA-F]{1,4}|([0-9a-fA-F]{1,4}:){1,5}(:[0-9a-fA-F]{1,4}){1,2}|([0-9a-fA-F]{1,4}:){1,4}(:[0-9a-fA-F]{1,4}){1,3}|([0-9a-fA-F]{1,4}:){1,3}(:[0-9a-fA-F]{1,4}){1,4}|([0-9a-fA-F]{1,4}:){1,2}(:[0-9a-fA-F]{1,4}){1,5}|[0-9a-fA-F]{1,4}:((:[0-9a-fA-F]{1,4}){1,6})|:((:[0-9a-fA-F]{1,4}){1,7}|:))/([0-9]{1,2}|1[01][0-9]|12[0-8])$' ; then\n");
 			CONCAT(&buffer, "\t");
-			if (!string_concat_sprintf(&buffer, logger, "ipv6", "")) return false;
+			CONCAT_T(&buffer, logger, "ipv6", "");
 
 			CONCAT(&buffer, "\t");
 			CONCAT_F(&buffer, routecmd6, "$SUBNET");
@@ -606,14 +1087,14 @@ tinc_write_subnetupdown(struct config *config, bool up)
 		} else {
 			CONCAT(&buffer, "if echo \"$SUBNET\" | grep -q -E '^(([0-9a-fA-F]{1,4}:){7,7}[0-9a-fA-F]{1,4}|([0-9a-fA-F]{1,4}:){1,7}:|([0-9a-fA-F]{1,4}:){1,6}:[0-9a-fA-F]{1,4}|([0-9a-fA-F]{1,4}:){1,5}(:[0-9a-fA-F]{1,4}){1,2}|([0-9a-fA-F]{1,4}:){1,4}(:[0-9a-fA-F]{1,4}){1,3}|([0-9a-fA-F]{1,4}:){1,3}(:[0-9a-fA-F]{1,4}){1,4}|([0-9a-fA-F]{1,4}:){1,2}(:[0-9a-fA-F]{1,4}){1,5}|[0-9a-fA-F]{1,4}:((:[0-9a-fA-F]{1,4}){1,6})|:((:[0-9a-fA-F]{1,4}){1,7}|:))/([0-9]{1,2}|1[01][0-9]|12[0-8])$' ; then\n");
 			CONCAT(&buffer, "\t");
-			if (!string_concat_sprintf(&buffer, logger, "ipv6", " (disabled)")) return false;
+			CONCAT_T(&buffer, logger, "ipv6", " (disabled)");
 			CONCAT(&buffer, "\t[ -x \"$0.local\" ] && \"$0.local\" \"$@\"\n");
 			CONCAT(&buffer, "\texit 0\n");
 
 			CONCAT(&buffer, "fi\n");
 		}
 
-		if (!string_concat_sprintf(&buffer, logger, "unknown", " (ignored)")) return false;
+		CONCAT_T(&buffer, logger, "unknown", " (ignored)");
 		CONCAT(&buffer, "[ -x \"$0.local\" ] && \"$0.local\" \"$@\"\n");
 		CONCAT(&buffer, "exit 0\n\n");
 	}
@@ -622,7 +1103,7 @@ tinc_write_subnetupdown(struct config *config, bool up)
 	
 	unlink(string_get(&filepath)); /* unlink first, may be a symlink */
 
-	if (!fs_writecontents(string_get(&filepath), string_get(&buffer), string_length(&buffer), 0700)) {
+	if (!fs_replacecontents(string_get(&filepath), string_get(&buffer), string_length(&buffer), 0700)) {
 		log_err("unable to write to %s!\n", string_get(&filepath));
 		res = false;
 	}
@@ -634,13 +1115,12 @@ tinc_write_subnetupdown(struct config *config, bool up)
 }
 
 static bool
-tinc_add_subnet(struct string* buffer, struct list_head *network)
+tinc_add_subnet(struct string* buffer, struct subnet_array *network)
 {
-	struct list_head *p;
+	unsigned int n;
 
-	list_for_each(p, network) {
-		struct string_list *i = container_of(p, struct string_list, list);
-		CONCAT_F(buffer, "Subnet=%s\n", i->text);
+	for (n = 0; n < network->count; n++) {
+		CONCAT_T(buffer, TINC_TEMPLATE_SUBNET, network->subnet[n].text);
 	}
 
 	return true;
@@ -1,57 +1,377 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
 
 #include "chaosvpn.h"
 
-bool
-uncompress_inflate(struct string *compressed, struct string *uncompressed)
+/* minimum growth step of the output string */
+#define UNCOMPRESS_MINSPACE (16 * 1024)
+
+/* upper limit for size hints, the hint is not authenticated */
+#define UNCOMPRESS_MAXHINT (64 * 1024 * 1024)
+
+/*
+ * Output handling shared by all codecs: decoders write directly into the
+ * spare capacity of stream->out.
+ */
+static char *
+uncompress_output_space(struct uncompress_stream *stream, size_t *space)
 {
-    int retval;
-    z_stream strm;
-    unsigned char outbuf[1024];
-    int have;
-
-    /* allocate inflate state */
-    memset(&strm, 0, sizeof(strm)); /* paranoia */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    if (inflateInit(&strm) != Z_OK)
+    struct string *out = stream->out;
+
+    if (out->size == out->length) {
+        /* only grow when full, an exact size hint must not double the */
+        /* buffer; grow geometrically, independent of out->growby */
+        if (!string_reserve(out, out->length > UNCOMPRESS_MINSPACE ?
+                out->length : UNCOMPRESS_MINSPACE)) {
+            return NULL;
+        }
+    }
+
+    *space = out->size - out->length;
+    if (*space > UINT_MAX) {
+        *space = UINT_MAX;
+    }
+    return out->s + out->length;
+}
+
+static bool
+uncompress_output_commit(struct uncompress_stream *stream, size_t have)
+{
+    struct string *out = stream->out;
+
+    if ((have > 0) && (stream->observer != NULL) &&
+            !stream->observer(stream->observerctx, out->s + out->length, have)) {
         return false;
+    }
+    out->length += have;
+    return true;
+}
+
+
+/* zlib, data format v3 default */
+
+static bool
+uncompress_zlib_init(struct uncompress_stream *stream)
+{
+    stream->strm.zalloc = Z_NULL;
+    stream->strm.zfree = Z_NULL;
+    stream->strm.opaque = Z_NULL;
+    stream->strm.avail_in = 0;
+    stream->strm.next_in = Z_NULL;
+    return inflateInit(&stream->strm) == Z_OK;
+}
+
+static bool
+uncompress_zlib_write(struct uncompress_stream *stream, const char *buf, size_t len)
+{
+    char *dst;
+    size_t space;
+    int retval;
+
+    stream->strm.avail_in = len;
+    stream->strm.next_in = (unsigned char*)buf;
 
-    strm.avail_in = string_length(compressed);
-    strm.next_in = (unsigned char*)string_get(compressed);
-    
     do {
-        strm.avail_out = sizeof(outbuf);
-        strm.next_out = outbuf;
-        retval = inflate(&strm, Z_FINISH);
+        dst = uncompress_output_space(stream, &space);
+        if (dst == NULL) {
+            return false;
+        }
+        stream->strm.avail_out = space;
+        stream->strm.next_out = (unsigned char*)dst;
+        retval = inflate(&stream->strm, Z_NO_FLUSH);
         switch (retval) {
-            case Z_STREAM_ERROR:
-                /* state clobbered */
-                return false;
-                break;
             case Z_NEED_DICT:
-                retval = Z_DATA_ERROR; /* and fall through */
+            case Z_STREAM_ERROR:
             case Z_DATA_ERROR:
             case Z_MEM_ERROR:
-                (void)inflateEnd(&strm);
                 return false;
         }
-        
-        have = sizeof(outbuf) - strm.avail_out;
-        string_concatb(uncompressed, (char *)outbuf, have);
-    } while (strm.avail_out == 0);
 
-    (void)inflateEnd(&strm);
+        if (!uncompress_output_commit(stream, space - stream->strm.avail_out)) {
+            return false;
+        }
 
-    if (retval != Z_STREAM_END) {
-        fprintf(stderr, "decompression failed\n");
+        if (retval == Z_STREAM_END) {
+            stream->finished = true;
+            break;
+        }
+    } while ((stream->strm.avail_in > 0) || (stream->strm.avail_out == 0));
+
+    return true;
+}
+
+static void
+uncompress_zlib_end(struct uncompress_stream *stream)
+{
+    (void)inflateEnd(&stream->strm);
+}
+
+
+#ifdef HAVE_ZSTD
+/* zstd */
+
+static bool
+uncompress_zstd_init(struct uncompress_stream *stream)
+{
+    stream->state = ZSTD_createDStream();
+    if (stream->state == NULL) {
+        return false;
+    }
+    return !ZSTD_isError(ZSTD_initDStream(stream->state));
+}
+
+static bool
+uncompress_zstd_write(struct uncompress_stream *stream, const char *buf, size_t len)
+{
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t space;
+    size_t retval;
+
+    in.src = buf;
+    in.size = len;
+    in.pos = 0;
+
+    do {
+        out.dst = uncompress_output_space(stream, &space);
+        if (out.dst == NULL) {
+            return false;
+        }
+        out.size = space;
+        out.pos = 0;
+
+        retval = ZSTD_decompressStream(stream->state, &out, &in);
+        if (ZSTD_isError(retval)) {
+            log_err("zstd: %s\n", ZSTD_getErrorName(retval));
+            return false;
+        }
+        if (!uncompress_output_commit(stream, out.pos)) {
+            return false;
+        }
+
+        if (retval == 0) {
+            /* frame complete */
+            stream->finished = true;
+            break;
+        }
+    } while ((in.pos < in.size) || (out.pos == out.size));
+
+    return true;
+}
+
+static void
+uncompress_zstd_end(struct uncompress_stream *stream)
+{
+    ZSTD_freeDStream(stream->state);
+}
+#endif
+
+
+#ifdef HAVE_LZ4
+/* lz4, frame format */
+
+static bool
+uncompress_lz4_init(struct uncompress_stream *stream)
+{
+    LZ4F_dctx *dctx;
+
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+        return false;
+    }
+    stream->state = dctx;
+    return true;
+}
+
+static bool
+uncompress_lz4_write(struct uncompress_stream *stream, const char *buf, size_t len)
+{
+    char *dst;
+    size_t space;
+    size_t dstsize;
+    size_t srcsize;
+    size_t retval;
+
+    do {
+        dst = uncompress_output_space(stream, &space);
+        if (dst == NULL) {
+            return false;
+        }
+        dstsize = space;
+        srcsize = len;
+
+        retval = LZ4F_decompress(stream->state, dst, &dstsize, buf, &srcsize, NULL);
+        if (LZ4F_isError(retval)) {
+            log_err("lz4: %s\n", LZ4F_getErrorName(retval));
+            return false;
+        }
+        if (!uncompress_output_commit(stream, dstsize)) {
+            return false;
+        }
+        buf += srcsize;
+        len -= srcsize;
+
+        if (retval == 0) {
+            /* frame complete */
+            stream->finished = true;
+            break;
+        }
+    } while ((len > 0) || (dstsize == space));
+
+    return true;
+}
+
+static void
+uncompress_lz4_end(struct uncompress_stream *stream)
+{
+    (void)LZ4F_freeDecompressionContext(stream->state);
+}
+#endif
+
+
+/* supported codecs, the first one is the default */
+static const struct uncompress_codec uncompress_codecs[] = {
+    { "zlib", uncompress_zlib_init, uncompress_zlib_write, uncompress_zlib_end },
+#ifdef HAVE_ZSTD
+    { "zstd", uncompress_zstd_init, uncompress_zstd_write, uncompress_zstd_end },
+#endif
+#ifdef HAVE_LZ4
+    { "lz4", uncompress_lz4_init, uncompress_lz4_write, uncompress_lz4_end },
+#endif
+};
+
+#define UNCOMPRESS_CODECS (sizeof(uncompress_codecs) / sizeof(uncompress_codecs[0]))
+
+/* @returns NULL if name is not supported */
+const struct uncompress_codec *
+uncompress_codec_find(struct string_view *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < UNCOMPRESS_CODECS; i++) {
+        if (string_view_equalsz(name, uncompress_codecs[i].name)) {
+            return &uncompress_codecs[i];
+        }
+    }
+    return NULL;
+}
+
+/* comma separated list of codec names, as advertised to the master */
+bool
+uncompress_codec_list(struct string *list)
+{
+    unsigned int i;
+
+    for (i = 0; i < UNCOMPRESS_CODECS; i++) {
+        if (i && !string_putc(list, ',')) return false;
+        if (!string_concat(list, uncompress_codecs[i].name)) return false;
+    }
+    return true;
+}
+
+/*
+ * Decode into the spare capacity of out, without an intermediate
+ * buffer. codec NULL means zlib. sizehint is the expected uncompressed
+ * size (0 if unknown), it is used to size out up front, afterwards out
+ * grows geometrically. observer, if not NULL, sees every block of
+ * decoded data once.
+ */
+bool
+uncompress_stream_init(struct uncompress_stream *stream, const struct uncompress_codec *codec, struct string *out, size_t sizehint, crypto_sink observer, void *observerctx)
+{
+    memset(stream, 0, sizeof(struct uncompress_stream)); /* paranoia */
+
+    stream->codec = (codec != NULL) ? codec : &uncompress_codecs[0];
+    if (!stream->codec->init(stream)) {
+        stream->initialized = true;
+        uncompress_stream_free(stream);
         return false;
     }
-    
+
+    stream->out = out;
+    stream->observer = observer;
+    stream->observerctx = observerctx;
+    stream->initialized = true;
+
+    if (sizehint > UNCOMPRESS_MAXHINT) {
+        sizehint = UNCOMPRESS_MAXHINT;
+    }
+    /* one byte more, users zero-terminate the result */
+    (void)string_reserve(out, sizehint + 1);
+
     return true;
 }
+
+/*
+ * Feed the next block of compressed data.
+ * Signature compatible with crypto_sink, ctx is a struct uncompress_stream.
+ */
+bool
+uncompress_stream_write(void *ctx, const char *buf, size_t len)
+{
+    struct uncompress_stream *stream = ctx;
+
+    if (stream->finished) {
+        /* trailing data after the end of the stream is ignored */
+        return true;
+    }
+
+    return stream->codec->write(stream, buf, len);
+}
+
+/* @returns true if the complete compressed stream was received */
+bool
+uncompress_stream_finish(struct uncompress_stream *stream)
+{
+    bool finished = stream->finished;
+
+    uncompress_stream_free(stream);
+    if (!finished) {
+        fprintf(stderr, "decompression failed\n");
+    }
+
+    return finished;
+}
+
+void
+uncompress_stream_free(struct uncompress_stream *stream)
+{
+    if (stream->initialized) {
+        stream->codec->end(stream);
+        stream->initialized = false;
+    }
+}
+
+/*
+ * Fused kernel: decrypt ciphertext in cache sized blocks, each block
+ * is decoded right away while it is still hot, directly into out.
+ */
+bool
+uncompress_decrypt_inflate(struct string_view *ciphertext, struct string_view *aes_key, struct string_view *aes_iv, const struct uncompress_codec *codec, struct string *out, size_t sizehint, crypto_sink observer, void *observerctx)
+{
+    struct uncompress_stream stream;
+
+    if (!sizehint) {
+        /* text configs usually compress about 4:1 */
+        sizehint = ciphertext->length * 4;
+    }
+    if (!uncompress_stream_init(&stream, codec, out, sizehint, observer, observerctx)) {
+        log_err("uncompress_decrypt_inflate: inflate init failed\n");
+        return false;
+    }
+
+    if (!crypto_aes_decrypt_stream(ciphertext, aes_key, aes_iv, uncompress_stream_write, &stream)) {
+        uncompress_stream_free(&stream);
+        return false;
+    }
+
+    return uncompress_stream_finish(&stream);
+}